@@ -0,0 +1,590 @@
+#include "bsp.h"
+#include "bsptree.h"
+#include "bvh.h"
+#include "lmap.h"
+#include "mesh.h"
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+// Lightmap packing benchmark: the old per-column skyline against the segment
+// skyline in lmap.c, on the lightmaps of the given maps and on a synthetic set.
+// Then the g-buffer shading: the old AoS loop against shade_g_buffer on SoA
+// planes, on a synthetic page. Last, BSP tree point lookups and BVH ray
+// throughput on the world of the given maps.
+//
+//   ./bench [map.bsp ...]
+
+#define NUM_SYNTHETIC 100000
+#define REPEAT 5
+#define SHADE_SIZE 2048 // texels per side of the synthetic g-buffer page
+#define NUM_RAYS (1 << 20)
+#define NUM_CHECKED 4096 // rays also traced against every triangle
+#define RAY_BATCH 4096   // rays per thread pool task
+#define NUM_POINTS (1 << 20)
+
+struct rect_s {
+  guint w, h;
+};
+
+// The previous packer: one height per atlas column, every column is a
+// candidate position and the block's columns are rescanned for each.
+static gboolean column_pack(guint *skyline, guint atlas_width, guint w,
+                            guint h, guint *x, guint *y) {
+  guint best_x = G_MAXUINT;
+  guint best_y = G_MAXUINT;
+  for (guint cx = 0; cx + w <= atlas_width; cx++) {
+    if (skyline[cx] >= best_y) {
+      continue;
+    }
+    gboolean fits = TRUE;
+    for (guint x2 = cx; x2 < cx + w; x2++) {
+      if (skyline[x2] > skyline[cx]) {
+        fits = FALSE;
+        break;
+      }
+    }
+    if (fits) {
+      best_y = skyline[cx];
+      best_x = cx;
+    }
+  }
+  if (best_x == G_MAXUINT) {
+    return FALSE;
+  }
+  for (guint cx = best_x; cx < best_x + w; cx++) {
+    skyline[cx] = best_y + h;
+  }
+  *x = best_x;
+  *y = best_y;
+  return TRUE;
+}
+
+static guint column_pack_all(const struct rect_s *rects, guint num_rects,
+                             guint atlas_width) {
+  guint *skyline = g_new(guint, atlas_width);
+  for (guint i = 0; i < atlas_width; i++) {
+    skyline[i] = 0;
+  }
+  guint height = 0;
+  for (guint i = 0; i < num_rects; i++) {
+    guint x, y;
+    if (!column_pack(skyline, atlas_width, rects[i].w, rects[i].h, &x, &y)) {
+      height = G_MAXUINT;
+      break;
+    }
+    height = MAX(height, y + rects[i].h);
+  }
+  g_free(skyline);
+  return height;
+}
+
+static guint skyline_pack_all(const struct rect_s *rects, guint num_rects,
+                              guint atlas_width) {
+  struct skyline_s sky;
+  skyline_init(&sky, atlas_width, G_MAXUINT, 0);
+  guint height = 0;
+  for (guint i = 0; i < num_rects; i++) {
+    guint x, y;
+    if (!skyline_pack(&sky, rects[i].w, rects[i].h, &x, &y)) {
+      height = G_MAXUINT;
+      break;
+    }
+    height = MAX(height, y + rects[i].h);
+  }
+  skyline_free(&sky);
+  return height;
+}
+
+static guint rotated_pack_all(const struct rect_s *rects, guint num_rects,
+                              guint atlas_width) {
+  struct skyline_s sky;
+  skyline_init(&sky, atlas_width, G_MAXUINT, 0);
+  guint height = 0;
+  for (guint i = 0; i < num_rects; i++) {
+    guint x, y;
+    gboolean rotated;
+    if (!skyline_pack_rotated(&sky, rects[i].w, rects[i].h, &x, &y,
+                              &rotated)) {
+      height = G_MAXUINT;
+      break;
+    }
+    height = MAX(height, y + (rotated ? rects[i].w : rects[i].h));
+  }
+  skyline_free(&sky);
+  return height;
+}
+
+// Best of REPEAT runs, in milliseconds.
+static gdouble time_packer(guint (*pack)(const struct rect_s *, guint, guint),
+                           const struct rect_s *rects, guint num_rects,
+                           guint atlas_width, guint *height) {
+  gdouble best = G_MAXDOUBLE;
+  GTimer *timer = g_timer_new();
+  for (guint r = 0; r < REPEAT; r++) {
+    g_timer_start(timer);
+    *height = pack(rects, num_rects, atlas_width);
+    g_timer_stop(timer);
+    best = MIN(best, g_timer_elapsed(timer, NULL) * 1000.0);
+  }
+  g_timer_destroy(timer);
+  return best;
+}
+
+static gint compare_rect_fn(gconstpointer a, gconstpointer b,
+                            gpointer user_data) {
+  const struct rect_s *ra = a;
+  const struct rect_s *rb = b;
+  if (ra->h != rb->h) {
+    return ra->h < rb->h ? 1 : -1;
+  }
+  return ra->w < rb->w ? 1 : ra->w > rb->w ? -1 : 0;
+}
+
+// Longer side, then shorter side, as pack_lmaps sorts when rotating.
+static gint compare_rect_rotated_fn(gconstpointer a, gconstpointer b,
+                                    gpointer user_data) {
+  const struct rect_s *ra = a;
+  const struct rect_s *rb = b;
+  guint long_a = MAX(ra->w, ra->h), long_b = MAX(rb->w, rb->h);
+  if (long_a != long_b) {
+    return long_a < long_b ? 1 : -1;
+  }
+  guint short_a = MIN(ra->w, ra->h), short_b = MIN(rb->w, rb->h);
+  return short_a < short_b ? 1 : short_a > short_b ? -1 : 0;
+}
+
+static void print_result(const gchar *packer, guint atlas_width, guint64 area,
+                         guint height, gdouble ms, gdouble baseline_ms) {
+  if (height == G_MAXUINT) {
+    g_print("    %-8s does not fit\n", packer);
+    return;
+  }
+  g_print("    %-8s %6u rows %5.1f%% %9.2f ms %6.1fx\n", packer, height,
+          100.0 * area / ((gdouble)atlas_width * height), ms,
+          baseline_ms / ms);
+}
+
+static void bench_rects(const gchar *name, struct rect_s *rects,
+                        guint num_rects, const guint *widths,
+                        guint num_widths) {
+  struct rect_s *rotated = g_memdup2(rects, num_rects * sizeof(struct rect_s));
+  g_qsort_with_data(rects, num_rects, sizeof(struct rect_s), compare_rect_fn,
+                    NULL);
+  g_qsort_with_data(rotated, num_rects, sizeof(struct rect_s),
+                    compare_rect_rotated_fn, NULL);
+  guint64 area = 0;
+  for (guint i = 0; i < num_rects; i++) {
+    area += rects[i].w * rects[i].h;
+  }
+  g_print("%s: %u rects, %" G_GUINT64_FORMAT " texels\n", name, num_rects,
+          area);
+  for (guint i = 0; i < num_widths; i++) {
+    guint w = widths[i], height;
+    g_print("  %u wide:\n", w);
+    gdouble col_ms = time_packer(column_pack_all, rects, num_rects, w, &height);
+    print_result("column", w, area, height, col_ms, col_ms);
+    gdouble ms = time_packer(skyline_pack_all, rects, num_rects, w, &height);
+    print_result("segment", w, area, height, ms, col_ms);
+    ms = time_packer(rotated_pack_all, rotated, num_rects, w, &height);
+    print_result("rotating", w, area, height, ms, col_ms);
+  }
+  g_free(rotated);
+}
+
+// Computes the lightmap size of every face in the map the same way bsp2obj
+// does.
+static struct rect_s *load_lmap_rects(const gchar *path, guint *num_rects) {
+  gchar *buf;
+  gsize len;
+  GError *err = NULL;
+  if (!g_file_get_contents(path, &buf, &len, &err)) {
+    g_print("%s\n", err->message);
+    g_error_free(err);
+    return NULL;
+  }
+  struct header_s *header = (struct header_s *)buf;
+  struct face_s *faces = (struct face_s *)(buf + header->faces.offset);
+  struct surface_s *surfaces = (struct surface_s *)(buf + header->texinfo.offset);
+  struct edge_s *edges = (struct edge_s *)(buf + header->edges.offset);
+  gint32 *edges_list = (gint32 *)(buf + header->edges_list.offset);
+  struct vec3_s *vertices = (struct vec3_s *)(buf + header->vertices.offset);
+
+  *num_rects = header->faces.size / sizeof(struct face_s);
+  struct rect_s *rects = g_new(struct rect_s, *num_rects);
+  for (guint i = 0; i < *num_rects; i++) {
+    struct face_s *face = &faces[i];
+    struct surface_s *surface = &surfaces[face->texinfo_id];
+    struct lmap_s lm;
+    init_lmap(&lm, i);
+    for (guint j = 0; j < face->ledge_num; j++) {
+      gint32 e = edges_list[face->ledge_id + j];
+      struct edge_s *edge = &edges[ABS(e)];
+      struct vec3_s v = vertices[e < 0 ? edge->vertex1 : edge->vertex0];
+      lmap_addST(&lm, vec3_dot(surface->vectorS, v) + surface->distS,
+                 vec3_dot(surface->vectorT, v) + surface->distT);
+    }
+    calc_lmap(&lm);
+    rects[i].w = lm.width;
+    rects[i].h = lm.height;
+  }
+  g_free(buf);
+  return rects;
+}
+
+// The previous shading loop: vec3_s positions and normals (AoS), out-of-line
+// vec3 calls per texel.
+static void aos_shade(struct rgba_s *diffuse, const struct vec3_s *positions,
+                      const struct vec3_s *normals, gsize num_texels) {
+  struct vec3_s lightpos = vec3_set(0.0f, 0.0f, 0.0f);
+  for (gsize i = 0; i < num_texels; i++) {
+    struct vec3_s pos = positions[i];
+    struct vec3_s normal = vec3_norm(normals[i]);
+    struct vec3_s lightdir = vec3_sub(lightpos, pos);
+    float len_sq = vec3_dot(lightdir, lightdir);
+    float len = sqrtf(len_sq);
+    lightdir = vec3_mul(lightdir, 1.0f / len);
+    gfloat diff = MAX(vec3_dot(normal, lightdir), 0.0f);
+    (void)diff;
+    gfloat intensity = 255.0f / len;
+    intensity = sqrtf(CLAMP(intensity, 0.0f, 1.0f));
+    diffuse[i].r = (guint8)CLAMP_COLOR_COMPONENT(diffuse[i].r * intensity);
+    diffuse[i].g = (guint8)CLAMP_COLOR_COMPONENT(diffuse[i].g * intensity);
+    diffuse[i].b = (guint8)CLAMP_COLOR_COMPONENT(diffuse[i].b * intensity);
+  }
+}
+
+// Both loops on the same random page, best of REPEAT runs each. Every run
+// starts from the unshaded colors, the outputs have to match exactly.
+static void bench_shading(void) {
+  gsize num_texels = (gsize)SHADE_SIZE * SHADE_SIZE;
+  struct rgba_s *colors = g_new(struct rgba_s, num_texels);
+  struct vec3_s *positions = g_new(struct vec3_s, num_texels);
+  struct vec3_s *normals = g_new(struct vec3_s, num_texels);
+  struct atlas_s atlas = {0};
+  atlas.width = SHADE_SIZE;
+  atlas.height = SHADE_SIZE;
+  atlas.num_pages = 1;
+  atlas.diffuse_data = g_new(struct rgba_s, num_texels);
+  for (guint k = 0; k < 3; k++) {
+    atlas.normal_planes[k] = g_aligned_alloc(num_texels, sizeof(gfloat), 32);
+    atlas.position_planes[k] = g_aligned_alloc(num_texels, sizeof(gfloat), 32);
+  }
+  GRand *rand = g_rand_new_with_seed(1234);
+  for (gsize i = 0; i < num_texels; i++) {
+    for (guint k = 0; k < 4; k++) {
+      colors[i].rgba[k] = (guint8)g_rand_int_range(rand, 0, 256);
+    }
+    for (guint k = 0; k < 3; k++) {
+      positions[i].xyz[k] = (gfloat)g_rand_double_range(rand, -4096, 4096);
+      normals[i].xyz[k] = (gfloat)g_rand_double_range(rand, -1, 1);
+      atlas.position_planes[k][i] = positions[i].xyz[k];
+      atlas.normal_planes[k][i] = normals[i].xyz[k];
+    }
+  }
+  g_rand_free(rand);
+
+  struct rgba_s *aos_out = g_new(struct rgba_s, num_texels);
+  gdouble aos_ms = G_MAXDOUBLE, soa_ms = G_MAXDOUBLE;
+  GTimer *timer = g_timer_new();
+  for (guint r = 0; r < REPEAT; r++) {
+    memcpy(aos_out, colors, num_texels * sizeof(struct rgba_s));
+    g_timer_start(timer);
+    aos_shade(aos_out, positions, normals, num_texels);
+    g_timer_stop(timer);
+    aos_ms = MIN(aos_ms, g_timer_elapsed(timer, NULL) * 1000.0);
+
+    memcpy(atlas.diffuse_data, colors, num_texels * sizeof(struct rgba_s));
+    g_timer_start(timer);
+    shade_g_buffer(&atlas, 0, num_texels);
+    g_timer_stop(timer);
+    soa_ms = MIN(soa_ms, g_timer_elapsed(timer, NULL) * 1000.0);
+  }
+  g_timer_destroy(timer);
+
+  gboolean same = memcmp(aos_out, atlas.diffuse_data,
+                         num_texels * sizeof(struct rgba_s)) == 0;
+  g_print("shading: %ux%u texels\n", SHADE_SIZE, SHADE_SIZE);
+  g_print("    %-8s %9.2f ms %7.1f Mtexels/s\n", "aos", aos_ms,
+          num_texels / (aos_ms * 1000.0));
+  g_print("    %-8s %9.2f ms %7.1f Mtexels/s %6.1fx%s\n", "soa", soa_ms,
+          num_texels / (soa_ms * 1000.0), aos_ms / soa_ms,
+          same ? "" : " (output differs!)");
+
+  for (guint k = 0; k < 3; k++) {
+    g_aligned_free(atlas.normal_planes[k]);
+    g_aligned_free(atlas.position_planes[k]);
+  }
+  g_free(atlas.diffuse_data);
+  g_free(aos_out);
+  g_free(colors);
+  g_free(positions);
+  g_free(normals);
+}
+
+// Fan-triangulated faces of the world model, three vertices per triangle.
+static struct vec3_s *load_world_tris(const gchar *path, guint *num_tris,
+                                      struct boundbox_s *bound) {
+  gchar *buf;
+  gsize len;
+  GError *err = NULL;
+  if (!g_file_get_contents(path, &buf, &len, &err)) {
+    g_print("%s\n", err->message);
+    g_error_free(err);
+    return NULL;
+  }
+  struct header_s *header = (struct header_s *)buf;
+  struct model_s *world = (struct model_s *)(buf + header->models.offset);
+  struct face_s *faces = (struct face_s *)(buf + header->faces.offset);
+  struct edge_s *edges = (struct edge_s *)(buf + header->edges.offset);
+  gint32 *edges_list = (gint32 *)(buf + header->edges_list.offset);
+  struct vec3_s *vertices = (struct vec3_s *)(buf + header->vertices.offset);
+
+  GArray *tris = g_array_new(FALSE, FALSE, sizeof(struct vec3_s));
+  for (guint i = world->face_id; i < world->face_id + world->face_num; i++) {
+    struct face_s *face = &faces[i];
+    struct vec3_s first = {{{0}}}, prev = {{{0}}};
+    for (guint j = 0; j < face->ledge_num; j++) {
+      gint32 e = edges_list[face->ledge_id + j];
+      struct edge_s *edge = &edges[ABS(e)];
+      struct vec3_s v = vertices[e < 0 ? edge->vertex1 : edge->vertex0];
+      if (j == 0) {
+        first = v;
+      } else if (j >= 2) {
+        g_array_append_val(tris, first);
+        g_array_append_val(tris, prev);
+        g_array_append_val(tris, v);
+      }
+      prev = v;
+    }
+  }
+  *bound = world->bound;
+  g_free(buf);
+  *num_tris = tris->len / 3;
+  return (struct vec3_s *)g_array_free(tris, FALSE);
+}
+
+struct ray_job_s {
+  const struct bvh_s *bvh;
+  const struct vec3_s *origins, *dirs;
+  guint num_rays;
+  gboolean any;
+  gint hits;
+};
+
+static guint trace_rays(const struct ray_job_s *job, guint first,
+                        guint last) {
+  guint hits = 0;
+  for (guint i = first; i < last; i++) {
+    if (job->any) {
+      hits += bvh_occluded(job->bvh, job->origins[i], job->dirs[i], 1.0f);
+    } else {
+      struct bvh_hit_s hit;
+      hits += bvh_intersect(job->bvh, job->origins[i], job->dirs[i], 1.0f,
+                            &hit);
+    }
+  }
+  return hits;
+}
+
+static void trace_task(gpointer data, gpointer user_data) {
+  struct ray_job_s *job = user_data;
+  guint first = (GPOINTER_TO_UINT(data) - 1) * RAY_BATCH;
+  guint hits = trace_rays(job, first, MIN(first + RAY_BATCH, job->num_rays));
+  g_atomic_int_add(&job->hits, (gint)hits);
+}
+
+// Mrays/s on one thread and on all of them, best of REPEAT runs each.
+static void bench_rays(const gchar *name, struct ray_job_s *job) {
+  gdouble one_ms = G_MAXDOUBLE, all_ms = G_MAXDOUBLE;
+  guint hits = 0;
+  GTimer *timer = g_timer_new();
+  for (guint r = 0; r < REPEAT; r++) {
+    g_timer_start(timer);
+    hits = trace_rays(job, 0, job->num_rays);
+    g_timer_stop(timer);
+    one_ms = MIN(one_ms, g_timer_elapsed(timer, NULL) * 1000.0);
+
+    job->hits = 0;
+    g_timer_start(timer);
+    GThreadPool *pool = g_thread_pool_new(trace_task, job,
+                                          g_get_num_processors(), TRUE, NULL);
+    for (guint b = 0; b * RAY_BATCH < job->num_rays; b++) {
+      g_thread_pool_push(pool, GUINT_TO_POINTER(b + 1), NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_timer_stop(timer);
+    all_ms = MIN(all_ms, g_timer_elapsed(timer, NULL) * 1000.0);
+  }
+  g_timer_destroy(timer);
+  g_print("    %-8s %5.1f%% hit %8.2f Mrays/s %8.2f Mrays/s (%u threads)%s\n",
+          name, 100.0 * hits / job->num_rays, job->num_rays / (one_ms * 1000.0),
+          job->num_rays / (all_ms * 1000.0), g_get_num_processors(),
+          (guint)job->hits == hits ? "" : " (hits differ!)");
+}
+
+// Random rays through the world bounds, as long as its diagonal: closest
+// hits (picking) and any hit (shadow segments between two random points).
+// The first NUM_CHECKED closest hits are checked against a single leaf
+// holding every triangle, i.e. brute force.
+static void bench_bvh(const gchar *path) {
+  guint num_tris;
+  struct boundbox_s bound;
+  struct vec3_s *verts = load_world_tris(path, &num_tris, &bound);
+  if (verts == NULL) {
+    return;
+  }
+  guint32 *ids = g_new(guint32, MAX(num_tris, 1));
+  for (guint i = 0; i < num_tris; i++) {
+    ids[i] = i;
+  }
+  struct bvh_s bvh;
+  build_bvh(&bvh, verts, ids, num_tris);
+  g_free(ids);
+  g_free(verts);
+  if (bvh.num_nodes == 0) {
+    return;
+  }
+
+  gfloat diagonal = vec3_len(vec3_sub(bound.max, bound.min));
+  struct vec3_s *origins = g_new(struct vec3_s, NUM_RAYS);
+  struct vec3_s *dirs = g_new(struct vec3_s, NUM_RAYS);
+  struct vec3_s *ends = g_new(struct vec3_s, NUM_RAYS);
+  GRand *rand = g_rand_new_with_seed(1234);
+  for (guint i = 0; i < NUM_RAYS; i++) {
+    struct vec3_s d;
+    do {
+      for (guint k = 0; k < 3; k++) {
+        d.xyz[k] = (gfloat)g_rand_double_range(rand, -1.0, 1.0);
+      }
+    } while (vec3_dot(d, d) > 1.0f || vec3_dot(d, d) < 1e-6f);
+    for (guint k = 0; k < 3; k++) {
+      origins[i].xyz[k] = (gfloat)g_rand_double_range(
+          rand, bound.min.xyz[k], bound.max.xyz[k]);
+      gfloat end = (gfloat)g_rand_double_range(rand, bound.min.xyz[k],
+                                                bound.max.xyz[k]);
+      ends[i].xyz[k] = end - origins[i].xyz[k];
+    }
+    dirs[i] = vec3_mul(vec3_norm(d), diagonal);
+  }
+  g_rand_free(rand);
+
+  struct bvh_s brute = bvh;
+  brute.num_nodes = 1;
+  brute.nodes = g_aligned_alloc(1, sizeof(struct bvh_node_s), 32);
+  brute.nodes[0] = bvh.nodes[0];
+  brute.nodes[0].index = 0;
+  brute.nodes[0].count = bvh.num_tris;
+  guint mismatches = 0;
+  for (guint i = 0; i < NUM_CHECKED; i++) {
+    struct bvh_hit_s a, b;
+    gboolean hit_a = bvh_intersect(&bvh, origins[i], dirs[i], 1.0f, &a);
+    gboolean hit_b = bvh_intersect(&brute, origins[i], dirs[i], 1.0f, &b);
+    // overlapping coplanar faces can put the hit a rounding error apart
+    mismatches += hit_a != hit_b || (hit_a && fabsf(a.t - b.t) > 1e-6f);
+  }
+  g_aligned_free(brute.nodes);
+
+  g_print("%s: %u triangles, %u rays, %u of %u closest hits differ from "
+          "brute force\n",
+          path, bvh.num_tris, NUM_RAYS, mismatches, NUM_CHECKED);
+  struct ray_job_s closest = {&bvh, origins, dirs, NUM_RAYS, FALSE, 0};
+  bench_rays("closest", &closest);
+  struct ray_job_s any = {&bvh, origins, ends, NUM_RAYS, TRUE, 0};
+  bench_rays("any", &any);
+
+  g_free(origins);
+  g_free(dirs);
+  g_free(ends);
+  free_bvh(&bvh);
+}
+
+// Point-in-leaf lookups at random points in the world bounds, best of
+// REPEAT runs; the checksum sums the leaf indices.
+static void bench_bsp_tree(const gchar *path) {
+  gchar *buf;
+  gsize len;
+  GError *err = NULL;
+  if (!g_file_get_contents(path, &buf, &len, &err)) {
+    g_print("%s\n", err->message);
+    g_error_free(err);
+    return;
+  }
+  const struct header_s *header = (const struct header_s *)buf;
+  const struct model_s *world =
+      (const struct model_s *)(buf + header->models.offset);
+  struct bsp_tree_s tree;
+  build_bsp_tree(&tree, buf, header, world);
+  if (tree.num_nodes == 0) {
+    free_bsp_tree(&tree);
+    g_free(buf);
+    return;
+  }
+
+  GRand *rand = g_rand_new_with_seed(0x5eed);
+  struct vec3_s *points = g_new(struct vec3_s, NUM_POINTS);
+  for (guint i = 0; i < NUM_POINTS; i++) {
+    for (guint k = 0; k < 3; k++) {
+      points[i].xyz[k] = (gfloat)g_rand_double_range(
+          rand, world->bound.min.xyz[k], world->bound.max.xyz[k]);
+    }
+  }
+  g_rand_free(rand);
+
+  guint64 sum = 0;
+  gdouble best_ms = G_MAXDOUBLE;
+  GTimer *timer = g_timer_new();
+  for (guint r = 0; r < REPEAT; r++) {
+    sum = 0;
+    g_timer_start(timer);
+    for (guint i = 0; i < NUM_POINTS; i++) {
+      sum += bsp_point_in_leaf(&tree, points[i]);
+    }
+    g_timer_stop(timer);
+    best_ms = MIN(best_ms, g_timer_elapsed(timer, NULL) * 1000.0);
+  }
+  g_timer_destroy(timer);
+  g_print("%s: %u BSP nodes, %u point lookups\n", path, tree.num_nodes,
+          NUM_POINTS);
+  g_print("    %-8s %9.2f ms %8.2f M lookups/s (checksum %" G_GUINT64_FORMAT
+          ")\n",
+          "point", best_ms, NUM_POINTS / (best_ms * 1000.0), sum);
+
+  g_free(points);
+  free_bsp_tree(&tree);
+  g_free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  const guint map_widths[] = {256, 512, 1024, 2048};
+  for (gint i = 1; i < argc; i++) {
+    guint num_rects;
+    struct rect_s *rects = load_lmap_rects(argv[i], &num_rects);
+    if (rects == NULL) {
+      return 1;
+    }
+    bench_rects(argv[i], rects, num_rects, map_widths,
+                G_N_ELEMENTS(map_widths));
+    g_free(rects);
+  }
+
+  // lightmap-like sizes: 1..18 luxels per side, fixed seed
+  const guint synthetic_widths[] = {1024, 4096};
+  GRand *rand = g_rand_new_with_seed(1234);
+  struct rect_s *rects = g_new(struct rect_s, NUM_SYNTHETIC);
+  for (guint i = 0; i < NUM_SYNTHETIC; i++) {
+    rects[i].w = g_rand_int_range(rand, 1, 19);
+    rects[i].h = g_rand_int_range(rand, 1, 19);
+  }
+  g_rand_free(rand);
+  bench_rects("synthetic", rects, NUM_SYNTHETIC, synthetic_widths,
+              G_N_ELEMENTS(synthetic_widths));
+  g_free(rects);
+
+  bench_shading();
+  for (gint i = 1; i < argc; i++) {
+    bench_bsp_tree(argv[i]);
+    bench_bvh(argv[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef _BSP_
+#define _BSP_
+
+#include "vec.h"
+#include <glib.h>
+
+struct entry_s {
+  guint32 offset;
+  guint32 size;
+};
+
+struct header_s {
+  guint32 version;
+  struct entry_s entities;
+  struct entry_s planes;
+  struct entry_s miptex;
+  struct entry_s vertices;
+  struct entry_s visilist;
+  struct entry_s nodes;
+  struct entry_s texinfo;
+  struct entry_s faces;
+  struct entry_s lightmaps;
+  struct entry_s clipnodes;
+  struct entry_s leaves;
+  struct entry_s faces_list;
+  struct entry_s edges;
+  struct entry_s edges_list;
+  struct entry_s models;
+};
+
+struct plane_s {
+  struct vec3_s normal; // Vector orthogonal to plane (Nx,Ny,Nz)
+                        // with Nx2+Ny2+Nz2 = 1
+  gfloat dist;          // Offset to plane, along the normal vector.
+                        // Distance from (0,0,0) to the plane
+  gint type;            // Type of plane, depending on normal vector.
+};
+
+/*
+plane types:
+0: Axial plane, in X
+1: Axial plane, in Y
+2: Axial plane, in Z
+3: Non axial plane, roughly toward X
+4: Non axial plane, roughly toward Y
+5: Non axial plane, roughly toward Z*/
+
+struct boundbox_s {
+  struct vec3_s min;
+  struct vec3_s max;
+};
+
+struct model_s {
+  struct boundbox_s bound;
+  struct vec3_s origin;
+  guint32 node_id0;
+  guint32 node_id1;
+  guint32 node_id2;
+  guint32 node_id3;
+  guint32 numleaves;
+  guint32 face_id;
+  guint32 face_num;
+};
+
+struct mipheader_s {
+  guint32 numtex;
+  guint32 offsets[];
+};
+
+struct miptex_s {
+  gchar name[16];
+  guint32 width;
+  guint32 height;
+  guint32 offset1;
+  guint32 offset2;
+  guint32 offset4;
+  guint32 offset8;
+};
+
+struct surface_s {
+  struct vec3_s vectorS;
+  gfloat distS;
+  struct vec3_s vectorT;
+  gfloat distT;
+  guint32 texture_id;
+  guint32 animated;
+};
+
+struct edge_s {
+  guint16 vertex0;
+  guint16 vertex1;
+};
+
+struct face_s {
+  guint16 plane_id;
+  guint16 side;
+  gint32 ledge_id;
+  guint16 ledge_num;
+  guint16 texinfo_id;
+  guint8 styles[4]; // lightstyle of each lightmap, 255 ends the list
+  gint32 lightmap;  // offset of the first lightmap, the others follow
+};
+
+struct node_s {
+  guint32 plane_id;
+  gint16 children[2]; // >= 0: node index, < 0: -(leaf index + 1)
+  gint16 mins[3];
+  gint16 maxs[3];
+  guint16 face_id;
+  guint16 face_num;
+};
+
+struct leaf_s {
+  gint32 contents; // CONTENTS_*
+  gint32 vislist;  // offset into the visilist lump, -1 if none
+  gint16 mins[3];
+  gint16 maxs[3];
+  guint16 lface_id; // first entry in faces_list
+  guint16 lface_num;
+  guint8 ambient[4];
+};
+
+#define CONTENTS_EMPTY -1
+#define CONTENTS_SOLID -2
+#define CONTENTS_WATER -3
+#define CONTENTS_SLIME -4
+#define CONTENTS_LAVA -5
+#define CONTENTS_SKY -6
+
+#endif // _BSP_
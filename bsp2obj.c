@@ -21,9 +21,14 @@
 #include <math.h>
 #include <string.h>
 
+#include "bsp.h"
+#include "bsptree.h"
+#include "entities.h"
+#include "lmap.h"
 #include "lodepng.h"
 #include "mesh.h"
 #include "mygltf.h"
+#include "vis.h"
 
 #define SWAP(a, b)                                                             \
   do {                                                                         \
@@ -32,243 +37,42 @@
     b = tmp;                                                                   \
   } while (0)
 
-struct entry_s {
-  guint32 offset;
-  guint32 size;
-};
-
-struct header_s {
-  guint32 version;
-  struct entry_s entities;
-  struct entry_s planes;
-  struct entry_s miptex;
-  struct entry_s vertices;
-  struct entry_s visilist;
-  struct entry_s nodes;
-  struct entry_s texinfo;
-  struct entry_s faces;
-  struct entry_s lightmaps;
-  struct entry_s clipnodes;
-  struct entry_s leaves;
-  struct entry_s faces_list;
-  struct entry_s edges;
-  struct entry_s edges_list;
-  struct entry_s models;
-};
-
-struct plane_s {
-  struct vec3_s normal; // Vector orthogonal to plane (Nx,Ny,Nz)
-                        // with Nx2+Ny2+Nz2 = 1
-  gfloat dist;          // Offset to plane, along the normal vector.
-                        // Distance from (0,0,0) to the plane
-  gint type;            // Type of plane, depending on normal vector.
-};
-
-/*
-plane types:
-0: Axial plane, in X
-1: Axial plane, in Y
-2: Axial plane, in Z
-3: Non axial plane, roughly toward X
-4: Non axial plane, roughly toward Y
-5: Non axial plane, roughly toward Z*/
-
-struct boundbox_s {
-  struct vec3_s min;
-  struct vec3_s max;
-};
-
-struct model_s {
-  struct boundbox_s bound;
-  struct vec3_s origin;
-  guint32 node_id0;
-  guint32 node_id1;
-  guint32 node_id2;
-  guint32 node_id3;
-  guint32 numleaves;
-  guint32 face_id;
-  guint32 face_num;
-};
-
-struct mipheader_s {
-  guint32 numtex;
-  guint32 offsets[];
-};
-
-struct miptex_s {
-  gchar name[16];
-  guint32 width;
-  guint32 height;
-  guint32 offset1;
-  guint32 offset2;
-  guint32 offset4;
-  guint32 offset8;
-};
-
-struct surface_s {
-  struct vec3_s vectorS;
-  gfloat distS;
-  struct vec3_s vectorT;
-  gfloat distT;
-  guint32 texture_id;
-  guint32 animated;
-};
-
-struct edge_s {
-  guint16 vertex0;
-  guint16 vertex1;
-};
-
-struct face_s {
-  guint16 plane_id;
-  guint16 side;
-  gint32 ledge_id;
-  guint16 ledge_num;
-  guint16 texinfo_id;
-  guint8 typelight;
-  guint8 baselight;
-  guint8 light[2];
-  gint32 lightmap;
-};
-
-struct lmap_s {
-  gint face_id;
-  gfloat mins[2];
-  gfloat maxs[2];
-  gint bmins[2];
-  gint bmaxs[2];
-  gint tmins[2];
-  gint texts[2];
-  gint width, height;
-  struct rgba_s *data;
-  gint atlas_x, atlas_y;
-};
-
-void init_lmap(struct lmap_s *lm, gint face_id);
-void lmap_addST(struct lmap_s *lm, gfloat s, gfloat t);
-void calc_lmap(struct lmap_s *lm);
-void lmap_getUV(struct lmap_s *lm, gfloat s, gfloat t, gfloat *u, gfloat *v);
-int compare_lmap_fn(const gpointer a, const gpointer b);
-
-struct ivec2_s pack_lmap_block(guint *skyline, guint atlas_width, guint width,
-                               guint height, gboolean padded) {
-  guint best_x = G_MAXUINT;
-  guint best_y = G_MAXUINT;
-
-  struct ivec2_s uv = {-1, -1};
-
-  gint padding = padded ? 1 : 0;
-
-  width += padding;
-  height += padding;
-  for (guint x = padding; x < atlas_width - width - padding; x++) {
-    if (skyline[x] >= best_y) {
-      continue;
-    }
-    gboolean fits = TRUE;
-    for (gint x2 = x; x2 < x + width; x2++) {
-      if (skyline[x2] > skyline[x]) {
-        fits = FALSE;
-        break;
-      }
-    }
-    if (fits) {
-      best_y = skyline[x];
-      best_x = x;
-    }
-  }
-  if (best_x != G_MAXUINT) {
-    for (guint x = best_x; x < best_x + width; x++) {
-      skyline[x] = best_y + height;
-    }
-    uv.x = best_x;
-    uv.y = best_y;
-  }
-  return uv;
-}
-
-void pack_lmaps(struct lmap_s *lmaps, guint num_lmaps, guint atlas_width,
-                guint atlas_height) {
-  guint *skyline = g_new(guint, atlas_width);
-  for (guint i = 0; i < atlas_width; i++) {
-    skyline[i] = 1;
-  }
-
-  g_print("packing...\n");
-  g_qsort_with_data(lmaps, num_lmaps, sizeof(struct lmap_s), compare_lmap_fn,
-                    NULL);
-  for (guint i = 0; i < num_lmaps; i++) {
-    struct lmap_s *lm = &lmaps[i];
-    struct ivec2_s uv =
-        pack_lmap_block(skyline, atlas_width, lm->width, lm->height, FALSE);
-    if (uv.x == -1) {
-      g_error("Failed to pack lightmaps into atlas (%ux%u)", atlas_width,
-              atlas_height);
-    } else {
-      lm->atlas_x = uv.x;
-      lm->atlas_y = uv.y;
-    }
-  }
-
-  guint max_height = skyline[0];
-  for (guint i = 1; i < atlas_width; i++) {
-    if (skyline[i] > max_height) {
-      max_height = skyline[i];
-    }
-  }
-  g_print("Lightmap atlas size: %ux%u\n", atlas_width, max_height);
-  if (max_height <= atlas_height) {
-    struct rgba_s *atlas_data =
-        g_new(struct rgba_s, atlas_width * atlas_height);
-    for (guint i = 0; i < atlas_width * atlas_height; i++) {
-      atlas_data[i].r = 255;
-      atlas_data[i].g = 0;
-      atlas_data[i].b = 255;
-      atlas_data[i].a = 255;
-    }
-    for (guint i = 0; i < num_lmaps; i++) {
-      struct lmap_s *lm = &lmaps[i];
-      for (gint y = 0; y < lm->height; y++) {
-        for (gint x = 0; x < lm->width; x++) {
-          guint dest_x = lm->atlas_x + x;
-          guint dest_y = lm->atlas_y + y;
-          atlas_data[dest_y * atlas_width + dest_x] =
-              lm->data[y * lm->width + x];
-        }
-      }
-    }
-    unsigned error = lodepng_encode32_file("lightmap.png", atlas_data,
-                                           atlas_width, atlas_height);
-    if (error) {
-      g_error("error %u: %s\n", error, lodepng_error_text(error));
-    }
-    g_free(atlas_data);
-  }
-  g_free(skyline);
-}
-
-guint *create_lmap_lut(const struct lmap_s *lmaps, guint num_lmaps) {
-  guint *lut = g_new(guint, num_lmaps);
-  for (guint i = 0; i < num_lmaps; i++) {
-    lut[lmaps[i].face_id] = i;
-  }
-  return lut;
-}
-
 gboolean build_region(struct poly_region_s *region, const struct poly_s *poly,
                       const struct lmap_s *lm, struct vec3_s surface_vectorS,
                       gfloat surface_distS, struct vec3_s surface_vectorT,
                       gfloat surface_distT) {
+  region->page = lm->page;
   region->x = lm->atlas_x;
   region->y = lm->atlas_y;
-  region->w = lm->width;
-  region->h = lm->height;
-
-  // Lightmap S/T mapping constants (Quake scale = 16)
-  region->scale.x = (gfloat)region->w * 16.0f;
-  region->scale.y = (gfloat)region->h * 16.0f;
-  region->bias.x = (gfloat)lm->tmins[0];
-  region->bias.y = (gfloat)lm->tmins[1];
+  region->w = lm->block_w;
+  region->h = lm->block_h;
+  region->rotated = lm->rotated;
+  region->shared = lm->share >= 0;
+
+  // Lightmap S/T of the block texels: luxels are 16 units apart, spread
+  // over the whole lightmap in a downsampled block the way lmap_getUV maps
+  // it (the corner luxels stay), and a 1x1 block sits at its middle
+  gint size[2] = {lm->width, lm->height};
+  gint block[2] = {lm->block_w, lm->block_h};
+  for (guint k = 0; k < 2; k++) {
+    region->scale.xy[k] =
+        block[k] > 1 ? (gfloat)(size[k] - 1) * 16.0f / (block[k] - 1) : 0.0f;
+    region->bias.xy[k] =
+        block[k] > 1 ? (gfloat)lm->tmins[k]
+                     : (gfloat)lm->tmins[k] + (size[k] - 1) * 8.0f;
+  }
+  // the block's corner texels have to be the UVs' lightmap corners
+  if (!lm->uniform) {
+    for (gint c = 0; c < 2; c++) {
+      gfloat uv[2];
+      lmap_getUV(lm, region->bias.x + c * (block[0] - 1) * region->scale.x,
+                 region->bias.y + c * (block[1] - 1) * region->scale.y,
+                 &uv[lm->rotated], &uv[!lm->rotated]);
+      for (guint k = 0; k < 2; k++) {
+        g_assert(fabsf(uv[k] - (c * (block[k] - 1) + 0.5f)) < 1e-3f);
+      }
+    }
+  }
 
   struct vec3_s t_x_n = vec3_cross(surface_vectorT, poly->plane_normal);
   gfloat det = vec3_dot(surface_vectorS, t_x_n);
@@ -312,6 +116,17 @@ void export_mesh_with_lmap_to_obj(struct mesh_s *mesh, gfloat scale) {
   g_string_append(obj, "illum 1\n");
   g_string_append(obj, "Ns 0\n");
   g_string_append(obj, "map_Kd diffuse.png\n");
+  // one material per extra atlas page
+  for (guint p = 1; p < mesh->texture_atlas->num_pages; p++) {
+    g_string_append_printf(obj, "newmtl lightmap_%u\n", p);
+    g_string_append(obj, "Ka 1 1 1\n");
+    g_string_append(obj, "Kd 1 1 1\n");
+    g_string_append(obj, "Ks 0 0 0\n");
+    g_string_append(obj, "Tr 1\n");
+    g_string_append(obj, "illum 1\n");
+    g_string_append(obj, "Ns 0\n");
+    g_string_append_printf(obj, "map_Kd diffuse_%u.png\n", p);
+  }
   g_file_set_contents("lightmap.mtl", obj->str, obj->len, NULL);
 
   g_string_free(obj, TRUE);
@@ -332,17 +147,35 @@ void export_mesh_with_lmap_to_obj(struct mesh_s *mesh, gfloat scale) {
     g_string_append_printf(obj, "vt %g %g\n", v->uvs[1].x, v->uvs[1].y);
   }
 
-  // Write faces
-  for (guint i = 0; i < mesh->polys->len; i++) {
-    struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
-    // g_print("exporting poly %u with %u tris\n", i, poly->num_tris);
-    for (guint j = 0; j < poly->num_tris; j++) {
-      struct tri_s *tri = &poly->tris[j];
-      g_string_append(obj, "f");
-      g_string_append_printf(obj, " %u/%u", tri->v0 + 1, tri->v0 + 1);
-      g_string_append_printf(obj, " %u/%u", tri->v1 + 1, tri->v1 + 1);
-      g_string_append_printf(obj, " %u/%u", tri->v2 + 1, tri->v2 + 1);
-      g_string_append_c(obj, '\n');
+  // Write faces, grouped by atlas page; brush models start a new object.
+  // Later pages name their first object, or their faces would end up in
+  // the last one of the page before.
+  for (guint p = 0; p < mesh->texture_atlas->num_pages; p++) {
+    if (p > 0) {
+      g_string_append_printf(obj, "usemtl lightmap_%u\n", p);
+    }
+    guint model_id = p > 0 ? G_MAXUINT : 0;
+    for (guint i = 0; i < mesh->polys->len; i++) {
+      struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
+      if (poly->lightmap_page != p) {
+        continue;
+      }
+      if (poly->model_id != model_id) {
+        model_id = poly->model_id;
+        if (model_id == 0) {
+          g_string_append(obj, "o world\n");
+        } else {
+          g_string_append_printf(obj, "o *%u\n", model_id);
+        }
+      }
+      for (guint j = 0; j < poly->num_tris; j++) {
+        struct tri_s *tri = &poly->tris[j];
+        g_string_append(obj, "f");
+        g_string_append_printf(obj, " %u/%u", tri->v0 + 1, tri->v0 + 1);
+        g_string_append_printf(obj, " %u/%u", tri->v1 + 1, tri->v1 + 1);
+        g_string_append_printf(obj, " %u/%u", tri->v2 + 1, tri->v2 + 1);
+        g_string_append_c(obj, '\n');
+      }
     }
   }
 
@@ -462,6 +295,80 @@ static guint map_vertex(GHashTable *map, GString *obj, struct vec3_s *vertices,
   return mapped_idx;
 }
 
+static gchar *opt_triangulation = NULL;
+static gboolean opt_compact_indices = FALSE;
+static gdouble opt_chunk_size = 0.0;
+static gboolean opt_texture_arrays = FALSE;
+static gboolean opt_diffuse_atlas = FALSE;
+static gint opt_atlas_mips = 4;
+static gint opt_lightmap_max_size = 4096;
+static gboolean opt_lightmap_rotation = TRUE;
+static gchar *opt_lightmap_format = NULL;
+static gboolean opt_lightmap_dedup = FALSE;
+static gint opt_lightmap_downsample = 0;
+static gboolean opt_bake = FALSE;
+static gdouble opt_bake_radius = 0.0;
+static gint opt_bake_samples = 16;
+static gboolean opt_bake_bvh = FALSE;
+
+static GOptionEntry option_entries[] = {
+    {"triangulation", 't', 0, G_OPTION_ARG_STRING, &opt_triangulation,
+     "Triangulator: fan, strip, min-weight or max-min-angle (default: fan)",
+     "MODE"},
+    {"compact-indices", 0, 0, G_OPTION_ARG_NONE, &opt_compact_indices,
+     "Per-primitive vertex windows with uint16 indices in the glTF, brush "
+     "models in nodes of their own",
+     NULL},
+    {"chunk-size", 0, 0, G_OPTION_ARG_DOUBLE, &opt_chunk_size,
+     "Split the glTF world mesh into grid chunks of SIZE units", "SIZE"},
+    {"texture-arrays", 0, 0, G_OPTION_ARG_NONE, &opt_texture_arrays,
+     "Batch glTF draws by texture resolution, one texture array each", NULL},
+    {"diffuse-atlas", 0, 0, G_OPTION_ARG_NONE, &opt_diffuse_atlas,
+     "Pack all textures into one atlas and export a single glTF material",
+     NULL},
+    {"atlas-mips", 0, 0, G_OPTION_ARG_INT, &opt_atlas_mips,
+     "Mip levels the diffuse atlas gutters are sized for (default: 4)", "N"},
+    {"lightmap-max-size", 0, 0, G_OPTION_ARG_INT, &opt_lightmap_max_size,
+     "Largest lightmap atlas side to try (default: 4096)", "SIZE"},
+    {"no-lightmap-rotation", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE,
+     &opt_lightmap_rotation, "Never pack lightmaps turned by 90 degrees", NULL},
+    {"lightmap-format", 0, 0, G_OPTION_ARG_STRING, &opt_lightmap_format,
+     "Lightmap atlas format: rgba, r8 or styles (default: rgba); r8 atlases "
+     "are also referenced by the glTF materials, styles atlases hold up to "
+     "four lightstyles per face (see lightstyles.json)",
+     "FORMAT"},
+    {"lightmap-dedup", 0, 0, G_OPTION_ARG_NONE, &opt_lightmap_dedup,
+     "Share one atlas block among identical lightmaps and shrink uniform ones "
+     "to a texel (the g-buffer preview then shows one face per shared block)",
+     NULL},
+    {"lightmap-downsample", 0, 0, G_OPTION_ARG_INT, &opt_lightmap_downsample,
+     "Shrink smooth lightmaps 2x or 4x while no luxel is off by more than "
+     "MAXERR (0..255, default: 0 = off)",
+     "MAXERR"},
+    {"bake", 0, 0, G_OPTION_ARG_NONE, &opt_bake,
+     "Trace shadow rays from the g-buffer to the map's lights and export the "
+     "result as baked.png, laid out like lightmap.png",
+     NULL},
+    {"bake-radius", 0, 0, G_OPTION_ARG_DOUBLE, &opt_bake_radius,
+     "Light radius for soft baked shadows (default: 0 = point lights)",
+     "UNITS"},
+    {"bake-samples", 0, 0, G_OPTION_ARG_INT, &opt_bake_samples,
+     "Shadow rays per light and texel with a light radius (default: 16)",
+     "N"},
+    {"bake-bvh", 0, 0, G_OPTION_ARG_NONE, &opt_bake_bvh,
+     "Trace the baker's shadow rays against a BVH of the world's triangles "
+     "instead of its BSP tree",
+     NULL},
+    {NULL}};
+
+// Polys that block the baker's shadow rays, as with light.exe: the world's,
+// but not sky or liquids (texinfo flag 1, TEX_SPECIAL)
+static gboolean casts_shadow(const struct poly_s *poly, gpointer data) {
+  const struct surface_s *surfaces = data;
+  return poly->model_id == 0 &&
+         (poly->texinfo_id < 0 || !(surfaces[poly->texinfo_id].animated & 1));
+}
+
 int main(int argc, char **argv) {
   GError *err = NULL;
   gchar *buf = NULL;
@@ -469,11 +376,36 @@ int main(int argc, char **argv) {
   struct rgb_s *palette = NULL;
   struct texinfo_s *texinfos = NULL;
   guint num_texinfos = 0;
+  enum tri_mode_e tri_mode = TRI_MODE_FAN;
+  enum lmap_format_e lmap_format = LMAP_FORMAT_RGBA;
 
+  GOptionContext *context = g_option_context_new("<map.bsp>");
+  g_option_context_add_main_entries(context, option_entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &err)) {
+    g_print("%s\n", err->message);
+    g_error_free(err);
+    g_option_context_free(context);
+    return 1;
+  }
   if (argc != 2) {
-    g_print("usage: %s <map.bsp>\n", argv[0]);
+    gchar *help = g_option_context_get_help(context, TRUE, NULL);
+    g_print("%s", help);
+    g_free(help);
+    g_option_context_free(context);
     return 0;
   }
+  g_option_context_free(context);
+
+  if (opt_triangulation != NULL &&
+      !tri_mode_from_string(opt_triangulation, &tri_mode)) {
+    g_print("unknown triangulation mode '%s'\n", opt_triangulation);
+    return 1;
+  }
+  if (opt_lightmap_format != NULL &&
+      !lmap_format_from_string(opt_lightmap_format, &lmap_format)) {
+    g_print("unknown lightmap format '%s'\n", opt_lightmap_format);
+    return 1;
+  }
 
   load_palette("palette.lmp", &palette, &err);
   if (err != NULL) {
@@ -499,7 +431,6 @@ int main(int argc, char **argv) {
   struct mipheader_s *mipheader = buf + header->miptex.offset;
   struct vec3_s *vertices = buf + header->vertices.offset;
   struct surface_s *surfaces = buf + header->texinfo.offset;
-  //	gint16 *faces_list = buf + header->faces_list.offset;
   struct face_s *faces = buf + header->faces.offset;
   gint32 *edges_list = buf + header->edges_list.offset;
   struct edge_s *edges = buf + header->edges.offset;
@@ -637,33 +568,9 @@ int main(int argc, char **argv) {
         lmap_addST(lm, u[2], v[2]);
       }
       calc_lmap(lm);
-      guint num_luxels = lm->width * lm->height;
-      lm->data = g_new(struct rgba_s, num_luxels);
-      for (gint j = 0; j < num_luxels; j++) {
-        lm->data[j].r = 0;
-        lm->data[j].g = 0;
-        lm->data[j].b = 0;
-        lm->data[j].a = 255;
-      }
-      if (face->lightmap >= 0) {
-        guchar *lm_data =
-            (guchar *)buf + header->lightmaps.offset + face->lightmap;
-        for (gint j = 0; j < num_luxels; j++) {
-          guint8 intensity = lm_data[j];
-          lm->data[j].r = intensity;
-          lm->data[j].g = intensity;
-          lm->data[j].b = intensity;
-        }
-        /*
-        gchar* img_file = g_strdup_printf("lightmaps/lm_%d.png", lm->face_id);
-        unsigned error =
-            lodepng_encode32_file(img_file, lm->data, lm->width, lm->height);
-        if (error) {
-          g_error("error %u: %s\n", error, lodepng_error_text(error));
-        }
-        g_free(img_file);
-        */
-      }
+      // luxels are copied from the lump once the atlas is packed
+      lm->lightmap = face->lightmap;
+      memcpy(lm->styles, face->styles, sizeof(lm->styles));
     }
     obj = g_string_append(obj, obj_uvs->str);
     obj = g_string_append(obj, obj_faces->str);
@@ -697,142 +604,190 @@ int main(int argc, char **argv) {
     g_free(out_file);
   }
 
-  guint atlas_width = 512;
-  guint atlas_height = 768;
-  pack_lmaps(lmaps, face_count, atlas_width, atlas_height);
+  guint atlas_width = 0;
+  guint atlas_height = 0;
+  guint atlas_pages = 1;
+  struct lmap_opts_s lmap_opts = {0};
+  lmap_opts.max_size = (guint)MAX(opt_lightmap_max_size, 16);
+  lmap_opts.rotate = opt_lightmap_rotation;
+  lmap_opts.dedup = opt_lightmap_dedup;
+  lmap_opts.max_error = (guint)CLAMP(opt_lightmap_downsample, 0, 255);
+  const guint8 *lightmap_lump = (const guint8 *)buf + header->lightmaps.offset;
+  if (!pack_lmaps(lmaps, face_count, lightmap_lump, &lmap_opts, &atlas_width,
+                  &atlas_height, &atlas_pages)) {
+    g_printerr("lightmaps do not fit a %dx%d atlas\n", opt_lightmap_max_size,
+               opt_lightmap_max_size);
+    return 1;
+  }
+  export_lmap_atlas(lmaps, face_count, lightmap_lump, atlas_width,
+                    atlas_height, atlas_pages, lmap_format);
+  if (lmap_format == LMAP_FORMAT_STYLES) {
+    export_lmap_styles(lmaps, face_count, "lightstyles.json", &err);
+    if (err != NULL) {
+      g_error("%s", err->message);
+      g_error_free(err);
+      return 1;
+    }
+  }
   guint *lmap_lut = create_lmap_lut(lmaps, face_count);
-  // Extract a single model containing lightmap UVs
-  struct model_s *model = &models[0];
+  // Extract the world and the brush models into one mesh with lightmap UVs,
+  // each poly tagged with its model
+  guint num_models = header->models.size / sizeof(struct model_s);
   struct mesh_s *mesh = g_new(struct mesh_s, 1);
   init_mesh(mesh);
-  mesh->texture_atlas->num_polys = model->face_num;
+  mesh->tri_mode = tri_mode;
+  mesh->texture_atlas->num_polys = 0;
+  for (guint k = 0; k < num_models; k++) {
+    mesh->texture_atlas->num_polys += models[k].face_num;
+  }
+  mesh->texture_atlas->num_pages = atlas_pages;
   mesh->texture_atlas->poly_regions =
       g_new(struct poly_region_s, mesh->texture_atlas->num_polys);
 
-  for (gint i = 0; i < model->face_num; i++) {
-    gint face_id = model->face_id + i;
-    struct face_s *face = &faces[face_id];
-    struct surface_s *surface = &surfaces[face->texinfo_id];
-    struct miptex_s *miptex =
-        buf + header->miptex.offset + mipheader->offsets[surface->texture_id];
-    // if (g_strrstr_len(miptex->name, -1, "sky")) {
-    //   continue;
-    // }
-    struct lmap_s *lm = &lmaps[lmap_lut[face_id]];
-    struct poly_s *poly = mesh_add_poly(mesh, miptex->name);
-    struct plane_s *plane = &planes[face->plane_id];
-    poly->plane_normal = plane->normal;
-    if (face->side) {
-      poly->plane_normal = vec3_mul(poly->plane_normal, -1.0f);
-    }
-    for (gint j = 0; j < face->ledge_num; j++) {
-      struct edge_s *edge = edges + ABS(edges_list[face->ledge_id + j]);
-      gint vtx =
-          edges_list[face->ledge_id + j] < 0 ? edge->vertex1 : edge->vertex0;
-      struct vec3_s position = vertices[vtx];
-      if (0 == j) {
-        poly->plane_dist = vec3_dot(poly->plane_normal, position);
+  guint num_regions = 0;
+  for (guint k = 0; k < num_models; k++) {
+    struct model_s *model = &models[k];
+    for (guint i = 0; i < model->face_num; i++) {
+      gint face_id = model->face_id + i;
+      struct face_s *face = &faces[face_id];
+      struct surface_s *surface = &surfaces[face->texinfo_id];
+      struct miptex_s *miptex = buf + header->miptex.offset +
+                                mipheader->offsets[surface->texture_id];
+      // if (g_strrstr_len(miptex->name, -1, "sky")) {
+      //   continue;
+      // }
+      struct lmap_s *lm = &lmaps[lmap_lut[face_id]];
+      struct poly_s *poly = mesh_add_poly(mesh, miptex->name);
+      poly->texinfo_id = face->texinfo_id;
+      poly->model_id = k;
+      poly->lightmap_page = lm->page;
+      struct plane_s *plane = &planes[face->plane_id];
+      poly->plane_normal = plane->normal;
+      if (face->side) {
+        poly->plane_normal = vec3_mul(poly->plane_normal, -1.0f);
       }
-      struct vec2_s st, uv;
-      st.x = vec3_dot(surface->vectorS, position) + surface->distS;
-      st.y = vec3_dot(surface->vectorT, position) + surface->distT;
-      lmap_getUV(lm, st.x, st.y, &uv.x, &uv.y);
-      uv.x = (lm->atlas_x + uv.x) / atlas_width;
-      uv.y = 1.0f - (lm->atlas_y + uv.y) / atlas_height;
-      st.x /= miptex->width;
-      st.y = 1.0f - (st.y / miptex->height);
-      guint vertex_idx = mesh_add_get_vertex(mesh, position, st, uv);
-      poly_add_vertex(poly, vertex_idx);
+      for (gint j = 0; j < face->ledge_num; j++) {
+        struct edge_s *edge = edges + ABS(edges_list[face->ledge_id + j]);
+        gint vtx =
+            edges_list[face->ledge_id + j] < 0 ? edge->vertex1 : edge->vertex0;
+        struct vec3_s position = vertices[vtx];
+        if (0 == j) {
+          poly->plane_dist = vec3_dot(poly->plane_normal, position);
+        }
+        struct vec2_s st, uv;
+        st.x = vec3_dot(surface->vectorS, position) + surface->distS;
+        st.y = vec3_dot(surface->vectorT, position) + surface->distT;
+        lmap_getUV(lm, st.x, st.y, &uv.x, &uv.y);
+        uv.x = (lm->atlas_x + uv.x) / atlas_width;
+        uv.y = 1.0f - (lm->atlas_y + uv.y) / atlas_height;
+        st.x /= miptex->width;
+        st.y = 1.0f - (st.y / miptex->height);
+        guint vertex_idx = mesh_add_get_vertex(mesh, position, st, uv);
+        poly_add_vertex(poly, vertex_idx);
+      }
+      build_region(&mesh->texture_atlas->poly_regions[num_regions++], poly, lm,
+                   surface->vectorS, surface->distS, surface->vectorT,
+                   surface->distT);
     }
-    triangulate_poly(poly);
-    build_region(&mesh->texture_atlas->poly_regions[i], poly, lm,
-                 surface->vectorS, surface->distS, surface->vectorT,
-                 surface->distT);
   }
 
   // build_mesh(mesh, texinfos, num_texinfos);
   g_print("# of tex infos: %u\n", num_texinfos);
   build_mesh(mesh, texinfos, num_texinfos, atlas_width, atlas_height,
              vec3_set(DEG2RAD(-90), 0.0f, 0.0f));
+  // brush models get their own glTF nodes whenever the primitives are split
+  // anyway; the default export stays a single unsplit mesh
+  if (opt_chunk_size > 0.0 || (opt_compact_indices && num_models > 1)) {
+    build_mesh_chunks(mesh, (gfloat)opt_chunk_size);
+  }
 
   g_print("mesh built. exporting...\n");
   export_mesh_with_lmap_to_obj(mesh, 0.025f);
   g_print("lightmap OBJ exported.\n");
   export_mesh_with_mats_to_obj(mesh, 0.025f);
   g_print("material OBJ exported.\n");
-  export_mesh_to_gltf(mesh, 0.025f, "mesh.gltf", &err);
+  struct gltf_opts_s gltf_opts = {0};
+  gltf_opts.compact_indices = opt_compact_indices;
+  gltf_opts.texture_arrays = opt_texture_arrays;
+  gltf_opts.diffuse_atlas = opt_diffuse_atlas;
+  // a single channel atlas is what occlusionTexture samples (R)
+  gltf_opts.lightmap_occlusion = lmap_format == LMAP_FORMAT_R8;
+  if (opt_texture_arrays) {
+    export_texture_arrays(mesh);
+  }
+  if (opt_diffuse_atlas) {
+    build_diffuse_atlas(mesh, (guint)MAX(opt_atlas_mips, 1));
+    export_diffuse_atlas(mesh);
+  }
+  export_mesh_to_gltf(mesh, 0.025f, &gltf_opts, "mesh.gltf", &err);
   g_print("GLTF exported.\n");
   if (err != NULL) {
     g_error("%s", err->message);
     g_error_free(err);
   }
-  create_mesh_g_buffer(mesh);
+  struct entities_s ents;
+  GArray *lights = g_array_new(FALSE, FALSE, sizeof(struct light_s));
+  if (parse_entities(&ents, (const gchar *)buf + header->entities.offset,
+                     header->entities.size, &err)) {
+    extract_lights(&ents, lights);
+    g_print("%u entities, %u lights\n", ents.entities->len, lights->len);
+    free_entities(&ents);
+  } else {
+    g_printerr("%s\n", err->message);
+    g_clear_error(&err);
+  }
+  // the baker traces its shadow rays through the world's BSP tree, or a BVH
+  // of its triangles
+  struct bsp_tree_s tree;
+  build_bsp_tree(&tree, buf, header, &models[0]);
+  struct bvh_s bvh = {0};
+  if (opt_bake && opt_bake_bvh) {
+    build_mesh_bvh(&bvh, mesh, casts_shadow, surfaces);
+  }
+  struct bake_opts_s bake = {&tree, opt_bake_bvh ? &bvh : NULL,
+                             (gfloat)MAX(opt_bake_radius, 0.0),
+                             (guint)MAX(opt_bake_samples, 1), 0x5eed};
+  create_mesh_g_buffer(mesh, (struct light_s *)lights->data, lights->len,
+                       opt_bake ? &bake : NULL);
+  free_bvh(&bvh);
+  g_array_free(lights, TRUE);
   g_print("deferred lighting g-buffer created.\n");
 
+  struct vis_s vis;
+  build_vis(&vis, buf, header, &models[0]);
+  export_vis(&vis, "vis.bin", &err);
+  if (err != NULL) {
+    g_error("%s", err->message);
+    g_error_free(err);
+  }
+  free_vis(&vis);
+  g_print("visibility exported.\n");
+
+  export_bsp_tree(&tree, "bsptree.bin", &err);
+  if (err != NULL) {
+    g_error("%s", err->message);
+    g_error_free(err);
+  }
+  free_bsp_tree(&tree);
+  g_print("BSP tree exported.\n");
+
   g_hash_table_unref(map);
   g_string_free(obj, TRUE);
   g_free(buf);
-  for (guint i = 0; i < face_count; i++) {
-    g_free(lmaps[i].data);
-  }
   for (guint i = 0; i < num_texinfos; i++) {
     g_free(texinfos[i].data);
   }
   g_free(texinfos);
+  for (guint i = 0; i < face_count; i++) {
+    free_lmap(&lmaps[i]);
+  }
   g_free(lmaps);
   g_free(lmap_lut);
   g_free(palette);
+  g_free(opt_triangulation);
+  g_free(opt_lightmap_format);
   free_mesh(&mesh);
   g_free(mesh);
   g_print("Done. Goodbye!\n");
   return 0;
 }
-
-void init_lmap(struct lmap_s *lm, gint face_id) {
-  lm->face_id = face_id;
-  lm->mins[0] = lm->mins[1] = G_MAXFLOAT;
-  lm->maxs[0] = lm->maxs[1] = -G_MAXFLOAT;
-}
-
-void lmap_addST(struct lmap_s *lm, gfloat s, gfloat t) {
-  if (s < lm->mins[0])
-    lm->mins[0] = s;
-  if (t < lm->mins[1])
-    lm->mins[1] = t;
-  if (s > lm->maxs[0])
-    lm->maxs[0] = s;
-  if (t > lm->maxs[1])
-    lm->maxs[1] = t;
-}
-
-void calc_lmap(struct lmap_s *lm) {
-  for (gint i = 0; i < 2; i++) {
-    lm->bmins[i] = (gint)floor(lm->mins[i] / 16.0f);
-    lm->bmaxs[i] = (gint)ceil(lm->maxs[i] / 16.0f);
-    lm->tmins[i] = lm->bmins[i] * 16;
-    lm->texts[i] = (lm->bmaxs[i] - lm->bmins[i]) * 16;
-  }
-  lm->width = lm->texts[0] / 16 + 1;
-  lm->height = lm->texts[1] / 16 + 1;
-}
-
-void lmap_getUV(struct lmap_s *lm, gfloat s, gfloat t, gfloat *u, gfloat *v) {
-  if (u != NULL) {
-    *u = (s - lm->tmins[0]) / 16.0f + 0.5f;
-  }
-  if (v != NULL) {
-    *v = (t - lm->tmins[1]) / 16.0f + 0.5f;
-  }
-}
-
-int compare_lmap_fn(const gpointer a, const gpointer b) {
-  const struct lmap_s *lm_a = (const struct lmap_s *)a;
-  const struct lmap_s *lm_b = (const struct lmap_s *)b;
-  if (lm_a->height != lm_b->height) {
-    return lm_b->height - lm_a->height;
-  }
-  if (lm_a->width != lm_b->width) {
-    return lm_b->width - lm_a->width;
-  }
-  return 0;
-}
@@ -0,0 +1,192 @@
+#include "bsptree.h"
+#include <string.h>
+
+// Segments within this distance of a node plane are not split by it
+#define BSP_TRACE_EPSILON 0.1f
+
+struct bsp_trace_s {
+  gint32 node;
+  struct vec3_s a, b;
+};
+
+struct bsp_walk_s {
+  gint32 node;   // lump node index
+  gint32 parent; // flat node index, -1 for the root
+  guint side;
+  guint depth;
+};
+
+void build_bsp_tree(struct bsp_tree_s *tree, const gchar *buf,
+                    const struct header_s *header,
+                    const struct model_s *world) {
+  const struct node_s *nodes =
+      (const struct node_s *)(buf + header->nodes.offset);
+  guint num_bsp_nodes = header->nodes.size / sizeof(struct node_s);
+  const struct plane_s *planes =
+      (const struct plane_s *)(buf + header->planes.offset);
+  guint num_planes = header->planes.size / sizeof(struct plane_s);
+  const struct leaf_s *leaves =
+      (const struct leaf_s *)(buf + header->leaves.offset);
+  guint num_bsp_leaves = header->leaves.size / sizeof(struct leaf_s);
+
+  memset(tree, 0, sizeof(*tree));
+  tree->num_leaves = num_bsp_leaves;
+  tree->leaves = g_new0(struct bsp_flat_leaf_s, MAX(num_bsp_leaves, 1));
+  for (guint i = 0; i < num_bsp_leaves; i++) {
+    tree->leaves[i].contents = leaves[i].contents;
+    memcpy(tree->leaves[i].mins, leaves[i].mins, sizeof(leaves[i].mins));
+    memcpy(tree->leaves[i].maxs, leaves[i].maxs, sizeof(leaves[i].maxs));
+  }
+
+  // re-lay the world's subtree out in pre-order, front child first, so a
+  // descent mostly walks forward through memory
+  GArray *flat = g_array_new(FALSE, FALSE, sizeof(struct bsp_flat_node_s));
+  GArray *stack = g_array_new(FALSE, FALSE, sizeof(struct bsp_walk_s));
+  guint max_depth = 0, num_axial = 0;
+  if (world->node_id0 < num_bsp_nodes) {
+    struct bsp_walk_s root = {(gint32)world->node_id0, -1, 0, 1};
+    g_array_append_val(stack, root);
+  }
+  while (stack->len > 0) {
+    struct bsp_walk_s w =
+        g_array_index(stack, struct bsp_walk_s, stack->len - 1);
+    g_array_set_size(stack, stack->len - 1);
+    max_depth = MAX(max_depth, w.depth);
+
+    const struct node_s *n = &nodes[w.node];
+    struct bsp_flat_node_s f = {0};
+    if (n->plane_id < num_planes) {
+      const struct plane_s *p = &planes[n->plane_id];
+      f.normal = p->normal;
+      f.dist = p->dist;
+      // the axial fast path assumes a +1 normal component, which qbsp
+      // guarantees but a hand-edited map might not
+      f.type = p->type >= 0 && p->type < 3 && p->normal.xyz[p->type] == 1.0f
+                   ? (guint32)p->type
+                   : 3;
+    } else {
+      f.type = 3;
+    }
+    if (f.type < 3) {
+      num_axial++;
+    }
+    gint32 index = (gint32)flat->len;
+    g_array_append_val(flat, f);
+    if (w.parent >= 0) {
+      g_array_index(flat, struct bsp_flat_node_s, w.parent).children[w.side] =
+          index;
+    }
+
+    // push back first so the front child is laid out right after its parent
+    for (gint side = 1; side >= 0; side--) {
+      gint32 child = n->children[side];
+      struct bsp_flat_node_s *self =
+          &g_array_index(flat, struct bsp_flat_node_s, index);
+      if (child < 0 || (guint)child >= num_bsp_nodes) {
+        // leaf, or a corrupt index: route it to the solid leaf
+        guint leaf = child < 0 ? (guint)~child : 0;
+        self->children[side] = ~(gint32)(leaf < num_bsp_leaves ? leaf : 0);
+        continue;
+      }
+      struct bsp_walk_s next = {child, index, (guint)side, w.depth + 1};
+      g_array_append_val(stack, next);
+    }
+  }
+  g_array_free(stack, TRUE);
+
+  tree->num_nodes = flat->len;
+  tree->depth = max_depth;
+  tree->nodes = (struct bsp_flat_node_s *)g_array_free(flat, FALSE);
+
+  g_print("BSP tree: %u nodes (%u axial), %u leaves, depth %u, %u KiB\n",
+          tree->num_nodes, num_axial, tree->num_leaves, max_depth,
+          (guint)((tree->num_nodes * sizeof(struct bsp_flat_node_s) +
+                   tree->num_leaves * sizeof(struct bsp_flat_leaf_s)) >>
+                  10));
+}
+
+// Walks the segment front to back, splitting it at each node plane it
+// crosses and leaving the far part on a stack. A split only happens going
+// down, so the stack never holds more than depth parts.
+gboolean bsp_segment_clear(const struct bsp_tree_s *tree, struct vec3_s a,
+                           struct vec3_s b) {
+  if (tree->num_nodes == 0) {
+    return TRUE;
+  }
+  struct bsp_trace_s *stack = g_newa(struct bsp_trace_s, tree->depth);
+  guint top = 0;
+  gint32 n = 0;
+  for (;;) {
+    while (n >= 0) {
+      const struct bsp_flat_node_s *node = &tree->nodes[n];
+      gfloat da, db;
+      if (node->type < 3) {
+        da = a.xyz[node->type] - node->dist;
+        db = b.xyz[node->type] - node->dist;
+      } else {
+        da = node->normal.x * a.x + node->normal.y * a.y +
+             node->normal.z * a.z - node->dist;
+        db = node->normal.x * b.x + node->normal.y * b.y +
+             node->normal.z * b.z - node->dist;
+      }
+      if (da >= -BSP_TRACE_EPSILON && db >= -BSP_TRACE_EPSILON) {
+        n = node->children[0];
+        continue;
+      }
+      if (da < BSP_TRACE_EPSILON && db < BSP_TRACE_EPSILON) {
+        n = node->children[1];
+        continue;
+      }
+      guint side = da < 0.0f;
+      gfloat frac = da / (da - db);
+      struct vec3_s mid;
+      for (guint k = 0; k < 3; k++) {
+        mid.xyz[k] = a.xyz[k] + (b.xyz[k] - a.xyz[k]) * frac;
+      }
+      stack[top++] = (struct bsp_trace_s){node->children[!side], mid, b};
+      b = mid;
+      n = node->children[side];
+    }
+    if (tree->leaves[~n].contents == CONTENTS_SOLID) {
+      return FALSE;
+    }
+    if (top == 0) {
+      return TRUE;
+    }
+    top--;
+    n = stack[top].node;
+    a = stack[top].a;
+    b = stack[top].b;
+  }
+}
+
+gboolean export_bsp_tree(const struct bsp_tree_s *tree, const gchar *path,
+                         GError **err) {
+  gsize nodes_size = tree->num_nodes * sizeof(struct bsp_flat_node_s);
+  gsize leaves_size = tree->num_leaves * sizeof(struct bsp_flat_leaf_s);
+  gsize size = 3 * sizeof(guint32) + nodes_size + leaves_size;
+
+  guint8 *data = g_malloc(size);
+  guint32 *head = (guint32 *)data;
+  head[0] = BSPTREE_MAGIC;
+  head[1] = tree->num_nodes;
+  head[2] = tree->num_leaves;
+  guint8 *ptr = data + 3 * sizeof(guint32);
+  memcpy(ptr, tree->nodes, nodes_size);
+  ptr += nodes_size;
+  memcpy(ptr, tree->leaves, leaves_size);
+
+  gboolean ok = g_file_set_contents(path, (const gchar *)data, size, err);
+  g_free(data);
+  return ok;
+}
+
+void free_bsp_tree(struct bsp_tree_s *tree) {
+  g_free(tree->nodes);
+  g_free(tree->leaves);
+  tree->nodes = NULL;
+  tree->leaves = NULL;
+  tree->num_nodes = 0;
+  tree->num_leaves = 0;
+  tree->depth = 0;
+}
@@ -0,0 +1,75 @@
+#ifndef _BSPTREE_
+#define _BSPTREE_
+
+#include "bsp.h"
+#include <glib.h>
+
+/*
+ * Flat BSP tree of the world model for fast point location.
+ *
+ * Nodes are stored in depth-first (pre-order) order starting at the root, so
+ * the front child of a node usually follows it in memory. Children >= 0 are
+ * node indices, children < 0 are ~leaf (BSP leaf index, same numbering as
+ * the leaves lump and vis.h).
+ *
+ * bsptree.bin layout (little endian):
+ *   guint32 magic ('BSPT'), num_nodes, num_leaves
+ *   struct bsp_flat_node_s nodes[num_nodes]
+ *   struct bsp_flat_leaf_s leaves[num_leaves]
+ */
+
+#define BSPTREE_MAGIC 0x54505342 // "BSPT"
+
+struct bsp_flat_node_s {
+  struct vec3_s normal;
+  gfloat dist;
+  gint32 children[2]; // front, back
+  guint32 type;       // plane type, 0..2 are axial
+  guint32 pad;        // 32 bytes per node
+};
+
+struct bsp_flat_leaf_s {
+  gint32 contents; // CONTENTS_*
+  gint16 mins[3];
+  gint16 maxs[3];
+};
+
+struct bsp_tree_s {
+  guint num_nodes;
+  guint num_leaves;
+  guint depth; // nodes on the longest root-to-leaf path
+  struct bsp_flat_node_s *nodes;
+  struct bsp_flat_leaf_s *leaves;
+};
+
+// Returns the index of the leaf containing p.
+static inline guint bsp_point_in_leaf(const struct bsp_tree_s *tree,
+                                      struct vec3_s p) {
+  gint32 n = tree->num_nodes > 0 ? 0 : -1;
+  while (n >= 0) {
+    const struct bsp_flat_node_s *node = &tree->nodes[n];
+    gfloat d;
+    if (node->type < 3) {
+      d = p.xyz[node->type] - node->dist;
+    } else {
+      d = node->normal.x * p.x + node->normal.y * p.y + node->normal.z * p.z -
+          node->dist;
+    }
+    n = node->children[d < 0.0f];
+  }
+  return (guint)~n;
+}
+
+// Whether the segment from a to b stays out of solid leaves, the shadow ray
+// test of light.exe's TestLine. Safe to call from several threads.
+extern gboolean bsp_segment_clear(const struct bsp_tree_s *tree,
+                                  struct vec3_s a, struct vec3_s b);
+
+extern void build_bsp_tree(struct bsp_tree_s *tree, const gchar *buf,
+                           const struct header_s *header,
+                           const struct model_s *world);
+extern gboolean export_bsp_tree(const struct bsp_tree_s *tree,
+                                const gchar *path, GError **err);
+extern void free_bsp_tree(struct bsp_tree_s *tree);
+
+#endif // _BSPTREE_
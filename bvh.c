@@ -0,0 +1,485 @@
+#include "bvh.h"
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE 4  // leaves this small are never split
+#define BVH_MAX_LEAF 16  // leaves this large are split even at a loss
+#define BVH_TRAVERSAL_COST 1.0f // of a node visit, in triangle tests
+#define BVH_TASK_MIN 1024 // fewest triangles built as a task of their own
+
+struct bvh_build_s {
+  struct vec3_s *centroids;
+  struct vec3_s *mins, *maxs; // triangle bounds
+  guint32 *order;             // triangles in leaf order once built
+};
+
+// A subtree built on its own thread into its own node array, indices
+// relative to that array
+struct bvh_task_s {
+  guint first, count, depth;
+  GArray *nodes;
+};
+
+// Node above the tasks, built first
+struct bvh_top_s {
+  struct bvh_node_s node;
+  gint children[2]; // indices into the top nodes of an interior node
+  gint task;        // >= 0 when the whole subtree is that task's
+};
+
+static inline gfloat half_area(struct vec3_s min, struct vec3_s max) {
+  gfloat dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+  return dx * dy + dy * dz + dz * dx;
+}
+
+static inline void grow(struct vec3_s *min, struct vec3_s *max,
+                        struct vec3_s p_min, struct vec3_s p_max) {
+  for (guint k = 0; k < 3; k++) {
+    min->xyz[k] = MIN(min->xyz[k], p_min.xyz[k]);
+    max->xyz[k] = MAX(max->xyz[k], p_max.xyz[k]);
+  }
+}
+
+static inline guint centroid_bin(gfloat c, gfloat c_min, gfloat scale) {
+  return MIN((guint)((c - c_min) * scale), BVH_BINS - 1);
+}
+
+// Bounds order[first, first + count) into node and picks the cheapest of
+// BVH_BINS binned SAH splits per axis. Returns the size of the first part
+// after partitioning the range, or 0 if node became a leaf.
+static guint split_range(const struct bvh_build_s *b, guint first,
+                         guint count, guint depth, struct bvh_node_s *node) {
+  struct vec3_s c_min = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);
+  struct vec3_s c_max = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);
+  node->min = c_min;
+  node->max = c_max;
+  for (guint i = first; i < first + count; i++) {
+    guint t = b->order[i];
+    grow(&node->min, &node->max, b->mins[t], b->maxs[t]);
+    grow(&c_min, &c_max, b->centroids[t], b->centroids[t]);
+  }
+  node->index = first;
+  node->count = count;
+  if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+    return 0;
+  }
+
+  gfloat best_cost = G_MAXFLOAT;
+  guint best_axis = 0, best_bin = 0, best_left = 0;
+  for (guint k = 0; k < 3; k++) {
+    gfloat extent = c_max.xyz[k] - c_min.xyz[k];
+    if (extent <= 0.0f) {
+      continue;
+    }
+    gfloat scale = BVH_BINS / extent;
+    guint bin_count[BVH_BINS] = {0};
+    struct vec3_s bin_min[BVH_BINS], bin_max[BVH_BINS];
+    for (guint j = 0; j < BVH_BINS; j++) {
+      bin_min[j] = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);
+      bin_max[j] = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);
+    }
+    for (guint i = first; i < first + count; i++) {
+      guint t = b->order[i];
+      guint j = centroid_bin(b->centroids[t].xyz[k], c_min.xyz[k], scale);
+      bin_count[j]++;
+      grow(&bin_min[j], &bin_max[j], b->mins[t], b->maxs[t]);
+    }
+    // right side areas from the back, then the left side in one sweep
+    gfloat right_area[BVH_BINS];
+    struct vec3_s min = bin_min[BVH_BINS - 1], max = bin_max[BVH_BINS - 1];
+    for (guint j = BVH_BINS - 1; j > 0; j--) {
+      grow(&min, &max, bin_min[j], bin_max[j]);
+      right_area[j] = half_area(min, max);
+    }
+    min = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);
+    max = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);
+    guint left = 0;
+    for (guint j = 0; j + 1 < BVH_BINS; j++) {
+      grow(&min, &max, bin_min[j], bin_max[j]);
+      left += bin_count[j];
+      if (left == 0 || left == count) {
+        continue;
+      }
+      gfloat cost = left * half_area(min, max) +
+                    (count - left) * right_area[j + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = k;
+        best_bin = j;
+        best_left = left;
+      }
+    }
+  }
+
+  if (best_left == 0) {
+    // all centroids in one spot: a large range is halved as it is
+    if (count <= BVH_MAX_LEAF) {
+      return 0;
+    }
+    node->count = 0;
+    return count / 2;
+  }
+  gfloat area = half_area(node->min, node->max);
+  if (BVH_TRAVERSAL_COST * area + best_cost >= count * area &&
+      count <= BVH_MAX_LEAF) {
+    return 0;
+  }
+
+  gfloat scale = BVH_BINS / (c_max.xyz[best_axis] - c_min.xyz[best_axis]);
+  guint i = first, j = first + count;
+  while (i < j) {
+    guint t = b->order[i];
+    if (centroid_bin(b->centroids[t].xyz[best_axis], c_min.xyz[best_axis],
+                     scale) <= best_bin) {
+      i++;
+    } else {
+      b->order[i] = b->order[--j];
+      b->order[j] = t;
+    }
+  }
+  node->count = 0;
+  return best_left;
+}
+
+// Appends the subtree over order[first, first + count) to nodes, depth
+// first.
+static void build_subtree(const struct bvh_build_s *b, guint first,
+                          guint count, guint depth, GArray *nodes) {
+  guint index = nodes->len;
+  struct bvh_node_s node;
+  guint left = split_range(b, first, count, depth, &node);
+  g_array_append_val(nodes, node);
+  if (left == 0) {
+    return;
+  }
+  build_subtree(b, first, left, depth + 1, nodes);
+  g_array_index(nodes, struct bvh_node_s, index).index = nodes->len;
+  build_subtree(b, first + left, count - left, depth + 1, nodes);
+}
+
+static void build_task(gpointer data, gpointer user_data) {
+  struct bvh_task_s *task = data;
+  const struct bvh_build_s *b = user_data;
+  task->nodes = g_array_new(FALSE, FALSE, sizeof(struct bvh_node_s));
+  build_subtree(b, task->first, task->count, task->depth, task->nodes);
+}
+
+// Splits the range down to subtrees of at most task_size triangles, which
+// become tasks. Returns the index of the top node for the range.
+static gint build_top(const struct bvh_build_s *b, guint first, guint count,
+                      guint depth, guint task_size, GArray *top,
+                      GArray *tasks) {
+  gint index = (gint)top->len;
+  struct bvh_top_s t = {.children = {-1, -1}, .task = -1};
+  guint left = 0;
+  if (count <= task_size) {
+    struct bvh_task_s task = {first, count, depth, NULL};
+    t.task = (gint)tasks->len;
+    g_array_append_val(tasks, task);
+  } else {
+    left = split_range(b, first, count, depth, &t.node);
+  }
+  g_array_append_val(top, t);
+  if (left > 0) {
+    gint child0 = build_top(b, first, left, depth + 1, task_size, top, tasks);
+    gint child1 = build_top(b, first + left, count - left, depth + 1,
+                            task_size, top, tasks);
+    g_array_index(top, struct bvh_top_s, index).children[0] = child0;
+    g_array_index(top, struct bvh_top_s, index).children[1] = child1;
+  }
+  return index;
+}
+
+// Lays the top node i and everything below it out depth first, splicing in
+// the tasks' nodes.
+static void emit_top(const GArray *top, gint i, const struct bvh_task_s *tasks,
+                     GArray *nodes) {
+  const struct bvh_top_s *t = &g_array_index(top, struct bvh_top_s, i);
+  if (t->task >= 0) {
+    const GArray *task_nodes = tasks[t->task].nodes;
+    guint base = nodes->len;
+    g_array_append_vals(nodes, task_nodes->data, task_nodes->len);
+    for (guint n = base; n < nodes->len; n++) {
+      struct bvh_node_s *node = &g_array_index(nodes, struct bvh_node_s, n);
+      if (node->count == 0) {
+        node->index += base;
+      }
+    }
+    return;
+  }
+  guint index = nodes->len;
+  g_array_append_val(nodes, t->node);
+  if (t->node.count > 0) {
+    return;
+  }
+  emit_top(top, t->children[0], tasks, nodes);
+  g_array_index(nodes, struct bvh_node_s, index).index = nodes->len;
+  emit_top(top, t->children[1], tasks, nodes);
+}
+
+void build_bvh(struct bvh_s *bvh, const struct vec3_s *verts,
+               const guint32 *ids, guint num_tris) {
+  GTimer *timer = g_timer_new();
+  memset(bvh, 0, sizeof(*bvh));
+  if (num_tris == 0) {
+    g_timer_destroy(timer);
+    return;
+  }
+
+  struct bvh_build_s b;
+  b.centroids = g_new(struct vec3_s, num_tris);
+  b.mins = g_new(struct vec3_s, num_tris);
+  b.maxs = g_new(struct vec3_s, num_tris);
+  b.order = g_new(guint32, num_tris);
+  for (guint i = 0; i < num_tris; i++) {
+    const struct vec3_s *v = &verts[i * 3];
+    b.mins[i] = b.maxs[i] = v[0];
+    grow(&b.mins[i], &b.maxs[i], v[1], v[1]);
+    grow(&b.mins[i], &b.maxs[i], v[2], v[2]);
+    for (guint k = 0; k < 3; k++) {
+      b.centroids[i].xyz[k] = (b.mins[i].xyz[k] + b.maxs[i].xyz[k]) * 0.5f;
+    }
+    b.order[i] = i;
+  }
+
+  // a few tasks per thread, each building its subtree depth first
+  guint task_size =
+      MAX(num_tris / (4 * g_get_num_processors()), BVH_TASK_MIN);
+  GArray *top = g_array_new(FALSE, FALSE, sizeof(struct bvh_top_s));
+  GArray *tasks = g_array_new(FALSE, FALSE, sizeof(struct bvh_task_s));
+  build_top(&b, 0, num_tris, 0, task_size, top, tasks);
+  GThreadPool *pool = g_thread_pool_new(build_task, &b, g_get_num_processors(),
+                                        TRUE, NULL);
+  for (guint i = 0; i < tasks->len; i++) {
+    g_thread_pool_push(pool, &g_array_index(tasks, struct bvh_task_s, i),
+                       NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  GArray *nodes = g_array_new(FALSE, FALSE, sizeof(struct bvh_node_s));
+  emit_top(top, 0, (const struct bvh_task_s *)tasks->data, nodes);
+  for (guint i = 0; i < tasks->len; i++) {
+    g_array_free(g_array_index(tasks, struct bvh_task_s, i).nodes, TRUE);
+  }
+  g_array_free(tasks, TRUE);
+  g_array_free(top, TRUE);
+
+  bvh->num_nodes = nodes->len;
+  bvh->nodes = g_aligned_alloc(nodes->len, sizeof(struct bvh_node_s), 32);
+  memcpy(bvh->nodes, nodes->data, nodes->len * sizeof(struct bvh_node_s));
+  g_array_free(nodes, TRUE);
+  bvh->num_tris = num_tris;
+  bvh->tris = g_new(struct bvh_tri_s, num_tris);
+  for (guint i = 0; i < num_tris; i++) {
+    const struct vec3_s *v = &verts[b.order[i] * 3];
+    struct bvh_tri_s *tri = &bvh->tris[i];
+    tri->v0 = v[0];
+    for (guint k = 0; k < 3; k++) {
+      tri->e1.xyz[k] = v[1].xyz[k] - v[0].xyz[k];
+      tri->e2.xyz[k] = v[2].xyz[k] - v[0].xyz[k];
+    }
+    tri->id = ids[b.order[i]];
+  }
+  g_free(b.centroids);
+  g_free(b.mins);
+  g_free(b.maxs);
+  g_free(b.order);
+
+  guint num_leaves = 0;
+  gdouble sah = 0.0;
+  gfloat root_area = half_area(bvh->nodes[0].min, bvh->nodes[0].max);
+  for (guint i = 0; i < bvh->num_nodes; i++) {
+    const struct bvh_node_s *node = &bvh->nodes[i];
+    gfloat area = root_area > 0.0f
+                      ? half_area(node->min, node->max) / root_area
+                      : 1.0f;
+    num_leaves += node->count > 0;
+    sah += area * (node->count > 0 ? node->count : BVH_TRAVERSAL_COST);
+  }
+  g_print("BVH: %u triangles, %u nodes (%u leaves), SAH cost %.1f, %u KiB, "
+          "built in %.1f ms\n",
+          num_tris, bvh->num_nodes, num_leaves, sah,
+          (guint)((bvh->num_nodes * sizeof(struct bvh_node_s) +
+                   num_tris * sizeof(struct bvh_tri_s)) >>
+                  10),
+          g_timer_elapsed(timer, NULL) * 1000.0);
+  g_timer_destroy(timer);
+}
+
+struct bvh_ray_s {
+  struct vec3_s origin, dir, inv_dir;
+#ifdef __SSE2__
+  __m128 origin4, inv_dir4;
+#endif
+};
+
+// Slab test of the ray against a node's box, clipped to [0, max_t]. near
+// is where the ray enters it.
+static inline gboolean ray_box(const struct bvh_ray_s *ray,
+                               const struct bvh_node_s *node, gfloat max_t,
+                               gfloat *near) {
+#ifdef __SSE2__
+  // one axis per lane; the fourth lane (index, count) is masked off
+  const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->min.xyz), ray->origin4),
+                         ray->inv_dir4);
+  __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node->max.xyz), ray->origin4),
+                         ray->inv_dir4);
+  __m128 t_near = _mm_and_ps(xyz, _mm_min_ps(t0, t1));
+  __m128 t_far = _mm_or_ps(_mm_and_ps(xyz, _mm_max_ps(t0, t1)),
+                           _mm_andnot_ps(xyz, _mm_set1_ps(max_t)));
+  t_near = _mm_max_ps(t_near, _mm_shuffle_ps(t_near, t_near, 0x4e));
+  t_near = _mm_max_ps(t_near, _mm_shuffle_ps(t_near, t_near, 0xb1));
+  t_far = _mm_min_ps(t_far, _mm_shuffle_ps(t_far, t_far, 0x4e));
+  t_far = _mm_min_ps(t_far, _mm_shuffle_ps(t_far, t_far, 0xb1));
+  *near = _mm_cvtss_f32(t_near);
+  return _mm_comile_ss(t_near, t_far);
+#else
+  gfloat t_near = 0.0f, t_far = max_t;
+  for (guint k = 0; k < 3; k++) {
+    gfloat t0 = (node->min.xyz[k] - ray->origin.xyz[k]) * ray->inv_dir.xyz[k];
+    gfloat t1 = (node->max.xyz[k] - ray->origin.xyz[k]) * ray->inv_dir.xyz[k];
+    t_near = MAX(t_near, MIN(t0, t1));
+    t_far = MIN(t_far, MAX(t0, t1));
+  }
+  *near = t_near;
+  return t_near <= t_far;
+#endif
+}
+
+// Moller-Trumbore: whether the ray hits tri with 0 < t < max_t.
+static inline gboolean ray_tri(const struct bvh_ray_s *ray,
+                               const struct bvh_tri_s *tri, gfloat max_t,
+                               struct bvh_hit_s *hit) {
+  const struct vec3_s *d = &ray->dir, *e1 = &tri->e1, *e2 = &tri->e2;
+  gfloat px = d->y * e2->z - d->z * e2->y;
+  gfloat py = d->z * e2->x - d->x * e2->z;
+  gfloat pz = d->x * e2->y - d->y * e2->x;
+  gfloat det = e1->x * px + e1->y * py + e1->z * pz;
+  if (det == 0.0f) {
+    return FALSE;
+  }
+  gfloat inv_det = 1.0f / det;
+  gfloat sx = ray->origin.x - tri->v0.x;
+  gfloat sy = ray->origin.y - tri->v0.y;
+  gfloat sz = ray->origin.z - tri->v0.z;
+  gfloat u = (sx * px + sy * py + sz * pz) * inv_det;
+  if (u < 0.0f || u > 1.0f) {
+    return FALSE;
+  }
+  gfloat qx = sy * e1->z - sz * e1->y;
+  gfloat qy = sz * e1->x - sx * e1->z;
+  gfloat qz = sx * e1->y - sy * e1->x;
+  gfloat v = (d->x * qx + d->y * qy + d->z * qz) * inv_det;
+  if (v < 0.0f || u + v > 1.0f) {
+    return FALSE;
+  }
+  gfloat t = (e2->x * qx + e2->y * qy + e2->z * qz) * inv_det;
+  if (!(t > 0.0f && t < max_t)) {
+    return FALSE;
+  }
+  hit->t = t;
+  hit->u = u;
+  hit->v = v;
+  hit->id = tri->id;
+  return TRUE;
+}
+
+// Front to back: of two children hit, the nearer is visited first and the
+// other waits on the stack with its entry distance, skipped once a closer
+// hit is known. any stops at the first hit.
+static gboolean traverse(const struct bvh_s *bvh, struct vec3_s origin,
+                         struct vec3_s dir, gfloat max_t, gboolean any,
+                         struct bvh_hit_s *hit) {
+  struct {
+    guint node;
+    gfloat near;
+  } stack[BVH_MAX_DEPTH];
+  guint top = 0;
+  struct bvh_ray_s ray;
+  ray.origin = origin;
+  ray.dir = dir;
+  for (guint k = 0; k < 3; k++) {
+    ray.inv_dir.xyz[k] = 1.0f / dir.xyz[k];
+  }
+#ifdef __SSE2__
+  ray.origin4 = _mm_set_ps(0.0f, origin.z, origin.y, origin.x);
+  ray.inv_dir4 =
+      _mm_set_ps(0.0f, ray.inv_dir.z, ray.inv_dir.y, ray.inv_dir.x);
+#endif
+
+  gfloat near;
+  if (bvh->num_nodes == 0 || !ray_box(&ray, &bvh->nodes[0], max_t, &near)) {
+    return FALSE;
+  }
+  gboolean found = FALSE;
+  guint n = 0;
+  for (;;) {
+    const struct bvh_node_s *node = &bvh->nodes[n];
+    if (node->count > 0) {
+      for (guint i = node->index; i < node->index + node->count; i++) {
+        if (ray_tri(&ray, &bvh->tris[i], max_t, hit)) {
+          if (any) {
+            return TRUE;
+          }
+          found = TRUE;
+          max_t = hit->t;
+        }
+      }
+    } else {
+      guint a = n + 1, b = node->index;
+      gfloat near_a, near_b;
+      gboolean hit_a = ray_box(&ray, &bvh->nodes[a], max_t, &near_a);
+      gboolean hit_b = ray_box(&ray, &bvh->nodes[b], max_t, &near_b);
+      if (hit_a && hit_b) {
+        gboolean b_first = near_b < near_a;
+        stack[top].node = b_first ? a : b;
+        stack[top].near = b_first ? near_a : near_b;
+        top++;
+        n = b_first ? b : a;
+        continue;
+      }
+      if (hit_a || hit_b) {
+        n = hit_a ? a : b;
+        continue;
+      }
+    }
+    while (top > 0 && stack[top - 1].near > max_t) {
+      top--;
+    }
+    if (top == 0) {
+      return found;
+    }
+    n = stack[--top].node;
+  }
+}
+
+gboolean bvh_intersect(const struct bvh_s *bvh, struct vec3_s origin,
+                       struct vec3_s dir, gfloat max_t,
+                       struct bvh_hit_s *hit) {
+  struct bvh_hit_s closest;
+  if (!traverse(bvh, origin, dir, max_t, FALSE, &closest)) {
+    return FALSE;
+  }
+  *hit = closest;
+  return TRUE;
+}
+
+gboolean bvh_occluded(const struct bvh_s *bvh, struct vec3_s origin,
+                      struct vec3_s dir, gfloat max_t) {
+  struct bvh_hit_s hit;
+  return traverse(bvh, origin, dir, max_t, TRUE, &hit);
+}
+
+void free_bvh(struct bvh_s *bvh) {
+  g_aligned_free(bvh->nodes);
+  g_free(bvh->tris);
+  bvh->nodes = NULL;
+  bvh->tris = NULL;
+  bvh->num_nodes = 0;
+  bvh->num_tris = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _BVH_
+#define _BVH_
+
+#include "vec.h"
+#include <glib.h>
+
+/*
+ * Bounding volume hierarchy over triangles, for ray queries: closest hits
+ * (picking), any hit before a distance (shadow rays, line of sight).
+ *
+ * Built with binned SAH, large subtrees in parallel. Nodes are 32 bytes in
+ * depth-first order: an interior node's first child follows it, index holds
+ * the second; a leaf holds count triangles from tris[index]. Triangles are
+ * stored in leaf order as a vertex and two edges, ready for the ray test.
+ */
+
+#define BVH_MAX_DEPTH 64
+
+struct bvh_node_s {
+  struct vec3_s min;
+  guint32 index; // interior: second child, leaf: first triangle
+  struct vec3_s max;
+  guint32 count; // triangles in a leaf, 0 for an interior node
+};
+
+struct bvh_tri_s {
+  struct vec3_s v0, e1, e2; // v1 - v0, v2 - v0
+  guint32 id;               // caller's id, e.g. the mesh poly
+};
+
+struct bvh_s {
+  guint num_nodes;
+  guint num_tris;
+  struct bvh_node_s *nodes; // 32-byte aligned
+  struct bvh_tri_s *tris;
+};
+
+struct bvh_hit_s {
+  gfloat t;    // along the ray direction, in units of its length
+  gfloat u, v; // barycentric coordinates of v1 and v2
+  guint32 id;
+};
+
+// verts holds three vertices per triangle, ids one id per triangle.
+extern void build_bvh(struct bvh_s *bvh, const struct vec3_s *verts,
+                      const guint32 *ids, guint num_tris);
+// Closest hit with 0 < t < max_t; hit is only written when there is one.
+extern gboolean bvh_intersect(const struct bvh_s *bvh, struct vec3_s origin,
+                              struct vec3_s dir, gfloat max_t,
+                              struct bvh_hit_s *hit);
+// Whether anything lies on the ray with 0 < t < max_t. With dir = b - a and
+// max_t = 1, whether the segment from a to b is blocked.
+extern gboolean bvh_occluded(const struct bvh_s *bvh, struct vec3_s origin,
+                             struct vec3_s dir, gfloat max_t);
+extern void free_bvh(struct bvh_s *bvh);
+
+#endif // _BVH_
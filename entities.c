@@ -0,0 +1,262 @@
+#include "entities.h"
+#include <string.h>
+
+static guint ent_str_hash(gconstpointer key) {
+  const struct ent_str_s *s = key;
+  guint h = 5381;
+  for (guint i = 0; i < s->len; i++) {
+    h = h * 33 + (guchar)s->str[i];
+  }
+  return h;
+}
+
+static gboolean ent_str_eq(gconstpointer a, gconstpointer b) {
+  const struct ent_str_s *sa = a, *sb = b;
+  return sa->len == sb->len && memcmp(sa->str, sb->str, sa->len) == 0;
+}
+
+gboolean ent_str_equal(const struct ent_str_s *s, const gchar *str) {
+  gsize len = strlen(str);
+  return s->len == len && memcmp(s->str, str, len) == 0;
+}
+
+// Next token after *pos, COM_Parse style: whitespace and // comments are
+// skipped, a token is either quoted or runs to the next whitespace, and { }
+// are tokens of their own. FALSE at the end of the lump.
+static gboolean next_token(const gchar *lump, gsize size, gsize *pos,
+                           struct ent_str_s *token, gboolean *quoted) {
+  gsize p = *pos;
+  for (;;) {
+    while (p < size && (guchar)lump[p] <= ' ') {
+      p++;
+    }
+    if (p + 1 < size && lump[p] == '/' && lump[p + 1] == '/') {
+      while (p < size && lump[p] != '\n') {
+        p++;
+      }
+      continue;
+    }
+    break;
+  }
+  // the lump is NUL terminated, which ends it as well
+  if (p >= size || lump[p] == '\0') {
+    *pos = p;
+    return FALSE;
+  }
+
+  *quoted = lump[p] == '"';
+  if (*quoted) {
+    gsize start = ++p;
+    while (p < size && lump[p] != '"') {
+      p++;
+    }
+    token->str = lump + start;
+    token->len = p - start;
+    *pos = MIN(p + 1, size);
+    return TRUE;
+  }
+  gsize start = p;
+  if (lump[p] == '{' || lump[p] == '}') {
+    p++;
+  } else {
+    while (p < size && (guchar)lump[p] > ' ' && lump[p] != '{' &&
+           lump[p] != '}' && lump[p] != '"') {
+      p++;
+    }
+  }
+  token->str = lump + start;
+  token->len = p - start;
+  *pos = p;
+  return TRUE;
+}
+
+static gboolean is_brace(const struct ent_str_s *token, gboolean quoted,
+                         gchar brace) {
+  return !quoted && token->len == 1 && token->str[0] == brace;
+}
+
+static gboolean tokenize_entities(struct entities_s *ents, const gchar *lump,
+                                  gsize size, GError **err) {
+  gsize pos = 0;
+  struct ent_str_s token;
+  gboolean quoted;
+  while (next_token(lump, size, &pos, &token, &quoted)) {
+    if (!is_brace(&token, quoted, '{')) {
+      g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                  "entities: expected '{' at byte %" G_GSIZE_FORMAT,
+                  (gsize)(token.str - lump));
+      return FALSE;
+    }
+    struct entity_s entity = {ents->pairs->len, 0, {"", 0}};
+    for (;;) {
+      struct ent_pair_s pair;
+      if (!next_token(lump, size, &pos, &pair.key, &quoted)) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "entities: entity %u is not closed", ents->entities->len);
+        return FALSE;
+      }
+      if (is_brace(&pair.key, quoted, '}')) {
+        break;
+      }
+      if (!next_token(lump, size, &pos, &pair.value, &quoted) ||
+          is_brace(&pair.value, quoted, '}')) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "entities: key without a value at byte %" G_GSIZE_FORMAT,
+                    (gsize)(pair.key.str - lump));
+        return FALSE;
+      }
+      if (ent_str_equal(&pair.key, "classname")) {
+        entity.classname = pair.value;
+      }
+      g_array_append_val(ents->pairs, pair);
+      entity.num_pairs++;
+    }
+    g_array_append_val(ents->entities, entity);
+  }
+  return TRUE;
+}
+
+gboolean parse_entities(struct entities_s *ents, const gchar *lump,
+                        gsize size, GError **err) {
+  ents->pairs = g_array_new(FALSE, FALSE, sizeof(struct ent_pair_s));
+  ents->entities = g_array_new(FALSE, FALSE, sizeof(struct entity_s));
+  ents->by_classname = g_hash_table_new_full(
+      ent_str_hash, ent_str_eq, NULL, (GDestroyNotify)g_array_unref);
+  if (!tokenize_entities(ents, lump, size, err)) {
+    free_entities(ents);
+    return FALSE;
+  }
+
+  // keys point into the entities array, which no longer grows
+  for (guint i = 0; i < ents->entities->len; i++) {
+    struct entity_s *entity =
+        &g_array_index(ents->entities, struct entity_s, i);
+    GArray *list = g_hash_table_lookup(ents->by_classname, &entity->classname);
+    if (list == NULL) {
+      list = g_array_new(FALSE, FALSE, sizeof(guint));
+      g_hash_table_insert(ents->by_classname, &entity->classname, list);
+    }
+    g_array_append_val(list, i);
+  }
+  return TRUE;
+}
+
+void free_entities(struct entities_s *ents) {
+  g_hash_table_destroy(ents->by_classname);
+  g_array_free(ents->entities, TRUE);
+  g_array_free(ents->pairs, TRUE);
+}
+
+const struct ent_str_s *entity_value(const struct entities_s *ents,
+                                     guint entity, const gchar *key) {
+  const struct entity_s *e =
+      &g_array_index(ents->entities, struct entity_s, entity);
+  // later keys win, as in ED_ParseEdict
+  for (guint i = e->num_pairs; i-- > 0;) {
+    const struct ent_pair_s *pair =
+        &g_array_index(ents->pairs, struct ent_pair_s, e->first_pair + i);
+    if (ent_str_equal(&pair->key, key)) {
+      return &pair->value;
+    }
+  }
+  return NULL;
+}
+
+const GArray *entities_by_classname(const struct entities_s *ents,
+                                    const gchar *classname) {
+  struct ent_str_s key = {classname, strlen(classname)};
+  return g_hash_table_lookup(ents->by_classname, &key);
+}
+
+// Values are short numbers; they are copied to terminate them for strtod.
+static gboolean parse_floats(const struct ent_str_s *s, gfloat *values,
+                             guint count) {
+  gchar buf[64];
+  if (s->len >= sizeof(buf)) {
+    return FALSE;
+  }
+  memcpy(buf, s->str, s->len);
+  buf[s->len] = '\0';
+  gchar *p = buf;
+  for (guint i = 0; i < count; i++) {
+    gchar *end;
+    values[i] = (gfloat)g_ascii_strtod(p, &end);
+    if (end == p) {
+      return FALSE;
+    }
+    p = end;
+  }
+  return TRUE;
+}
+
+gboolean ent_str_to_float(const struct ent_str_s *s, gfloat *value) {
+  return parse_floats(s, value, 1);
+}
+
+gboolean ent_str_to_vec3(const struct ent_str_s *s, struct vec3_s *value) {
+  return parse_floats(s, value->xyz, 3);
+}
+
+static gint compare_guint_fn(gconstpointer a, gconstpointer b) {
+  guint ia = *(const guint *)a, ib = *(const guint *)b;
+  return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+void extract_lights(const struct entities_s *ents, GArray *lights) {
+  // light, light_fluoro, light_globe, light_torch_small_walltorch, ...; kept
+  // in lump order so lighting sums them in a stable order
+  GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, ents->by_classname);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    const struct ent_str_s *classname = key;
+    const GArray *list = value;
+    if (classname->len >= 5 && memcmp(classname->str, "light", 5) == 0 &&
+        (classname->len == 5 || classname->str[5] == '_')) {
+      g_array_append_vals(indices, list->data, list->len);
+    }
+  }
+  g_array_sort(indices, compare_guint_fn);
+  // style of each targetname, in order of first appearance
+  GHashTable *target_styles = g_hash_table_new(ent_str_hash, ent_str_eq);
+
+  for (guint i = 0; i < indices->len; i++) {
+    guint entity = g_array_index(indices, guint, i);
+    const struct ent_str_s *s;
+    struct light_s light = {vec3_set(0.0f, 0.0f, 0.0f), 300.0f, 1.0f, 0};
+    if ((s = entity_value(ents, entity, "origin")) == NULL ||
+        !ent_str_to_vec3(s, &light.origin)) {
+      continue;
+    }
+    if ((s = entity_value(ents, entity, "light")) != NULL) {
+      ent_str_to_float(s, &light.light);
+    }
+    if ((s = entity_value(ents, entity, "wait")) != NULL) {
+      ent_str_to_float(s, &light.wait);
+      if (light.wait <= 0.0f) {
+        light.wait = 1.0f;
+      }
+    }
+    gfloat style;
+    if ((s = entity_value(ents, entity, "style")) != NULL &&
+        ent_str_to_float(s, &style)) {
+      light.style = (guint)CLAMP(style, 0.0f, 254.0f);
+    }
+    // light.exe gives targeted (switchable) lights styles from 32 on, one
+    // per targetname, so each switch toggles only its own lights
+    const struct ent_str_s *target = entity_value(ents, entity, "targetname");
+    if (light.style == 0 && target) {
+      gpointer style_ptr = g_hash_table_lookup(target_styles, target);
+      if (style_ptr == NULL) {
+        guint next = 32 + g_hash_table_size(target_styles);
+        style_ptr = GUINT_TO_POINTER(MIN(next, 254));
+        g_hash_table_insert(target_styles, (gpointer)target, style_ptr);
+      }
+      light.style = GPOINTER_TO_UINT(style_ptr);
+    }
+    g_array_append_val(lights, light);
+  }
+  g_hash_table_destroy(target_styles);
+  g_array_free(indices, TRUE);
+}
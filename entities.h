@@ -0,0 +1,65 @@
+#ifndef _ENTITIES_
+#define _ENTITIES_
+
+#include "bsp.h"
+#include "vec.h"
+#include <glib.h>
+
+/*
+ * The entities lump: a list of { "key" "value" ... } blocks, in Quake's
+ * COM_Parse syntax (quoted or bare tokens, // comments).
+ *
+ * Keys and values are views into the lump, nothing is copied or terminated,
+ * so the lump has to outlive the parsed entities. Entities are indexed by
+ * classname.
+ */
+
+struct ent_str_s {
+  const gchar *str; // not NUL terminated
+  guint len;
+};
+
+struct ent_pair_s {
+  struct ent_str_s key, value;
+};
+
+struct entity_s {
+  guint first_pair, num_pairs; // into entities_s.pairs
+  struct ent_str_s classname;  // empty if the entity has none
+};
+
+struct entities_s {
+  GArray *pairs;            // array of struct ent_pair_s
+  GArray *entities;         // array of struct entity_s, in lump order
+  GHashTable *by_classname; // key: struct ent_str_s*, value: GArray of guint
+};
+
+// A light entity (light, light_fluoro, light_torch_small_walltorch, ...), with
+// light.exe's defaults for missing keys.
+struct light_s {
+  struct vec3_s origin;
+  gfloat light; // intensity at the origin, 300 if not set
+  gfloat wait;  // scale of the linear falloff with distance, 1 if not set
+  guint style;  // lightstyle, 0 for static lights
+};
+
+extern gboolean parse_entities(struct entities_s *ents, const gchar *lump,
+                               gsize size, GError **err);
+extern void free_entities(struct entities_s *ents);
+
+// Value of key in entity, NULL if it has no such key
+extern const struct ent_str_s *entity_value(const struct entities_s *ents,
+                                            guint entity, const gchar *key);
+// Indices of the entities with this classname, NULL if there are none
+extern const GArray *entities_by_classname(const struct entities_s *ents,
+                                           const gchar *classname);
+
+extern gboolean ent_str_equal(const struct ent_str_s *s, const gchar *str);
+extern gboolean ent_str_to_float(const struct ent_str_s *s, gfloat *value);
+extern gboolean ent_str_to_vec3(const struct ent_str_s *s,
+                                struct vec3_s *value);
+
+// Appends every light entity to lights (array of struct light_s)
+extern void extract_lights(const struct entities_s *ents, GArray *lights);
+
+#endif // _ENTITIES_
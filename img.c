@@ -1,47 +1,49 @@
 #include "img.h"
+#include <math.h>
 
-void downsample_image(const struct img_s *img_src, struct img_s *img_dst) {
-  float h_scale = (float)img_dst->h / (float)img_src->h;
-  float w_scale = (float)img_dst->w / (float)img_src->w;
-
-  struct rgbsum_s {
-    guint r;
-    guint g;
-    guint b;
-    guint a;
-    guint count;
-  };
-  struct rgbsum_s *vals = g_new0(struct rgbsum_s, img_dst->w * img_dst->h);
-  for (guint y = 0; y < img_src->h; y++) {
-    for (guint x = 0; x < img_src->w; x++) {
-
-      guint src_idx = y * img_src->w + x;
-      guint dst_x = (guint)(x * w_scale);
-      guint dst_y = (guint)(y * h_scale);
-      guint dst_idx = dst_y * img_dst->w + dst_x;
-      struct rgba_s color = img_src->data[src_idx];
-      vals[dst_idx].r += color.r;
-      vals[dst_idx].g += color.g;
-      vals[dst_idx].b += color.b;
-      vals[dst_idx].a += color.a;
-      vals[dst_idx].count++;
-    }
-  }
-#define RGBA_MAX(a) ((a) > 255 ? 255 : (a))
+// Filter weights of the source texels for each destination texel along one
+// axis: a tent as wide as the scale, centered so that the first and last
+// destination texels sit on the first and last source texels.
+static void tent_span(guint dst_i, guint src_n, guint dst_n, gint *first,
+                      gint *last, gfloat *center, gfloat *radius) {
+  gfloat scale =
+      dst_n > 1 ? (gfloat)(src_n - 1) / (gfloat)(dst_n - 1) : (gfloat)src_n;
+  *center = dst_n > 1 ? dst_i * scale : (src_n - 1) * 0.5f;
+  *radius = MAX(scale, 1.0f);
+  *first = MAX((gint)ceilf(*center - *radius), 0);
+  *last = MIN((gint)floorf(*center + *radius), (gint)src_n - 1);
+}
 
-  for (guint i = 0; i < img_dst->w * img_dst->h; i++) {
-    if (vals[i].count > 0) {
-      img_dst->data[i].r = RGBA_MAX(vals[i].r / vals[i].count);
-      img_dst->data[i].g = RGBA_MAX(vals[i].g / vals[i].count);
-      img_dst->data[i].b = RGBA_MAX(vals[i].b / vals[i].count);
-      img_dst->data[i].a = RGBA_MAX(vals[i].a / vals[i].count);
-    } else {
-      img_dst->data[i].r = 0;
-      img_dst->data[i].g = 0;
-      img_dst->data[i].b = 0;
-      img_dst->data[i].a = 0;
+void downsample_image(const struct img_s *img_src, struct img_s *img_dst) {
+  for (guint dy = 0; dy < img_dst->h; dy++) {
+    gint y0, y1;
+    gfloat cy, ry;
+    tent_span(dy, img_src->h, img_dst->h, &y0, &y1, &cy, &ry);
+    for (guint dx = 0; dx < img_dst->w; dx++) {
+      gint x0, x1;
+      gfloat cx, rx;
+      tent_span(dx, img_src->w, img_dst->w, &x0, &x1, &cx, &rx);
+      gfloat sum[4] = {0.0f};
+      gfloat weight_sum = 0.0f;
+      for (gint y = y0; y <= y1; y++) {
+        gfloat wy = 1.0f - fabsf(y - cy) / ry;
+        for (gint x = x0; x <= x1; x++) {
+          gfloat w = wy * (1.0f - fabsf(x - cx) / rx);
+          if (w <= 0.0f) {
+            continue;
+          }
+          const struct rgba_s *color = &img_src->data[y * img_src->w + x];
+          for (guint c = 0; c < 4; c++) {
+            sum[c] += w * color->rgba[c];
+          }
+          weight_sum += w;
+        }
+      }
+      struct rgba_s *out = &img_dst->data[dy * img_dst->w + dx];
+      for (guint c = 0; c < 4; c++) {
+        out->rgba[c] = (guint8)CLAMP_COLOR_COMPONENT(
+            (gint)(sum[c] / weight_sum + 0.5f));
+      }
     }
   }
-#undef RGBA_MAX
-  g_free(vals);
-}
\ No newline at end of file
+}
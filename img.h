@@ -31,4 +31,6 @@ struct rgba_s {
   };
 };
 
+// Shrinks img_src to img_dst's size; the corner texel centers stay in place,
+// so bilinear sampling of img_dst approximates img_src.
 void downsample_image(const struct img_s *img_src, struct img_s *img_dst);
@@ -0,0 +1,854 @@
+#include "lmap.h"
+#include "img.h"
+#include "lodepng.h"
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void skyline_init(struct skyline_s *sky, guint width, guint max_height,
+                  guint base_y) {
+  sky->width = width;
+  sky->max_height = max_height;
+  sky->segs = g_array_new(FALSE, FALSE, sizeof(struct skyline_seg_s));
+  struct skyline_seg_s seg = {0, base_y, width};
+  g_array_append_val(sky->segs, seg);
+}
+
+// Finds the bottom-left position for a w x h block: starting at segment i it
+// rests on the highest segment it spans, the lowest such position (leftmost
+// on ties) wins. Also returns the area left empty under the block.
+static gboolean skyline_find(const struct skyline_s *sky, guint w, guint h,
+                             guint *seg, guint *y, guint64 *waste) {
+  const struct skyline_seg_s *segs =
+      (const struct skyline_seg_s *)sky->segs->data;
+  guint num_segs = sky->segs->len;
+  guint best_y = G_MAXUINT, best_i = 0;
+  for (guint i = 0; i < num_segs && segs[i].x + w <= sky->width; i++) {
+    guint top = 0, covered = 0;
+    for (guint j = i; covered < w && top < best_y; j++) {
+      top = MAX(top, segs[j].y);
+      covered += segs[j].w;
+    }
+    if (top < best_y) {
+      best_y = top;
+      best_i = i;
+    }
+  }
+  if (best_y == G_MAXUINT || best_y + h > sky->max_height) {
+    return FALSE;
+  }
+  *waste = 0;
+  guint x1 = segs[best_i].x + w;
+  for (guint j = best_i; j < num_segs && segs[j].x < x1; j++) {
+    guint span = MIN(segs[j].x + segs[j].w, x1) - segs[j].x;
+    *waste += (guint64)(best_y - segs[j].y) * span;
+  }
+  *seg = best_i;
+  *y = best_y;
+  return TRUE;
+}
+
+// Places a w x h block at segment i, height y. Segments it covers are
+// replaced by one segment on top of it.
+static void skyline_place(struct skyline_s *sky, guint i, guint w, guint h,
+                          guint y) {
+  struct skyline_seg_s *segs = (struct skyline_seg_s *)sky->segs->data;
+  guint num_segs = sky->segs->len;
+  guint x0 = segs[i].x, x1 = x0 + w;
+  // drop the segments under the block, trim the one sticking out right
+  guint end = i;
+  while (end < num_segs && segs[end].x + segs[end].w <= x1) {
+    end++;
+  }
+  if (end < num_segs && segs[end].x < x1) {
+    segs[end].w -= x1 - segs[end].x;
+    segs[end].x = x1;
+  }
+  g_array_remove_range(sky->segs, i, end - i);
+  struct skyline_seg_s seg = {x0, y + h, w};
+  g_array_insert_val(sky->segs, i, seg);
+
+  // merge with equally high neighbours
+  segs = (struct skyline_seg_s *)sky->segs->data;
+  if (i + 1 < sky->segs->len && segs[i + 1].y == seg.y) {
+    segs[i].w += segs[i + 1].w;
+    g_array_remove_index(sky->segs, i + 1);
+  }
+  if (i > 0 && segs[i - 1].y == seg.y) {
+    segs[i - 1].w += segs[i].w;
+    g_array_remove_index(sky->segs, i);
+  }
+}
+
+gboolean skyline_pack(struct skyline_s *sky, guint w, guint h, guint *x,
+                      guint *y) {
+  guint i;
+  guint64 waste;
+  if (!skyline_find(sky, w, h, &i, y, &waste)) {
+    return FALSE;
+  }
+  *x = g_array_index(sky->segs, struct skyline_seg_s, i).x;
+  skyline_place(sky, i, w, h, *y);
+  return TRUE;
+}
+
+// Tries the block both ways round and keeps the orientation with the lower top
+// edge, then the one that leaves less empty area under it.
+gboolean skyline_pack_rotated(struct skyline_s *sky, guint w, guint h,
+                              guint *x, guint *y, gboolean *rotated) {
+  guint i, i_rot, y_rot;
+  guint64 waste, waste_rot;
+  gboolean fits = skyline_find(sky, w, h, &i, y, &waste);
+  gboolean fits_rot =
+      w != h && skyline_find(sky, h, w, &i_rot, &y_rot, &waste_rot);
+  if (!fits && !fits_rot) {
+    return FALSE;
+  }
+  guint top = *y + h, top_rot = y_rot + w;
+  *rotated = !fits || (fits_rot && (top_rot < top || (top_rot == top &&
+                                                      waste_rot < waste)));
+  if (*rotated) {
+    i = i_rot;
+    *y = y_rot;
+    guint tmp = w;
+    w = h;
+    h = tmp;
+  }
+  *x = g_array_index(sky->segs, struct skyline_seg_s, i).x;
+  skyline_place(sky, i, w, h, *y);
+  return TRUE;
+}
+
+guint skyline_height(const struct skyline_s *sky) {
+  guint height = 0;
+  for (guint i = 0; i < sky->segs->len; i++) {
+    height = MAX(height, g_array_index(sky->segs, struct skyline_seg_s, i).y);
+  }
+  return height;
+}
+
+void skyline_free(struct skyline_s *sky) {
+  g_array_free(sky->segs, TRUE);
+  sky->segs = NULL;
+}
+
+static gboolean skyline_pack_lmap(struct skyline_s *sky,
+                                  const struct lmap_s *lm, gboolean rotate,
+                                  guint *x, guint *y, gboolean *rotated) {
+  if (rotate) {
+    return skyline_pack_rotated(sky, lm->block_w, lm->block_h, x, y, rotated);
+  }
+  *rotated = FALSE;
+  return skyline_pack(sky, lm->block_w, lm->block_h, x, y);
+}
+
+// Skyline-packs the (sorted) lightmaps into an atlas of the given width.
+// Returns the height used, or G_MAXUINT if a lightmap does not fit the width.
+// Positions are only written back when place is set.
+static guint skyline_pack_lmaps(struct lmap_s *lmaps, guint num_lmaps,
+                                guint atlas_width, gboolean rotate,
+                                gboolean place) {
+  struct skyline_s sky;
+  skyline_init(&sky, atlas_width, G_MAXUINT, 1);
+  guint max_height = 1;
+  for (guint i = 0; i < num_lmaps; i++) {
+    struct lmap_s *lm = &lmaps[i];
+    guint x, y;
+    gboolean rotated;
+    if (!skyline_pack_lmap(&sky, lm, rotate, &x, &y, &rotated)) {
+      skyline_free(&sky);
+      return G_MAXUINT;
+    }
+    if (place) {
+      lm->atlas_x = x;
+      lm->atlas_y = y;
+      lm->page = 0;
+      lm->rotated = rotated;
+    }
+    max_height = MAX(max_height, y + (rotated ? lm->block_w : lm->block_h));
+  }
+  skyline_free(&sky);
+  return max_height;
+}
+
+static guint next_pow2(guint x) {
+  guint p = 1;
+  while (p < x) {
+    p <<= 1;
+  }
+  return p;
+}
+
+// Orders lightmaps by their longer, then their shorter side, the way they can
+// be turned in the atlas.
+static gint compare_lmap_rotated_fn(gconstpointer a, gconstpointer b,
+                                    gpointer user_data) {
+  const struct lmap_s *lm_a = (const struct lmap_s *)a;
+  const struct lmap_s *lm_b = (const struct lmap_s *)b;
+  if ((lm_a->share >= 0) != (lm_b->share >= 0)) {
+    return lm_a->share >= 0 ? 1 : -1;
+  }
+  gint long_a = MAX(lm_a->block_w, lm_a->block_h);
+  gint long_b = MAX(lm_b->block_w, lm_b->block_h);
+  if (long_a != long_b) {
+    return long_b - long_a;
+  }
+  return MIN(lm_b->block_w, lm_b->block_h) - MIN(lm_a->block_w, lm_a->block_h);
+}
+
+// First-fit packs the (sorted) lightmaps into as many size x size pages as
+// needed. Returns the number of pages, 0 if a lightmap is larger than a page.
+static guint pack_lmap_pages(struct lmap_s *lmaps, guint num_lmaps,
+                             guint size, gboolean rotate) {
+  GArray *pages = g_array_new(FALSE, FALSE, sizeof(struct skyline_s));
+  guint num_pages = 0;
+  for (guint i = 0; i < num_lmaps; i++) {
+    struct lmap_s *lm = &lmaps[i];
+    guint x, y, page = 0;
+    gboolean rotated, packed = FALSE, fresh = FALSE;
+    for (; !packed && !fresh; page++) {
+      if (page == pages->len) {
+        struct skyline_s sky;
+        skyline_init(&sky, size, size, 1);
+        g_array_append_val(pages, sky);
+        fresh = TRUE;
+      }
+      packed =
+          skyline_pack_lmap(&g_array_index(pages, struct skyline_s, page), lm,
+                            rotate, &x, &y, &rotated);
+    }
+    if (!packed) {
+      num_pages = 0; // does not fit an empty page either
+      break;
+    }
+    lm->atlas_x = x;
+    lm->atlas_y = y;
+    lm->page = page - 1;
+    lm->rotated = rotated;
+    num_pages = MAX(num_pages, page);
+  }
+  for (guint p = 0; p < pages->len; p++) {
+    skyline_free(&g_array_index(pages, struct skyline_s, p));
+  }
+  g_array_free(pages, TRUE);
+  return num_pages;
+}
+
+// Identity of a lightmap's contents: luxel size, styles and the luxels in the
+// lump, or one value per style for a uniform lightmap.
+struct lmap_block_s {
+  gint width, height;
+  guint8 styles[4];
+  guint8 values[4];
+  const guint8 *luxels; // NULL if uniform
+  gsize size;
+};
+
+static guint lmap_block_hash(gconstpointer key) {
+  const struct lmap_block_s *block = key;
+  // FNV-1a over the header fields, then the luxels
+  guint32 hash = 2166136261u;
+  const guint8 *head = (const guint8 *)block;
+  for (gsize i = 0; i < G_STRUCT_OFFSET(struct lmap_block_s, luxels); i++) {
+    hash = (hash ^ head[i]) * 16777619u;
+  }
+  for (gsize i = 0; i < block->size; i++) {
+    hash = (hash ^ block->luxels[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static gboolean lmap_block_equal(gconstpointer a, gconstpointer b) {
+  const struct lmap_block_s *block_a = a;
+  const struct lmap_block_s *block_b = b;
+  return memcmp(block_a, block_b, G_STRUCT_OFFSET(struct lmap_block_s,
+                                                  luxels)) == 0 &&
+         block_a->size == block_b->size &&
+         (block_a->size == 0 ||
+          memcmp(block_a->luxels, block_b->luxels, block_a->size) == 0);
+}
+
+// Shrinks uniform lightmaps to a 1x1 block and points every lightmap whose
+// block is identical to an earlier one at it (lmap_s.share).
+static void dedup_lmaps(struct lmap_s *lmaps, guint num_lmaps,
+                        const guint8 *lightmap_lump) {
+  struct lmap_block_s *blocks = g_new0(struct lmap_block_s, num_lmaps);
+  GHashTable *table = g_hash_table_new(lmap_block_hash, lmap_block_equal);
+  guint num_uniform = 0, num_shared = 0;
+  guint64 area = 0, packed_area = 0;
+  for (guint i = 0; i < num_lmaps; i++) {
+    struct lmap_s *lm = &lmaps[i];
+    struct lmap_block_s *block = &blocks[i];
+    gsize num_luxels = (gsize)lm->width * lm->height;
+    guint num_styles = 0;
+    memset(block->styles, 255, sizeof(block->styles));
+    for (; lm->lightmap >= 0 && num_styles < 4; num_styles++) {
+      if (lm->styles[num_styles] == 255) {
+        break;
+      }
+      block->styles[num_styles] = lm->styles[num_styles];
+    }
+    const guint8 *luxels =
+        lm->lightmap >= 0 ? lightmap_lump + lm->lightmap : NULL;
+    lm->uniform = TRUE;
+    for (guint k = 0; k < num_styles && lm->uniform; k++) {
+      const guint8 *style_luxels = luxels + k * num_luxels;
+      for (gsize j = 1; j < num_luxels; j++) {
+        if (style_luxels[j] != style_luxels[0]) {
+          lm->uniform = FALSE;
+          break;
+        }
+      }
+      block->values[k] = style_luxels[0];
+    }
+    if (lm->uniform) {
+      lm->block_w = lm->block_h = 1;
+      block->width = block->height = 1;
+      memset(block->values + num_styles, 0, 4 - num_styles);
+      num_uniform++;
+    } else {
+      block->width = lm->width;
+      block->height = lm->height;
+      memset(block->values, 0, sizeof(block->values));
+      block->luxels = luxels;
+      block->size = num_styles * num_luxels;
+    }
+    area += num_luxels;
+
+    gpointer owner = g_hash_table_lookup(table, block);
+    if (owner != NULL) {
+      lm->share = lmaps[GPOINTER_TO_UINT(owner) - 1].face_id;
+      num_shared++;
+    } else {
+      g_hash_table_insert(table, block, GUINT_TO_POINTER(i + 1));
+      packed_area += (guint64)lm->block_w * lm->block_h;
+    }
+  }
+  g_print("dedup: %u uniform lightmaps shrunk to one texel, %u share another's "
+          "block; %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+          " luxels left to pack (%.1f%% saved)\n",
+          num_uniform, num_shared, packed_area, area,
+          100.0 - 100.0 * packed_area / MAX(area, 1));
+  g_hash_table_destroy(table);
+  g_free(blocks);
+}
+
+// Bilinear sample of a block at (x, y) in texel center coordinates.
+static gfloat sample_block(const struct rgba_s *data, gint w, gint h, gfloat x,
+                           gfloat y, guint c) {
+  gint x0 = MIN((gint)x, w - 1), y0 = MIN((gint)y, h - 1);
+  gint x1 = MIN(x0 + 1, w - 1), y1 = MIN(y0 + 1, h - 1);
+  gfloat fx = x - x0, fy = y - y0;
+  gfloat top = data[y0 * w + x0].rgba[c] * (1.0f - fx) +
+               data[y0 * w + x1].rgba[c] * fx;
+  gfloat bottom = data[y1 * w + x0].rgba[c] * (1.0f - fx) +
+                  data[y1 * w + x1].rgba[c] * fx;
+  return top * (1.0f - fy) + bottom * fy;
+}
+
+// Scale from lightmap to block texel centers along one axis.
+static gfloat block_scale(gint size, gint block_size) {
+  return size > 1 ? (gfloat)(block_size - 1) / (gfloat)(size - 1) : 1.0f;
+}
+
+// Shrinks smooth lightmaps by 4 or 2 on each side (see downsample_image) as
+// long as bilinear sampling of the smaller block stays within max_error of
+// every luxel, and reports what that saved.
+static void downsample_lmaps(struct lmap_s *lmaps, guint num_lmaps,
+                             const guint8 *lightmap_lump, guint max_error) {
+  const guint factors[] = {4, 2};
+  guint num_scaled[G_N_ELEMENTS(factors)] = {0};
+  guint64 area = 0, packed_area = 0;
+  guint worst_error = 0;
+  gdouble error_sum = 0.0;
+  guint64 num_scaled_luxels = 0;
+  for (guint i = 0; i < num_lmaps; i++) {
+    struct lmap_s *lm = &lmaps[i];
+    if (lm->share >= 0) {
+      continue;
+    }
+    area += (guint64)lm->block_w * lm->block_h;
+    if (lm->uniform || lm->lightmap < 0 || lm->width < 3 || lm->height < 3) {
+      packed_area += (guint64)lm->block_w * lm->block_h;
+      continue;
+    }
+    // the luxels of all styles, style k in rgba[k]
+    gsize num_luxels = (gsize)lm->width * lm->height;
+    struct img_s src = {lm->width, lm->height,
+                        g_new0(struct rgba_s, num_luxels)};
+    guint num_styles = 0;
+    while (num_styles < 4 && lm->styles[num_styles] != 255) {
+      num_styles++;
+    }
+    for (guint k = 0; k < num_styles; k++) {
+      const guint8 *luxels = lightmap_lump + lm->lightmap + k * num_luxels;
+      for (gsize j = 0; j < num_luxels; j++) {
+        src.data[j].rgba[k] = luxels[j];
+      }
+    }
+    for (guint f = 0; f < G_N_ELEMENTS(factors); f++) {
+      // keeps the corner luxels: ceil((size - 1) / factor) + 1 texels
+      struct img_s dst = {(lm->width + factors[f] - 2) / factors[f] + 1,
+                          (lm->height + factors[f] - 2) / factors[f] + 1,
+                          NULL};
+      dst.data = g_new(struct rgba_s, dst.w * dst.h);
+      downsample_image(&src, &dst);
+      gfloat sx = block_scale(lm->width, dst.w);
+      gfloat sy = block_scale(lm->height, dst.h);
+      gfloat error = 0.0f, block_error_sum = 0.0f;
+      for (gint y = 0; y < lm->height && error <= max_error; y++) {
+        for (gint x = 0; x < lm->width; x++) {
+          for (guint c = 0; c < num_styles; c++) {
+            gfloat e = fabsf(sample_block(dst.data, dst.w, dst.h, x * sx,
+                                          y * sy, c) -
+                             src.data[y * lm->width + x].rgba[c]);
+            error = MAX(error, e);
+            block_error_sum += e;
+          }
+        }
+      }
+      if (error <= max_error) {
+        lm->block_w = dst.w;
+        lm->block_h = dst.h;
+        lm->block_data = dst.data;
+        num_scaled[f]++;
+        worst_error = MAX(worst_error, (guint)ceilf(error));
+        error_sum += block_error_sum;
+        num_scaled_luxels += num_luxels * num_styles;
+        break;
+      }
+      g_free(dst.data);
+    }
+    g_free(src.data);
+    packed_area += (guint64)lm->block_w * lm->block_h;
+  }
+  g_print("downsample: %u lightmaps at 1/4, %u at 1/2; %" G_GUINT64_FORMAT
+          " of %" G_GUINT64_FORMAT " texels left to pack (%.1f%% saved); "
+          "max error %u, mean %.2f\n",
+          num_scaled[0], num_scaled[1], packed_area, area,
+          100.0 - 100.0 * packed_area / MAX(area, 1), worst_error,
+          num_scaled_luxels ? error_sum / num_scaled_luxels : 0.0);
+}
+
+// Picks the smallest atlas (power of two wide, a multiple of 16 high, up to
+// max_size on a side) the lightmaps pack into, and packs them. If none fits,
+// packs them into max_size x max_size pages instead. Returns FALSE if a
+// lightmap does not even fit a page. The lightmaps end up sorted, the ones
+// sharing another's block (with dedup) last.
+gboolean pack_lmaps(struct lmap_s *lmaps, guint num_lmaps,
+                    const guint8 *lightmap_lump,
+                    const struct lmap_opts_s *opts, guint *atlas_width,
+                    guint *atlas_height, guint *num_pages) {
+  guint max_size = opts->max_size;
+  gboolean rotate = opts->rotate;
+  g_print("packing...\n");
+  if (opts->dedup) {
+    dedup_lmaps(lmaps, num_lmaps, lightmap_lump);
+  }
+  if (opts->max_error > 0) {
+    downsample_lmaps(lmaps, num_lmaps, lightmap_lump, opts->max_error);
+  }
+  guint64 area = 0;
+  guint max_w = 0, max_short = 0;
+  guint num_packed = 0;
+  for (guint i = 0; i < num_lmaps; i++) {
+    struct lmap_s *lm = &lmaps[i];
+    if (lm->share >= 0) {
+      continue;
+    }
+    num_packed++;
+    area += (guint64)lm->block_w * lm->block_h;
+    max_w = MAX(max_w, (guint)lm->block_w);
+    // a rotated lightmap only needs its shorter side to fit the width
+    max_short = MAX(max_short, (guint)MIN(lm->block_w, lm->block_h));
+    lm->rotated = FALSE;
+  }
+
+  // Every width is tried upright (sorted by height) and, if allowed, with
+  // rotation (sorted by the longer side); rotation packs narrow atlases
+  // tighter but can lose on wide ones. The packer never uses the first row.
+  guint best_w = 0, best_h = 0;
+  gboolean best_rotate = FALSE;
+  for (gint pass = 0; pass < (rotate ? 2 : 1); pass++) {
+    gboolean rotated = pass == 1;
+    g_qsort_with_data(lmaps, num_lmaps, sizeof(struct lmap_s),
+                      rotated ? compare_lmap_rotated_fn : compare_lmap_fn,
+                      NULL);
+    guint min_w = next_pow2(MAX(rotated ? max_short : max_w, 16));
+    for (guint w = min_w; w <= max_size; w <<= 1) {
+      if ((guint64)w * max_size < area) {
+        continue;
+      }
+      guint used = skyline_pack_lmaps(lmaps, num_packed, w, rotated, FALSE);
+      if (used == G_MAXUINT || used > max_size) {
+        continue;
+      }
+      guint h = MIN((used + 15) & ~15u, max_size);
+      g_print("  %4u x %-4u: %u rows used, %.1f%% efficient%s\n", w, h, used,
+              100.0 * area / ((gdouble)w * h), rotated ? ", rotated" : "");
+      // smallest area, then the squarer one
+      if (best_w == 0 || (guint64)w * h < (guint64)best_w * best_h ||
+          ((guint64)w * h == (guint64)best_w * best_h &&
+           MAX(w, h) < MAX(best_w, best_h))) {
+        best_w = w;
+        best_h = h;
+        best_rotate = rotated;
+      }
+    }
+  }
+  guint pages = 1;
+  if (best_w != 0) {
+    if (rotate && !best_rotate) {
+      g_qsort_with_data(lmaps, num_lmaps, sizeof(struct lmap_s),
+                        compare_lmap_fn, NULL);
+    }
+    skyline_pack_lmaps(lmaps, num_packed, best_w, best_rotate, TRUE);
+  } else {
+    // the lightmaps are still sorted for the last pass
+    best_w = best_h = max_size;
+    pages = pack_lmap_pages(lmaps, num_packed, max_size, rotate);
+    if (pages == 0) {
+      return FALSE;
+    }
+  }
+  if (num_packed < num_lmaps) {
+    guint *lut = create_lmap_lut(lmaps, num_lmaps);
+    for (guint i = num_packed; i < num_lmaps; i++) {
+      struct lmap_s *lm = &lmaps[i];
+      const struct lmap_s *owner = &lmaps[lut[lm->share]];
+      lm->atlas_x = owner->atlas_x;
+      lm->atlas_y = owner->atlas_y;
+      lm->page = owner->page;
+      lm->rotated = owner->rotated;
+      lm->block_w = owner->block_w;
+      lm->block_h = owner->block_h;
+    }
+    g_free(lut);
+  }
+  *atlas_width = best_w;
+  *atlas_height = best_h;
+  *num_pages = pages;
+  g_print("Lightmap atlas size: %ux%u", best_w, best_h);
+  if (pages > 1) {
+    g_print(" x %u pages", pages);
+  }
+  g_print(" (%.1f%% efficient)\n",
+          100.0 * area / ((gdouble)best_w * best_h * pages));
+  return TRUE;
+}
+
+// Expands n 8-bit luxels to opaque gray RGBA.
+static void expand_luxels(struct rgba_s *dst, const guint8 *src, guint n) {
+  guint i = 0;
+#ifdef __SSE2__
+  const __m128i alpha = _mm_set1_epi8((char)255);
+  for (; i + 16 <= n; i += 16) {
+    __m128i l = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i ll_lo = _mm_unpacklo_epi8(l, l);     // l l per luxel
+    __m128i ll_hi = _mm_unpackhi_epi8(l, l);
+    __m128i la_lo = _mm_unpacklo_epi8(l, alpha); // l 255 per luxel
+    __m128i la_hi = _mm_unpackhi_epi8(l, alpha);
+    __m128i *out = (__m128i *)(dst + i);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(ll_lo, la_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(ll_lo, la_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(ll_hi, la_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(ll_hi, la_hi));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i].r = dst[i].g = dst[i].b = src[i];
+    dst[i].a = 255;
+  }
+}
+
+static const struct {
+  const gchar *name;
+  enum lmap_format_e format;
+} lmap_formats[] = {
+    {"rgba", LMAP_FORMAT_RGBA},
+    {"r8", LMAP_FORMAT_R8},
+    {"styles", LMAP_FORMAT_STYLES},
+};
+
+gboolean lmap_format_from_string(const gchar *name,
+                                 enum lmap_format_e *format) {
+  for (guint i = 0; i < G_N_ELEMENTS(lmap_formats); i++) {
+    if (g_strcmp0(lmap_formats[i].name, name) == 0) {
+      *format = lmap_formats[i].format;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// Style k luxel of texel (x, y) of a lightmap's block.
+static inline guint8 block_luxel(const struct lmap_s *lm, const guint8 *src,
+                                 gint x, gint y, guint k) {
+  if (lm->block_data != NULL) {
+    return lm->block_data[y * lm->block_w + x].rgba[k];
+  }
+  return src[k * (gsize)lm->width * lm->height + y * lm->width + x];
+}
+
+// Copies the luxels of a lightmap into its block of a one byte per texel
+// atlas page; unlit faces stay black.
+static void copy_lmap_r8(guint8 *page_data, guint width,
+                         const struct lmap_s *lm, const guint8 *src) {
+  guint8 *block = page_data + lm->atlas_y * width + lm->atlas_x;
+  for (gint y = 0; y < lm->block_h; y++) {
+    if (!lm->rotated && lm->block_data == NULL) {
+      memcpy(&block[y * width], src + y * lm->width, lm->block_w);
+      continue;
+    }
+    for (gint x = 0; x < lm->block_w; x++) {
+      guint8 *dst = lm->rotated ? &block[x * width + y] : &block[y * width + x];
+      *dst = block_luxel(lm, src, x, y, 0);
+    }
+  }
+}
+
+// Same for an RGBA atlas page: luxels are expanded to opaque gray.
+static void copy_lmap_rgba(struct rgba_s *page_data, guint width,
+                           const struct lmap_s *lm, const guint8 *src) {
+  struct rgba_s *block = page_data + lm->atlas_y * width + lm->atlas_x;
+  for (gint y = 0; y < lm->block_h; y++) {
+    if (src != NULL && !lm->rotated && lm->block_data == NULL) {
+      expand_luxels(&block[y * width], src + y * lm->width, lm->block_w);
+      continue;
+    }
+    for (gint x = 0; x < lm->block_w; x++) {
+      struct rgba_s *dst =
+          lm->rotated ? &block[x * width + y] : &block[y * width + x];
+      guint8 luxel = src != NULL ? block_luxel(lm, src, x, y, 0) : 0;
+      expand_luxels(dst, &luxel, 1);
+    }
+  }
+}
+
+// Same for a lightstyle atlas page: the lightmap of style slot 0..3 goes to
+// R, G, B and A, unused slots and unlit faces are 0.
+static void copy_lmap_styles(struct rgba_s *page_data, guint width,
+                             const struct lmap_s *lm, const guint8 *src) {
+  struct rgba_s *block = page_data + lm->atlas_y * width + lm->atlas_x;
+  guint num_styles = 0;
+  while (src != NULL && num_styles < 4 && lm->styles[num_styles] != 255) {
+    num_styles++;
+  }
+  for (gint y = 0; y < lm->block_h; y++) {
+    for (gint x = 0; x < lm->block_w; x++) {
+      struct rgba_s *dst =
+          lm->rotated ? &block[x * width + y] : &block[y * width + x];
+      // rgba[] is in PNG channel order
+      for (guint k = 0; k < 4; k++) {
+        dst->rgba[k] = k < num_styles ? block_luxel(lm, src, x, y, k) : 0;
+      }
+    }
+  }
+}
+
+void export_lmap_atlas(const struct lmap_s *lmaps, guint num_lmaps,
+                       const guint8 *lightmap_lump, guint width, guint height,
+                       guint num_pages, enum lmap_format_e format) {
+  // page 0 is lightmap.png, later pages lightmap_<page>.png
+  gsize page_size = (gsize)width * height;
+  gsize texel_size =
+      format == LMAP_FORMAT_R8 ? sizeof(guint8) : sizeof(struct rgba_s);
+  guint8 *atlas_data = g_malloc0(page_size * num_pages * texel_size);
+  if (format == LMAP_FORMAT_RGBA) {
+    // unused texels are magenta
+    struct rgba_s *texels = (struct rgba_s *)atlas_data;
+    for (gsize i = 0; i < page_size * num_pages; i++) {
+      texels[i].r = 255;
+      texels[i].g = 0;
+      texels[i].b = 255;
+      texels[i].a = 255;
+    }
+  }
+  for (guint i = 0; i < num_lmaps; i++) {
+    const struct lmap_s *lm = &lmaps[i];
+    if (lm->share >= 0) {
+      continue; // written with the lightmap it shares a block with
+    }
+    const guint8 *src =
+        lm->lightmap >= 0 ? lightmap_lump + lm->lightmap : NULL;
+    guint8 *page_data = atlas_data + lm->page * page_size * texel_size;
+    if (format == LMAP_FORMAT_RGBA) {
+      copy_lmap_rgba((struct rgba_s *)page_data, width, lm, src);
+    } else if (format == LMAP_FORMAT_STYLES) {
+      copy_lmap_styles((struct rgba_s *)page_data, width, lm, src);
+    } else if (src != NULL) {
+      copy_lmap_r8(page_data, width, lm, src);
+    }
+  }
+  for (guint p = 0; p < num_pages; p++) {
+    gchar *img_file = p == 0 ? g_strdup("lightmap.png")
+                             : g_strdup_printf("lightmap_%u.png", p);
+    const guint8 *page_data = atlas_data + p * page_size * texel_size;
+    unsigned error =
+        format == LMAP_FORMAT_R8
+            ? lodepng_encode_file(img_file, page_data, width, height,
+                                  LCT_GREY, 8)
+            : lodepng_encode32_file(img_file, page_data, width, height);
+    if (error) {
+      g_error("error %u: %s\n", error, lodepng_error_text(error));
+    }
+    g_free(img_file);
+  }
+  g_free(atlas_data);
+}
+
+// Light animations set up by the stock Quake progs (world.qc). Styles 32..62
+// belong to lights the game switches on and off; they are written as on.
+static const gchar *const lightstyle_patterns[] = {
+    "m",                                                   // normal
+    "mmnmmommommnonmmonqnmmo",                             // flicker
+    "abcdefghijklmnopqrstuvwxyzyxwvutsrqponmlkjihgfedcba", // slow pulse
+    "mmmmmaaaaammmmmaaaaaabcdefgabcdefg",                  // candle
+    "mamamamamama",                                        // fast strobe
+    "jklmnopqrstuvwxyzyxwvutsrqponmlkj",                   // gentle pulse
+    "nmonqnmomnmomomno",                                   // flicker 2
+    "mmmaaaabcdefgmmmmaaaammmaamm",                        // candle 2
+    "mmmaaammmaaammmabcdefaaaammmmabcdefmmmaaaa",          // candle 3
+    "aaaaaaaazzzzzzzz",                                    // slow strobe
+    "mmamammmmammamamaaamammma",                           // fluorescent
+    "abcdefghijklmnopqrrqponmlkjihgfedcba",                // slow pulse 2
+};
+
+// Writes the lightstyle table for an LMAP_FORMAT_STYLES atlas as JSON: the
+// pattern of every style used, and for every face with lightmaps its atlas
+// block (before rotation) and the style held by each of the R, G, B and A
+// channels.
+void export_lmap_styles(const struct lmap_s *lmaps, guint num_lmaps,
+                        const gchar *path, GError **err) {
+  gboolean used[256] = {FALSE};
+  GString *json = g_string_new("{\n  \"faces\": [");
+  gboolean first = TRUE;
+  for (guint i = 0; i < num_lmaps; i++) {
+    const struct lmap_s *lm = &lmaps[i];
+    if (lm->lightmap < 0 || lm->styles[0] == 255) {
+      continue;
+    }
+    g_string_append_printf(json,
+                           "%s\n    {\"face\": %d, \"page\": %u, "
+                           "\"rect\": [%d, %d, %d, %d], \"rotated\": %s, "
+                           "\"styles\": [",
+                           first ? "" : ",", lm->face_id, lm->page,
+                           lm->atlas_x, lm->atlas_y, lm->block_w, lm->block_h,
+                           lm->rotated ? "true" : "false");
+    for (guint k = 0; k < 4 && lm->styles[k] != 255; k++) {
+      g_string_append_printf(json, "%s%u", k ? ", " : "", lm->styles[k]);
+      used[lm->styles[k]] = TRUE;
+    }
+    g_string_append(json, "]}");
+    first = FALSE;
+  }
+  g_string_append(json, "\n  ],\n  \"styles\": {");
+  first = TRUE;
+  for (guint s = 0; s < 255; s++) {
+    if (!used[s]) {
+      continue;
+    }
+    const gchar *pattern = s < G_N_ELEMENTS(lightstyle_patterns)
+                               ? lightstyle_patterns[s]
+                               : "m";
+    g_string_append_printf(json, "%s\n    \"%u\": \"%s\"", first ? "" : ",",
+                           s, pattern);
+    first = FALSE;
+  }
+  g_string_append(json, "\n  }\n}\n");
+  g_file_set_contents(path, json->str, json->len, err);
+  g_string_free(json, TRUE);
+}
+
+guint *create_lmap_lut(const struct lmap_s *lmaps, guint num_lmaps) {
+  guint *lut = g_new(guint, num_lmaps);
+  for (guint i = 0; i < num_lmaps; i++) {
+    lut[lmaps[i].face_id] = i;
+  }
+  return lut;
+}
+
+void init_lmap(struct lmap_s *lm, gint face_id) {
+  lm->face_id = face_id;
+  lm->page = 0;
+  lm->rotated = FALSE;
+  lm->lightmap = -1;
+  lm->uniform = FALSE;
+  lm->block_data = NULL;
+  lm->share = -1;
+  memset(lm->styles, 255, sizeof(lm->styles));
+  lm->mins[0] = lm->mins[1] = G_MAXFLOAT;
+  lm->maxs[0] = lm->maxs[1] = -G_MAXFLOAT;
+}
+
+void free_lmap(struct lmap_s *lm) {
+  g_free(lm->block_data);
+  lm->block_data = NULL;
+}
+
+void lmap_addST(struct lmap_s *lm, gfloat s, gfloat t) {
+  if (s < lm->mins[0])
+    lm->mins[0] = s;
+  if (t < lm->mins[1])
+    lm->mins[1] = t;
+  if (s > lm->maxs[0])
+    lm->maxs[0] = s;
+  if (t > lm->maxs[1])
+    lm->maxs[1] = t;
+}
+
+void calc_lmap(struct lmap_s *lm) {
+  for (gint i = 0; i < 2; i++) {
+    lm->bmins[i] = (gint)floor(lm->mins[i] / 16.0f);
+    lm->bmaxs[i] = (gint)ceil(lm->maxs[i] / 16.0f);
+    lm->tmins[i] = lm->bmins[i] * 16;
+    lm->texts[i] = (lm->bmaxs[i] - lm->bmins[i]) * 16;
+  }
+  lm->width = lm->texts[0] / 16 + 1;
+  lm->height = lm->texts[1] / 16 + 1;
+  lm->block_w = lm->width;
+  lm->block_h = lm->height;
+}
+
+// Returns the luxel coordinates of (s, t) relative to the lightmap's atlas
+// position, transposed if the lightmap was packed rotated. A downsampled
+// block is scaled to keep the corner luxels in place, a uniform lightmap
+// maps everything to the center of its single texel.
+void lmap_getUV(const struct lmap_s *lm, gfloat s, gfloat t, gfloat *u,
+                gfloat *v) {
+  gfloat lu = 0.5f, lv = 0.5f;
+  if (!lm->uniform) {
+    lu += (s - lm->tmins[0]) / 16.0f * block_scale(lm->width, lm->block_w);
+    lv += (t - lm->tmins[1]) / 16.0f * block_scale(lm->height, lm->block_h);
+  }
+  if (lm->rotated) {
+    gfloat tmp = lu;
+    lu = lv;
+    lv = tmp;
+  }
+  if (u != NULL) {
+    *u = lu;
+  }
+  if (v != NULL) {
+    *v = lv;
+  }
+}
+
+// Orders lightmaps by block height, then width; lightmaps sharing another's
+// block go last.
+gint compare_lmap_fn(gconstpointer a, gconstpointer b, gpointer user_data) {
+  const struct lmap_s *lm_a = (const struct lmap_s *)a;
+  const struct lmap_s *lm_b = (const struct lmap_s *)b;
+  if ((lm_a->share >= 0) != (lm_b->share >= 0)) {
+    return lm_a->share >= 0 ? 1 : -1;
+  }
+  if (lm_a->block_h != lm_b->block_h) {
+    return lm_b->block_h - lm_a->block_h;
+  }
+  if (lm_a->block_w != lm_b->block_w) {
+    return lm_b->block_w - lm_a->block_w;
+  }
+  return 0;
+}
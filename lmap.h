@@ -0,0 +1,95 @@
+#ifndef _LMAP_
+#define _LMAP_
+
+#include <glib.h>
+
+struct lmap_s {
+  gint face_id;
+  gfloat mins[2];
+  gfloat maxs[2];
+  gint bmins[2];
+  gint bmaxs[2];
+  gint tmins[2];
+  gint texts[2];
+  gint width, height;
+  gint block_w, block_h; // size of its block in the atlas, 1x1 if uniform
+  gboolean uniform;      // every luxel of each style is the same
+  struct rgba_s *block_data; // downsampled block, style k in rgba[k]; NULL
+                             // if the block is the lump's luxels
+  gint share; // face_id of the lightmap whose identical block this one
+              // reuses, -1 if it has its own
+  gint32 lightmap;  // offset into the lightmaps lump, -1 if unlit
+  guint8 styles[4]; // lightstyle of each stacked lightmap, 255 if unused
+  gint atlas_x, atlas_y;
+  guint page;       // atlas page the lightmap is packed into
+  gboolean rotated; // packed transposed: luxel (x, y) is at atlas
+                    // (atlas_x + y, atlas_y + x)
+};
+
+extern void init_lmap(struct lmap_s *lm, gint face_id);
+extern void free_lmap(struct lmap_s *lm);
+extern void lmap_addST(struct lmap_s *lm, gfloat s, gfloat t);
+extern void calc_lmap(struct lmap_s *lm);
+extern void lmap_getUV(const struct lmap_s *lm, gfloat s, gfloat t,
+                       gfloat *u, gfloat *v);
+extern gint compare_lmap_fn(gconstpointer a, gconstpointer b,
+                            gpointer user_data);
+
+struct lmap_opts_s {
+  guint max_size;  // largest atlas side to try, pages of it if none fits
+  gboolean rotate; // pack lightmaps transposed where that fits tighter
+  // share one block among identical lightmaps and shrink uniform ones to a
+  // single texel
+  gboolean dedup;
+  // shrink smooth lightmaps 2x or 4x while no luxel is off by more than
+  // this (0..255), 0 to keep them all
+  guint max_error;
+};
+
+extern gboolean pack_lmaps(struct lmap_s *lmaps, guint num_lmaps,
+                           const guint8 *lightmap_lump,
+                           const struct lmap_opts_s *opts, guint *atlas_width,
+                           guint *atlas_height, guint *num_pages);
+enum lmap_format_e {
+  LMAP_FORMAT_RGBA,   // gray replicated into RGB, opaque alpha
+  LMAP_FORMAT_R8,     // one byte per luxel, grayscale PNG
+  LMAP_FORMAT_STYLES, // up to four lightstyles of a face in R, G, B and A
+};
+
+extern gboolean lmap_format_from_string(const gchar *name,
+                                        enum lmap_format_e *format);
+
+extern void export_lmap_atlas(const struct lmap_s *lmaps, guint num_lmaps,
+                              const guint8 *lightmap_lump, guint width,
+                              guint height, guint num_pages,
+                              enum lmap_format_e format);
+extern void export_lmap_styles(const struct lmap_s *lmaps, guint num_lmaps,
+                               const gchar *path, GError **err);
+extern guint *create_lmap_lut(const struct lmap_s *lmaps, guint num_lmaps);
+
+/*
+ * Skyline rectangle packer. The skyline is a list of horizontal segments
+ * sorted by x; only segment starts are candidate positions, and the lowest
+ * (then leftmost) one wins.
+ */
+
+struct skyline_seg_s {
+  guint x, y, w;
+};
+
+struct skyline_s {
+  guint width;
+  guint max_height;
+  GArray *segs; // array of struct skyline_seg_s, covering [0, width)
+};
+
+extern void skyline_init(struct skyline_s *sky, guint width, guint max_height,
+                         guint base_y);
+extern gboolean skyline_pack(struct skyline_s *sky, guint w, guint h, guint *x,
+                             guint *y);
+extern gboolean skyline_pack_rotated(struct skyline_s *sky, guint w, guint h,
+                                     guint *x, guint *y, gboolean *rotated);
+extern guint skyline_height(const struct skyline_s *sky);
+extern void skyline_free(struct skyline_s *sky);
+
+#endif // _LMAP_
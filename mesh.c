@@ -1,6 +1,13 @@
 #include "mesh.h"
 #include "lodepng.h"
 #include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define VERTEX_CHUNK_SIZE 16
 #define INDEX_BUFFER_CHUNK_SIZE 16
@@ -92,6 +99,10 @@ void poly_add_vertex(struct poly_s *poly, guint vertex_index) {
 
 void init_poly(struct poly_s *poly, gint face_id) {
   poly->face_id = face_id;
+  poly->texinfo_id = -1;
+  poly->chunk_id = 0;
+  poly->model_id = 0;
+  poly->lightmap_page = 0;
   poly->plane_normal = vec3_set(0.0f, 0.0f, 0.0f);
   poly->plane_dist = 0.0f;
   poly->num_vertices = 0;
@@ -138,11 +149,8 @@ static void rotate_poly_region(struct poly_region_s *region,
 
 struct vec3_s poly_region_coord_to_3d(const struct poly_region_s *region,
                                       struct ivec2_s co) {
-  gfloat u = ((gfloat)(co.x) + 0.5f) / (gfloat)(region->w);
-  gfloat v = ((gfloat)(co.y) + 0.5f) / (gfloat)(region->h);
-
-  gfloat S = region->scale.x * u + region->bias.x;
-  gfloat T = region->scale.y * v + region->bias.y;
+  gfloat S = region->scale.x * (gfloat)co.x + region->bias.x;
+  gfloat T = region->scale.y * (gfloat)co.y + region->bias.y;
   struct vec3_s s = vec3_mul(region->s_axis, S);
   struct vec3_s t = vec3_mul(region->t_axis, T);
   return vec3_add(vec3_add(region->o, s), t);
@@ -153,10 +161,12 @@ struct ivec2_s poly_region_coord_from_3d(const struct poly_region_s *region,
   struct vec3_s v = vec3_sub(p, region->o);
   gfloat S = vec3_dot(v, region->s_axis);
   gfloat T = vec3_dot(v, region->t_axis);
-  float U = (S - region->bias.x) / region->scale.x;
-  float V = (T - region->bias.y) / region->scale.y;
-  return (struct ivec2_s){(gint)(U * region->w - 0.5f),
-                          (gint)(V * region->h - 0.5f)};
+  // a 1x1 block has a zero scale
+  gfloat U = region->scale.x > 0.0f ? (S - region->bias.x) / region->scale.x
+                                    : 0.0f;
+  gfloat V = region->scale.y > 0.0f ? (T - region->bias.y) / region->scale.y
+                                    : 0.0f;
+  return (struct ivec2_s){(gint)U, (gint)V};
 }
 
 gint mat_cmp_fn(gconstpointer a, gconstpointer b) {
@@ -175,6 +185,10 @@ void free_mat(struct mat_s *mat) {
   memset(mat->name, 0, sizeof(mat->name));
   LIST_FREE(mat->polys);
   g_free(mat->polys);
+  if (mat->render_polys) {
+    LIST_FREE(mat->render_polys);
+    g_free(mat->render_polys);
+  }
   LIST_FREE(mat->tris);
   g_free(mat->tris);
   g_free(mat->texture_data);
@@ -191,7 +205,11 @@ struct mat_s *mesh_add_get_material(struct mesh_s *mesh,
   g_strlcpy(stored->name, material_name, sizeof(stored->name) - 1);
   stored->polys = g_new(LISTOF(index), 1);
   LIST_INIT(stored->polys, 16);
+  stored->render_polys = NULL;
+  stored->width = stored->height = 0;
   stored->texture_data = NULL;
+  stored->tex_array = stored->tex_layer = 0;
+  memset(stored->atlas_rect, 0, sizeof(stored->atlas_rect));
   stored->tris = NULL;
   g_hash_table_insert(mesh->material_map, g_strdup(material_name), stored);
   g_ptr_array_add(mesh->mats, stored);
@@ -204,10 +222,24 @@ void init_mesh(struct mesh_s *mesh) {
       g_hash_table_new_full(vertex_hash_fn, vertex_eq_fn, g_free, NULL);
   mesh->vertices = g_array_new(FALSE, FALSE, sizeof(struct vertex_s));
   mesh->polys = g_array_new(FALSE, FALSE, sizeof(struct poly_s));
+  mesh->render_polys = g_array_new(FALSE, FALSE, sizeof(struct poly_s));
+  mesh->chunks = g_array_new(FALSE, FALSE, sizeof(struct mesh_chunk_s));
+  mesh->tex_arrays = g_array_new(FALSE, FALSE, sizeof(struct tex_array_s));
   mesh->material_map =
       g_hash_table_new_full(g_str_hash, (GEqualFunc)g_str_equal, g_free, NULL);
   mesh->mats = g_ptr_array_new_with_free_func((GDestroyNotify)free_mat);
   mesh->texture_atlas = g_new(struct atlas_s, 1);
+  mesh->texture_atlas->num_pages = 1;
+  for (guint k = 0; k < 3; k++) {
+    mesh->texture_atlas->normal_planes[k] = NULL;
+    mesh->texture_atlas->position_planes[k] = NULL;
+  }
+  mesh->texture_atlas->coverage = NULL;
+  mesh->texture_atlas->tile_mask = NULL;
+  mesh->texture_atlas->baked_data = NULL;
+  mesh->diffuse_atlas = NULL;
+  mesh->tri_mode = TRI_MODE_FAN;
+  mesh->chunk_size = 0.0f;
 }
 
 struct poly_s *mesh_add_poly(struct mesh_s *mesh, const gchar *material_name) {
@@ -249,6 +281,222 @@ guint mesh_add_get_vertex(struct mesh_s *mesh, struct vec3_s position,
   return index;
 }
 
+static inline struct vec3_s vertex_pos(const struct mesh_s *mesh, guint idx) {
+  return g_array_index(mesh->vertices, struct vertex_s, idx).position;
+}
+
+static const struct {
+  const gchar *name;
+  enum tri_mode_e mode;
+} tri_modes[] = {
+    {"fan", TRI_MODE_FAN},
+    {"strip", TRI_MODE_STRIP},
+    {"min-weight", TRI_MODE_MIN_WEIGHT},
+    {"max-min-angle", TRI_MODE_MAX_MIN_ANGLE},
+};
+
+gboolean tri_mode_from_string(const gchar *name, enum tri_mode_e *mode) {
+  for (guint i = 0; i < G_N_ELEMENTS(tri_modes); i++) {
+    if (g_strcmp0(tri_modes[i].name, name) == 0) {
+      *mode = tri_modes[i].mode;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+const gchar *tri_mode_to_string(enum tri_mode_e mode) {
+  for (guint i = 0; i < G_N_ELEMENTS(tri_modes); i++) {
+    if (tri_modes[i].mode == mode) {
+      return tri_modes[i].name;
+    }
+  }
+  return "unknown";
+}
+
+// smallest interior angle in degrees (0 for degenerate triangles)
+static gfloat tri_min_angle(struct vec3_s a, struct vec3_s b, struct vec3_s c) {
+  struct vec3_s ab = vec3_sub(b, a);
+  struct vec3_s ac = vec3_sub(c, a);
+  struct vec3_s bc = vec3_sub(c, b);
+  if (vec3_len(ab) < 1e-6f || vec3_len(ac) < 1e-6f || vec3_len(bc) < 1e-6f) {
+    return 0.0f;
+  }
+  ab = vec3_norm(ab);
+  ac = vec3_norm(ac);
+  bc = vec3_norm(bc);
+  gfloat angle_a = acosf(CLAMP(vec3_dot(ab, ac), -1.0f, 1.0f));
+  gfloat angle_b = acosf(CLAMP(-vec3_dot(ab, bc), -1.0f, 1.0f));
+  gfloat angle_c = MAX(PI - angle_a - angle_b, 0.0f);
+  return RAD2DEG(MIN(angle_a, MIN(angle_b, angle_c)));
+}
+
+static gfloat tri_perimeter(struct vec3_s a, struct vec3_s b, struct vec3_s c) {
+  return vec3_len(vec3_sub(b, a)) + vec3_len(vec3_sub(c, b)) +
+         vec3_len(vec3_sub(a, c));
+}
+
+// Zig-zag between both ends of the winding: (0,1,n-1), (1,n-2,n-1), ...
+// Neighbouring triangles share an edge like a strip and avoid the long
+// spokes of the fan.
+static void triangulate_poly_strip(struct poly_s *poly) {
+  guint lo = 0, hi = poly->num_vertices - 1;
+  guint k = 0;
+  gboolean advance_lo = TRUE;
+  while (hi - lo >= 2) {
+    struct tri_s *tri = &poly->tris[k++];
+    if (advance_lo) {
+      tri->v0 = poly->vertices[lo];
+      tri->v1 = poly->vertices[lo + 1];
+      tri->v2 = poly->vertices[hi];
+      lo++;
+    } else {
+      tri->v0 = poly->vertices[lo];
+      tri->v1 = poly->vertices[hi - 1];
+      tri->v2 = poly->vertices[hi];
+      hi--;
+    }
+    advance_lo = !advance_lo;
+  }
+}
+
+// Optimal triangulation of a convex winding by dynamic programming over the
+// sub-windings i..j: score[i][j] is the best score of i..j and apex[i][j] the
+// vertex k forming the triangle (i, k, j). Minimizes the total perimeter
+// (minimum weight) or maximizes the smallest angle.
+static void triangulate_poly_optimal(const struct mesh_s *mesh,
+                                     struct poly_s *poly,
+                                     gboolean max_min_angle) {
+  guint n = poly->num_vertices;
+  gfloat *score = g_new0(gfloat, n * n);
+  guint *apex = g_new0(guint, n * n);
+  struct vec3_s *p = g_new(struct vec3_s, n);
+  for (guint i = 0; i < n; i++) {
+    p[i] = vertex_pos(mesh, poly->vertices[i]);
+  }
+
+  for (guint len = 2; len < n; len++) {
+    for (guint i = 0; i + len < n; i++) {
+      guint j = i + len;
+      gfloat best = max_min_angle ? -1.0f : G_MAXFLOAT;
+      for (guint k = i + 1; k < j; k++) {
+        gfloat s;
+        if (max_min_angle) {
+          s = tri_min_angle(p[i], p[k], p[j]);
+          if (k > i + 1)
+            s = MIN(s, score[i * n + k]);
+          if (j > k + 1)
+            s = MIN(s, score[k * n + j]);
+          if (s <= best)
+            continue;
+        } else {
+          s = score[i * n + k] + score[k * n + j] +
+              tri_perimeter(p[i], p[k], p[j]);
+          if (s >= best)
+            continue;
+        }
+        best = s;
+        apex[i * n + j] = k;
+      }
+      score[i * n + j] = best;
+    }
+  }
+
+  guint k = 0;
+  guint *stack = g_new(guint, 2 * n);
+  guint top = 0;
+  stack[top++] = 0;
+  stack[top++] = n - 1;
+  while (top > 0) {
+    guint j = stack[--top];
+    guint i = stack[--top];
+    if (j - i < 2) {
+      continue;
+    }
+    guint m = apex[i * n + j];
+    poly->tris[k].v0 = poly->vertices[i];
+    poly->tris[k].v1 = poly->vertices[m];
+    poly->tris[k].v2 = poly->vertices[j];
+    k++;
+    stack[top++] = i;
+    stack[top++] = m;
+    stack[top++] = m;
+    stack[top++] = j;
+  }
+
+  g_free(stack);
+  g_free(p);
+  g_free(apex);
+  g_free(score);
+}
+
+void triangulate_poly_with_mode(const struct mesh_s *mesh, struct poly_s *poly,
+                                enum tri_mode_e mode) {
+  if (poly->num_vertices < 3) {
+    return;
+  }
+  if (mode == TRI_MODE_FAN || poly->num_vertices == 3) {
+    triangulate_poly(poly);
+    return;
+  }
+  g_free(poly->tris);
+  poly->num_tris = poly->num_vertices - 2;
+  poly->tris = g_new(struct tri_s, poly->num_tris);
+  switch (mode) {
+  case TRI_MODE_STRIP:
+    triangulate_poly_strip(poly);
+    break;
+  case TRI_MODE_MIN_WEIGHT:
+    triangulate_poly_optimal(mesh, poly, FALSE);
+    break;
+  default:
+    triangulate_poly_optimal(mesh, poly, TRUE);
+    break;
+  }
+}
+
+#define TRI_ANGLE_BINS 6
+
+static void print_tri_quality(const struct mesh_s *mesh, const GArray *polys,
+                              const gchar *label) {
+  static const gfloat bin_max[TRI_ANGLE_BINS] = {5.0f,  10.0f, 20.0f,
+                                                 30.0f, 45.0f, 60.01f};
+  guint bins[TRI_ANGLE_BINS] = {0};
+  guint num_tris = 0;
+  gfloat min_angle = 60.0f;
+  gdouble sum_angle = 0.0;
+  for (guint i = 0; i < polys->len; i++) {
+    const struct poly_s *poly = &g_array_index(polys, struct poly_s, i);
+    for (guint j = 0; j < poly->num_tris; j++) {
+      const struct tri_s *tri = &poly->tris[j];
+      gfloat angle = tri_min_angle(vertex_pos(mesh, tri->v0),
+                                   vertex_pos(mesh, tri->v1),
+                                   vertex_pos(mesh, tri->v2));
+      guint bin = 0;
+      while (bin < TRI_ANGLE_BINS - 1 && angle >= bin_max[bin]) {
+        bin++;
+      }
+      bins[bin]++;
+      min_angle = MIN(min_angle, angle);
+      sum_angle += angle;
+      num_tris++;
+    }
+  }
+  if (num_tris == 0) {
+    return;
+  }
+  g_print("%s triangle quality (%s): %u triangles, min angle %.2f, mean min "
+          "angle %.2f\n",
+          label, tri_mode_to_string(mesh->tri_mode), num_tris, min_angle,
+          sum_angle / num_tris);
+  gfloat bin_min = 0.0f;
+  for (guint i = 0; i < TRI_ANGLE_BINS; i++) {
+    g_print("  min angle %2.0f-%2.0f deg: %6u (%5.1f%%)\n", bin_min,
+            MIN(bin_max[i], 60.0f), bins[i], 100.0f * bins[i] / num_tris);
+    bin_min = bin_max[i];
+  }
+}
+
 static struct mat_s *find_mat(GPtrArray *sorted_mats, const gchar *name,
                               gint *step_count) {
   gint left = 0;
@@ -272,6 +520,767 @@ static struct mat_s *find_mat(GPtrArray *sorted_mats, const gchar *name,
   return NULL; // Not found
 }
 
+// Coplanar poly merging for the render mesh.
+//
+// qbsp splits faces along BSP planes, so a flat wall arrives as many small
+// windings. Polys sharing an edge, a plane and a texinfo are welded back
+// together as long as the result stays convex (the fan in triangulate_poly
+// stays valid), then winding vertices are dropped where every poly having
+// them has them on a straight edge; one a neighbour keeps as a corner would
+// leave a T-junction. The lightmap mesh (mesh->polys) keeps the original
+// split since every face has its own lightmap block, so only mesh.obj uses
+// the merged polys: the glTF carries lightmap UVs.
+
+#define MERGE_NORMAL_EPSILON 0.0001f
+#define MERGE_DIST_EPSILON 0.01f
+#define MERGE_CONTINUOUS_EPSILON 0.001f
+
+// vertices of neighbouring faces only differ by their lightmap UVs
+static gboolean render_vertex_eq(const struct mesh_s *mesh, guint a, guint b) {
+  if (a == b)
+    return TRUE;
+  const struct vertex_s *va =
+      &g_array_index(mesh->vertices, struct vertex_s, a);
+  const struct vertex_s *vb =
+      &g_array_index(mesh->vertices, struct vertex_s, b);
+  return qf(va->position.x) == qf(vb->position.x) &&
+         qf(va->position.y) == qf(vb->position.y) &&
+         qf(va->position.z) == qf(vb->position.z) &&
+         qf(va->uvs[0].x) == qf(vb->uvs[0].x) &&
+         qf(va->uvs[0].y) == qf(vb->uvs[0].y);
+}
+
+static gboolean polys_mergeable(const struct poly_s *a,
+                                const struct poly_s *b) {
+  if (a->texinfo_id != b->texinfo_id || a->model_id != b->model_id)
+    return FALSE;
+  if (fabsf(a->plane_dist - b->plane_dist) > MERGE_DIST_EPSILON)
+    return FALSE;
+  return vec3_dot(a->plane_normal, b->plane_normal) >
+         1.0f - MERGE_NORMAL_EPSILON;
+}
+
+// Newell normal, follows the winding order whatever it is
+static struct vec3_s winding_normal(const struct mesh_s *mesh,
+                                    const guint *verts, guint num_verts) {
+  struct vec3_s n = vec3_set(0.0f, 0.0f, 0.0f);
+  for (guint i = 0; i < num_verts; i++) {
+    struct vec3_s p = vertex_pos(mesh, verts[i]);
+    struct vec3_s q = vertex_pos(mesh, verts[(i + 1) % num_verts]);
+    n.x += (p.y - q.y) * (p.z + q.z);
+    n.y += (p.z - q.z) * (p.x + q.x);
+    n.z += (p.x - q.x) * (p.y + q.y);
+  }
+  return vec3_norm(n);
+}
+
+// Every turn must bend the same way and the turns must add up to a single
+// revolution; overlapping coplanar faces would otherwise wind around twice.
+static gboolean winding_is_convex(const struct mesh_s *mesh, const guint *verts,
+                                  guint num_verts, struct vec3_s normal) {
+  gfloat total_turn = 0.0f;
+  for (guint i = 0; i < num_verts; i++) {
+    struct vec3_s p0 = vertex_pos(mesh, verts[i]);
+    struct vec3_s p1 = vertex_pos(mesh, verts[(i + 1) % num_verts]);
+    struct vec3_s p2 = vertex_pos(mesh, verts[(i + 2) % num_verts]);
+    struct vec3_s e0 = vec3_norm(vec3_sub(p1, p0));
+    struct vec3_s e1 = vec3_norm(vec3_sub(p2, p1));
+    gfloat sin_turn = vec3_dot(vec3_cross(e0, e1), normal);
+    if (sin_turn < -MERGE_CONTINUOUS_EPSILON) {
+      return FALSE;
+    }
+    total_turn += atan2f(sin_turn, vec3_dot(e0, e1));
+  }
+  return fabsf(total_turn - 2.0f * PI) < 0.01f;
+}
+
+// polys touching at more than one edge would merge into a pinched winding
+static gboolean winding_has_duplicates(const struct mesh_s *mesh,
+                                       const guint *verts, guint num_verts) {
+  for (guint i = 0; i < num_verts; i++) {
+    for (guint j = i + 1; j < num_verts; j++) {
+      if (render_vertex_eq(mesh, verts[i], verts[j])) {
+        return TRUE;
+      }
+    }
+  }
+  return FALSE;
+}
+
+// Returns a new winding if a and b share an edge and their union is convex.
+static guint *try_merge_polys(const struct mesh_s *mesh,
+                              const struct poly_s *a, const struct poly_s *b,
+                              guint *num_merged) {
+  guint na = a->num_vertices;
+  guint nb = b->num_vertices;
+  for (guint i = 0; i < na; i++) {
+    guint p1 = a->vertices[i];
+    guint p2 = a->vertices[(i + 1) % na];
+    for (guint j = 0; j < nb; j++) {
+      if (!render_vertex_eq(mesh, b->vertices[j], p2) ||
+          !render_vertex_eq(mesh, b->vertices[(j + 1) % nb], p1)) {
+        continue;
+      }
+      // a from p2 around to p1, then the rest of b back towards p2
+      guint n = 0;
+      guint *merged = g_new(guint, na + nb - 2);
+      for (guint k = 0; k < na; k++) {
+        merged[n++] = a->vertices[(i + 1 + k) % na];
+      }
+      for (guint k = 0; k < nb - 2; k++) {
+        merged[n++] = b->vertices[(j + 2 + k) % nb];
+      }
+      struct vec3_s normal = winding_normal(mesh, a->vertices, na);
+      if (winding_has_duplicates(mesh, merged, n) ||
+          !winding_is_convex(mesh, merged, n, normal)) {
+        g_free(merged);
+        return NULL;
+      }
+      *num_merged = n;
+      return merged;
+    }
+  }
+  return NULL;
+}
+
+// Vertex positions of the render polys, whatever their UVs: how many polys
+// have a vertex there and in how many it is collinear. Dropping a position
+// only where every poly has it collinear leaves no poly a vertex on another
+// poly's edge, so no T-junction.
+struct merge_pos_s {
+  gint x, y, z;
+  guint uses, collinear;
+};
+
+static guint merge_pos_hash(gconstpointer key) {
+  const struct merge_pos_s *p = key;
+  return ((guint)p->x * 73856093u) ^ ((guint)p->y * 19349663u) ^
+         ((guint)p->z * 83492791u);
+}
+
+static gboolean merge_pos_eq(gconstpointer a, gconstpointer b) {
+  const struct merge_pos_s *pa = a, *pb = b;
+  return pa->x == pb->x && pa->y == pb->y && pa->z == pb->z;
+}
+
+static struct merge_pos_s *merge_pos(GHashTable *positions,
+                                     const struct mesh_s *mesh, guint v) {
+  struct vec3_s p = vertex_pos(mesh, v);
+  struct merge_pos_s key = {qf(p.x), qf(p.y), qf(p.z), 0, 0};
+  struct merge_pos_s *pos = g_hash_table_lookup(positions, &key);
+  if (pos == NULL) {
+    pos = g_memdup2(&key, sizeof(key));
+    g_hash_table_add(positions, pos);
+  }
+  return pos;
+}
+
+// whether cur lies on the straight line from prev to next
+static gboolean vertex_is_collinear(const struct mesh_s *mesh, guint prev,
+                                    guint cur, guint next) {
+  struct vec3_s cur_pos = vertex_pos(mesh, cur);
+  struct vec3_s e0 = vec3_norm(vec3_sub(cur_pos, vertex_pos(mesh, prev)));
+  struct vec3_s e1 = vec3_norm(vec3_sub(vertex_pos(mesh, next), cur_pos));
+  return vec3_len(vec3_cross(e0, e1)) < MERGE_CONTINUOUS_EPSILON &&
+         vec3_dot(e0, e1) > 0.0f;
+}
+
+static guint remove_duplicate_vertices(const struct mesh_s *mesh, guint *verts,
+                                       guint num_verts) {
+  for (guint i = 0; i < num_verts && num_verts > 3;) {
+    guint prev = verts[(i + num_verts - 1) % num_verts];
+    if (render_vertex_eq(mesh, prev, verts[i])) {
+      memmove(&verts[i], &verts[i + 1], sizeof(guint) * (num_verts - i - 1));
+      num_verts--;
+    } else {
+      i++;
+    }
+  }
+  return num_verts;
+}
+
+// Counts the poly's vertices into positions
+static void count_merge_positions(GHashTable *positions,
+                                  const struct mesh_s *mesh,
+                                  const struct poly_s *poly) {
+  guint n = poly->num_vertices;
+  for (guint i = 0; i < n; i++) {
+    struct merge_pos_s *pos = merge_pos(positions, mesh, poly->vertices[i]);
+    pos->uses++;
+    pos->collinear += vertex_is_collinear(mesh, poly->vertices[(i + n - 1) % n],
+                                          poly->vertices[i],
+                                          poly->vertices[(i + 1) % n]);
+  }
+}
+
+// Drops the collinear vertices whose position is collinear in every poly
+// using it. Collinear vertices stay collinear as their neighbours on the
+// same line go, so one pass does.
+static guint remove_collinear_vertices(const struct mesh_s *mesh,
+                                       GHashTable *positions, guint *verts,
+                                       guint num_verts) {
+  guint n = 0;
+  for (guint i = 0; i < num_verts; i++) {
+    const struct merge_pos_s *pos = merge_pos(positions, mesh, verts[i]);
+    if (pos->collinear < pos->uses || num_verts - i + n <= 3) {
+      verts[n++] = verts[i];
+    }
+  }
+  return n;
+}
+
+void merge_coplanar_polys(struct mesh_s *mesh) {
+  guint num_verts_in = 0, num_verts_out = 0;
+  guint num_tris_in = 0, num_tris_out = 0;
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
+    GArray *work = g_array_sized_new(FALSE, FALSE, sizeof(struct poly_s),
+                                     mat->polys->len);
+    for (guint j = 0; j < mat->polys->len; j++) {
+      const struct poly_s *src =
+          &g_array_index(mesh->polys, struct poly_s, mat->polys->data[j]);
+      struct poly_s poly;
+      init_poly(&poly, src->face_id);
+      poly.texinfo_id = src->texinfo_id;
+      poly.model_id = src->model_id;
+      poly.plane_normal = src->plane_normal;
+      poly.plane_dist = src->plane_dist;
+      poly.num_vertices = src->num_vertices;
+      poly.vertices =
+          g_memdup2(src->vertices, sizeof(guint) * src->num_vertices);
+      num_verts_in += poly.num_vertices;
+      num_tris_in += src->num_tris;
+      g_array_append_val(work, poly);
+    }
+
+    gboolean merged_any = TRUE;
+    while (merged_any) {
+      merged_any = FALSE;
+      for (guint a = 0; a < work->len; a++) {
+        for (guint b = a + 1; b < work->len; b++) {
+          struct poly_s *pa = &g_array_index(work, struct poly_s, a);
+          struct poly_s *pb = &g_array_index(work, struct poly_s, b);
+          if (!polys_mergeable(pa, pb)) {
+            continue;
+          }
+          guint num_merged = 0;
+          guint *merged = try_merge_polys(mesh, pa, pb, &num_merged);
+          if (merged == NULL) {
+            continue;
+          }
+          g_free(pa->vertices);
+          pa->vertices = merged;
+          pa->num_vertices = num_merged;
+          free_poly(pb);
+          g_array_remove_index_fast(work, b);
+          merged_any = TRUE;
+          b = a; // rescan with the grown winding
+        }
+      }
+    }
+
+    mat->render_polys = g_new(LISTOF(index), 1);
+    LIST_INIT(mat->render_polys, MAX(work->len, 1));
+    for (guint j = 0; j < work->len; j++) {
+      guint index = mesh->render_polys->len;
+      g_array_append_val(mesh->render_polys,
+                         g_array_index(work, struct poly_s, j));
+      LIST_APPEND(mat->render_polys, index);
+    }
+    g_array_free(work, TRUE);
+  }
+
+  // polys of every material touch, so collinear vertices go once all are
+  // merged
+  GHashTable *positions =
+      g_hash_table_new_full(merge_pos_hash, merge_pos_eq, g_free, NULL);
+  for (guint i = 0; i < mesh->render_polys->len; i++) {
+    struct poly_s *poly = &g_array_index(mesh->render_polys, struct poly_s, i);
+    poly->num_vertices =
+        remove_duplicate_vertices(mesh, poly->vertices, poly->num_vertices);
+    count_merge_positions(positions, mesh, poly);
+  }
+  for (guint i = 0; i < mesh->render_polys->len; i++) {
+    struct poly_s *poly = &g_array_index(mesh->render_polys, struct poly_s, i);
+    poly->num_vertices = remove_collinear_vertices(
+        mesh, positions, poly->vertices, poly->num_vertices);
+    num_verts_out += poly->num_vertices;
+    triangulate_poly_with_mode(mesh, poly, mesh->tri_mode);
+    num_tris_out += poly->num_tris;
+  }
+  g_hash_table_destroy(positions);
+  g_print("merged %u polys into %u render polys (%u -> %u winding vertices, "
+          "%u -> %u triangles)\n",
+          mesh->polys->len, mesh->render_polys->len, num_verts_in,
+          num_verts_out, num_tris_in, num_tris_out);
+}
+
+// Spatial chunking: every world poly goes to the uniform grid cell holding
+// its centroid, so exporters can emit one cullable node per occupied cell.
+// Brush models (doors, platforms) move on their own and always get one chunk
+// each. A chunk_size of 0 keeps the world in a single chunk.
+void build_mesh_chunks(struct mesh_s *mesh, gfloat chunk_size) {
+  GHashTable *cell_map =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  g_array_set_size(mesh->chunks, 0);
+  mesh->chunk_size = MAX(chunk_size, 0.0f);
+
+  for (guint i = 0; i < mesh->polys->len; i++) {
+    struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
+    if (poly->num_tris == 0) {
+      continue;
+    }
+    struct vec3_s centroid = vec3_set(0.0f, 0.0f, 0.0f);
+    for (guint j = 0; j < poly->num_vertices; j++) {
+      centroid = vec3_add(centroid, vertex_pos(mesh, poly->vertices[j]));
+    }
+    centroid = vec3_mul(centroid, 1.0f / poly->num_vertices);
+
+    gint cell[3] = {0, 0, 0};
+    gchar *key;
+    if (poly->model_id == 0 && mesh->chunk_size > 0.0f) {
+      for (guint k = 0; k < 3; k++) {
+        cell[k] = (gint)floorf(centroid.xyz[k] / chunk_size);
+      }
+      key = g_strdup_printf("%d,%d,%d", cell[0], cell[1], cell[2]);
+    } else {
+      key = g_strdup_printf("*%u", poly->model_id);
+    }
+    gpointer val = g_hash_table_lookup(cell_map, key);
+    if (val == NULL) {
+      struct mesh_chunk_s chunk;
+      chunk.model_id = poly->model_id;
+      memcpy(chunk.cell, cell, sizeof(cell));
+      chunk.min = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);
+      chunk.max = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);
+      chunk.num_polys = 0;
+      chunk.num_tris = 0;
+      g_array_append_val(mesh->chunks, chunk);
+      val = GUINT_TO_POINTER(mesh->chunks->len); // 1-based, NULL is "missing"
+      g_hash_table_insert(cell_map, key, val);
+    } else {
+      g_free(key);
+    }
+    poly->chunk_id = GPOINTER_TO_UINT(val) - 1;
+
+    struct mesh_chunk_s *chunk =
+        &g_array_index(mesh->chunks, struct mesh_chunk_s, poly->chunk_id);
+    for (guint j = 0; j < poly->num_vertices; j++) {
+      struct vec3_s p = vertex_pos(mesh, poly->vertices[j]);
+      chunk->min = vec3_min(chunk->min, p);
+      chunk->max = vec3_max(chunk->max, p);
+    }
+    chunk->num_polys++;
+    chunk->num_tris += poly->num_tris;
+  }
+  g_hash_table_destroy(cell_map);
+
+  guint min_tris = G_MAXUINT, max_tris = 0, total_tris = 0;
+  guint num_world = 0, num_models = 0, model_polys = 0;
+  for (guint i = 0; i < mesh->chunks->len; i++) {
+    struct mesh_chunk_s *chunk =
+        &g_array_index(mesh->chunks, struct mesh_chunk_s, i);
+    if (chunk->model_id > 0) {
+      num_models++;
+      model_polys += chunk->num_polys;
+      continue;
+    }
+    num_world++;
+    min_tris = MIN(min_tris, chunk->num_tris);
+    max_tris = MAX(max_tris, chunk->num_tris);
+    total_tris += chunk->num_tris;
+  }
+  if (num_world > 0 && mesh->chunk_size > 0.0f) {
+    g_print("chunked %u polys into %u chunks of %g units (triangles per chunk: "
+            "min %u, max %u, avg %.1f)\n",
+            mesh->polys->len - model_polys, num_world, chunk_size, min_tris,
+            max_tris, (gfloat)total_tris / num_world);
+  }
+  if (num_models > 0) {
+    g_print("%u brush models with %u polys get a chunk each\n", num_models,
+            model_polys);
+  }
+}
+
+// BVH over the triangles of the polys keep accepts (all with keep NULL),
+// each with its poly index as id.
+void build_mesh_bvh(struct bvh_s *bvh, const struct mesh_s *mesh,
+                    gboolean (*keep)(const struct poly_s *poly, gpointer data),
+                    gpointer data) {
+  guint num_tris = 0;
+  for (guint i = 0; i < mesh->polys->len; i++) {
+    const struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
+    if (keep == NULL || keep(poly, data)) {
+      num_tris += poly->num_tris;
+    }
+  }
+  struct vec3_s *verts = g_new(struct vec3_s, MAX(num_tris, 1) * 3);
+  guint32 *ids = g_new(guint32, MAX(num_tris, 1));
+  guint n = 0;
+  for (guint i = 0; i < mesh->polys->len; i++) {
+    const struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
+    if (keep != NULL && !keep(poly, data)) {
+      continue;
+    }
+    for (guint j = 0; j < poly->num_tris; j++, n++) {
+      verts[n * 3] = vertex_pos(mesh, poly->tris[j].v0);
+      verts[n * 3 + 1] = vertex_pos(mesh, poly->tris[j].v1);
+      verts[n * 3 + 2] = vertex_pos(mesh, poly->tris[j].v2);
+      ids[n] = i;
+    }
+  }
+  build_bvh(bvh, verts, ids, num_tris);
+  g_free(verts);
+  g_free(ids);
+}
+
+static gint tex_res_cmp_fn(gconstpointer a, gconstpointer b,
+                           gpointer user_data) {
+  GPtrArray *mats = user_data;
+  guint ia = *(const guint *)a, ib = *(const guint *)b;
+  const struct mat_s *ma = g_ptr_array_index(mats, ia);
+  const struct mat_s *mb = g_ptr_array_index(mats, ib);
+  if (ma->width != mb->width)
+    return ma->width < mb->width ? -1 : 1;
+  if (ma->height != mb->height)
+    return ma->height < mb->height ? -1 : 1;
+  return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+// Texture array batching: materials with the same texture resolution become
+// layers of one array, so a renderer binds one texture per resolution class
+// instead of one per material. Layers stay in material (name) order.
+void build_texture_arrays(struct mesh_s *mesh) {
+  for (guint i = 0; i < mesh->tex_arrays->len; i++) {
+    g_free(g_array_index(mesh->tex_arrays, struct tex_array_s, i).mats);
+  }
+  g_array_set_size(mesh->tex_arrays, 0);
+
+  guint *order = g_new(guint, MAX(mesh->mats->len, 1));
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    order[i] = i;
+  }
+  g_qsort_with_data(order, mesh->mats->len, sizeof(guint), tex_res_cmp_fn,
+                    mesh->mats);
+
+  for (guint i = 0; i < mesh->mats->len;) {
+    const struct mat_s *first = g_ptr_array_index(mesh->mats, order[i]);
+    guint n = 1;
+    while (i + n < mesh->mats->len) {
+      const struct mat_s *mat = g_ptr_array_index(mesh->mats, order[i + n]);
+      if (mat->width != first->width || mat->height != first->height) {
+        break;
+      }
+      n++;
+    }
+    struct tex_array_s array;
+    array.width = first->width;
+    array.height = first->height;
+    array.num_layers = n;
+    array.mats = g_memdup2(&order[i], n * sizeof(guint));
+    for (guint j = 0; j < n; j++) {
+      struct mat_s *mat = g_ptr_array_index(mesh->mats, order[i + j]);
+      mat->tex_array = mesh->tex_arrays->len;
+      mat->tex_layer = j;
+    }
+    g_array_append_val(mesh->tex_arrays, array);
+    g_print("texture array %u: %u x %u, %u layers\n", mesh->tex_arrays->len - 1,
+            array.width, array.height, array.num_layers);
+    i += n;
+  }
+  g_free(order);
+  g_print("%u materials batched into %u texture arrays\n", mesh->mats->len,
+          mesh->tex_arrays->len);
+}
+
+// Writes each texture array as a vertical strip of its layers,
+// export/textures/array_<w>x<h>.png.
+void export_texture_arrays(const struct mesh_s *mesh) {
+  for (guint i = 0; i < mesh->tex_arrays->len; i++) {
+    const struct tex_array_s *array =
+        &g_array_index(mesh->tex_arrays, struct tex_array_s, i);
+    if (array->width == 0 || array->height == 0) {
+      continue;
+    }
+    gsize layer_size = (gsize)array->width * array->height;
+    struct rgba_s *strip =
+        g_new0(struct rgba_s, layer_size * array->num_layers);
+    for (guint j = 0; j < array->num_layers; j++) {
+      const struct mat_s *mat = g_ptr_array_index(mesh->mats, array->mats[j]);
+      if (mat->texture_data) {
+        memcpy(strip + j * layer_size, mat->texture_data,
+               layer_size * sizeof(struct rgba_s));
+      }
+    }
+    gchar *img_file = g_strdup_printf("export/textures/array_%ux%u.png",
+                                      array->width, array->height);
+    unsigned error =
+        lodepng_encode32_file(img_file, (const unsigned char *)strip,
+                              array->width, array->height * array->num_layers);
+    if (error) {
+      g_error("error %u: %s\n", error, lodepng_error_text(error));
+    }
+    g_free(img_file);
+    g_free(strip);
+  }
+}
+
+static gint atlas_slot_cmp_fn(gconstpointer a, gconstpointer b,
+                              gpointer user_data) {
+  GPtrArray *mats = user_data;
+  guint ia = *(const guint *)a, ib = *(const guint *)b;
+  const struct mat_s *ma = g_ptr_array_index(mats, ia);
+  const struct mat_s *mb = g_ptr_array_index(mats, ib);
+  if (ma->height != mb->height)
+    return ma->height > mb->height ? -1 : 1;
+  if (ma->width != mb->width)
+    return ma->width > mb->width ? -1 : 1;
+  return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+static guint next_pow2(guint x) {
+  guint p = 1;
+  while (p < x) {
+    p <<= 1;
+  }
+  return p;
+}
+
+// Slot size for a texture side: the side rounded up to a multiple of the
+// gutter (a power of two), plus the gutter on both ends.
+static inline guint atlas_slot_size(guint size, guint gutter) {
+  return ((size + gutter - 1) & ~(gutter - 1)) + 2 * gutter;
+}
+
+// Packs the slots into shelves of the given width, returns the height used.
+static guint shelf_pack(const GPtrArray *mats, const guint *order,
+                        guint num_slots, guint gutter, guint width,
+                        guint *slot_x, guint *slot_y) {
+  guint shelf_x = 0, shelf_y = 0, shelf_h = 0;
+  for (guint i = 0; i < num_slots; i++) {
+    const struct mat_s *mat = g_ptr_array_index(mats, order[i]);
+    guint w = atlas_slot_size(mat->width, gutter);
+    guint h = atlas_slot_size(mat->height, gutter);
+    if (shelf_x + w > width) {
+      shelf_y += shelf_h;
+      shelf_x = shelf_h = 0;
+    }
+    slot_x[i] = shelf_x;
+    slot_y[i] = shelf_y;
+    shelf_x += w;
+    shelf_h = MAX(shelf_h, h);
+  }
+  return shelf_y + shelf_h;
+}
+
+// Shelf-packs every material texture (plus gutter) into a power of two
+// atlas, trying a few widths for the smallest one. The gutter is
+// 2^(mip_levels - 1) and slots are padded to multiples of it, so every
+// texture starts on a block boundary of mip level mip_levels - 1. Quake
+// textures are multiples of 16 texels and need no padding up to 5 levels.
+void build_diffuse_atlas(struct mesh_s *mesh, guint mip_levels) {
+  mip_levels = CLAMP(mip_levels, 1, 8);
+  guint gutter = 1u << (mip_levels - 1);
+
+  guint *order = g_new(guint, MAX(mesh->mats->len, 1));
+  guint num_slots = 0;
+  guint64 area = 0;
+  guint max_w = 0;
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    const struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
+    if (mat->texture_data == NULL || mat->width == 0 || mat->height == 0) {
+      continue;
+    }
+    order[num_slots++] = i;
+    area += (guint64)atlas_slot_size(mat->width, gutter) *
+            atlas_slot_size(mat->height, gutter);
+    max_w = MAX(max_w, atlas_slot_size(mat->width, gutter));
+  }
+  g_qsort_with_data(order, num_slots, sizeof(guint), atlas_slot_cmp_fn,
+                    mesh->mats);
+
+  guint *slot_x = g_new(guint, MAX(num_slots, 1));
+  guint *slot_y = g_new(guint, MAX(num_slots, 1));
+  guint min_width = next_pow2(MAX(max_w, 1));
+  guint max_width = next_pow2(MAX(min_width, 2 * (guint)ceil(sqrt(area))));
+  guint width = max_width, height = G_MAXUINT;
+  for (guint w = min_width; w <= max_width; w <<= 1) {
+    guint h = next_pow2(MAX(
+        shelf_pack(mesh->mats, order, num_slots, gutter, w, slot_x, slot_y),
+        1));
+    if ((guint64)w * h < (guint64)width * height ||
+        ((guint64)w * h == (guint64)width * height && w < width)) {
+      width = w;
+      height = h;
+    }
+  }
+  shelf_pack(mesh->mats, order, num_slots, gutter, width, slot_x, slot_y);
+
+  struct diffuse_atlas_s *atlas = mesh->diffuse_atlas;
+  if (atlas == NULL) {
+    atlas = mesh->diffuse_atlas = g_new0(struct diffuse_atlas_s, 1);
+  }
+  g_free(atlas->data);
+  atlas->width = width;
+  atlas->height = height;
+  atlas->mip_levels = mip_levels;
+  atlas->gutter = gutter;
+  atlas->data = g_new0(struct rgba_s, (gsize)width * height);
+
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
+    memset(mat->atlas_rect, 0, sizeof(mat->atlas_rect));
+  }
+  guint64 used = 0;
+  for (guint i = 0; i < num_slots; i++) {
+    struct mat_s *mat = g_ptr_array_index(mesh->mats, order[i]);
+    gint w = mat->width, h = mat->height;
+    gint g = gutter;
+    gint slot_w = atlas_slot_size(w, gutter);
+    gint slot_h = atlas_slot_size(h, gutter);
+    // texture plus gutter and padding, wrapping like a repeat sampler would
+    for (gint y = -g; y < slot_h - g; y++) {
+      gint sy = ((y % h) + h) % h;
+      struct rgba_s *dst =
+          &atlas->data[(gsize)(slot_y[i] + g + y) * width + slot_x[i] + g];
+      for (gint x = -g; x < slot_w - g; x++) {
+        dst[x] = mat->texture_data[sy * w + ((x % w) + w) % w];
+      }
+    }
+    mat->atlas_rect[0] = (gfloat)(slot_x[i] + gutter) / width;
+    mat->atlas_rect[1] = (gfloat)(slot_y[i] + gutter) / height;
+    mat->atlas_rect[2] = (gfloat)w / width;
+    mat->atlas_rect[3] = (gfloat)h / height;
+    used += (guint64)w * h;
+  }
+  g_print("diffuse atlas: %u textures in %u x %u, gutter %u (%u mips), "
+          "%.1f%% texels used\n",
+          num_slots, width, height, gutter, mip_levels,
+          100.0 * used / ((gdouble)width * height));
+  g_free(slot_x);
+  g_free(slot_y);
+  g_free(order);
+}
+
+void export_diffuse_atlas(const struct mesh_s *mesh) {
+  const struct diffuse_atlas_s *atlas = mesh->diffuse_atlas;
+  if (atlas == NULL) {
+    return;
+  }
+  unsigned error = lodepng_encode32_file(
+      "export/textures/atlas.png", (const unsigned char *)atlas->data,
+      atlas->width, atlas->height);
+  if (error) {
+    g_error("error %u: %s\n", error, lodepng_error_text(error));
+  }
+}
+
+static void triangulate_mat_task(gpointer data, gpointer user_data) {
+  struct mat_s *mat = data;
+  struct mesh_s *mesh = user_data;
+  guint num_tris = 0;
+  for (guint j = 0; j < mat->polys->len; j++) {
+    guint poly_idx = mat->polys->data[j];
+    struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, poly_idx);
+    if (0 == poly->num_tris) {
+      triangulate_poly_with_mode(mesh, poly, mesh->tri_mode);
+    }
+    num_tris += poly->num_tris;
+  }
+  mat->tris = g_new(LISTOF(tri), 1);
+  LIST_INIT(mat->tris, MAX(num_tris, 1));
+  for (guint j = 0; j < mat->polys->len; j++) {
+    guint poly_idx = mat->polys->data[j];
+    struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, poly_idx);
+    for (guint k = 0; k < poly->num_tris; k++) {
+      LIST_APPEND(mat->tris, poly->tris[k]);
+    }
+  }
+}
+
+// Per channel (in rgba[] order) sum of squares, min and max over count
+// pixels. Squares of 8-bit values are summed as integers, so the RMS average
+// is exact.
+static void color_stats(const struct rgba_s *pixels, guint count,
+                        guint64 sum_sq[4], struct rgba_s *min,
+                        struct rgba_s *max) {
+  guint8 lo[4] = {255, 255, 255, 255}, hi[4] = {0, 0, 0, 0};
+  memset(sum_sq, 0, 4 * sizeof(guint64));
+  guint i = 0;
+#ifdef __SSE2__
+  // 4 pixels per vector: byte min/max work per channel as is, squares are
+  // taken in 16 bits (255^2 fits) and summed in 32-bit lanes, flushed to 64
+  // bits before they can overflow
+  __m128i vlo = _mm_set1_epi8((gchar)0xff), vhi = _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 4 <= count) {
+    __m128i acc = _mm_setzero_si128();
+    guint end = MIN(count & ~3u, i + 4 * 16384);
+    for (; i < end; i += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *)&pixels[i]);
+      vlo = _mm_min_epu8(vlo, p);
+      vhi = _mm_max_epu8(vhi, p);
+      __m128i p0 = _mm_unpacklo_epi8(p, zero); // pixels 0, 1 as 16 bits
+      __m128i p1 = _mm_unpackhi_epi8(p, zero); // pixels 2, 3
+      __m128i s0 = _mm_mullo_epi16(p0, p0);
+      __m128i s1 = _mm_mullo_epi16(p1, p1);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(s0, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(s0, zero));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(s1, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(s1, zero));
+    }
+    guint32 lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    for (guint c = 0; c < 4; c++) {
+      sum_sq[c] += lanes[c];
+    }
+  }
+  guint8 vl[16], vh[16];
+  _mm_storeu_si128((__m128i *)vl, vlo);
+  _mm_storeu_si128((__m128i *)vh, vhi);
+  for (guint k = 0; k < 16; k++) {
+    lo[k & 3] = MIN(lo[k & 3], vl[k]);
+    hi[k & 3] = MAX(hi[k & 3], vh[k]);
+  }
+#endif
+  for (; i < count; i++) {
+    for (guint c = 0; c < 4; c++) {
+      guint8 p = pixels[i].rgba[c];
+      sum_sq[c] += (guint)p * p;
+      lo[c] = MIN(lo[c], p);
+      hi[c] = MAX(hi[c], p);
+    }
+  }
+  for (guint c = 0; c < 4; c++) {
+    min->rgba[c] = lo[c];
+    max->rgba[c] = hi[c];
+  }
+}
+
+struct mat_stats_s {
+  const struct texinfo_s *texinfo;
+  struct mat_s *mat; // NULL if no material uses the texture
+  gint searches;
+  struct rgba_s min, max;
+};
+
+static void mat_stats_task(gpointer data, gpointer user_data) {
+  struct mat_stats_s *stats = data;
+  const struct texinfo_s *texinfo = stats->texinfo;
+  struct mat_s *mat = stats->mat;
+  guint count = texinfo->width * texinfo->height;
+  mat->width = texinfo->width;
+  mat->height = texinfo->height;
+  mat->texture_data = g_memdup2(texinfo->data, count * sizeof(struct rgba_s));
+
+  guint64 sum_sq[4];
+  color_stats(mat->texture_data, count, sum_sq, &stats->min, &stats->max);
+  for (guint c = 0; c < 4; c++) {
+    gdouble rms = count ? sqrt((gdouble)sum_sq[c] / count) : 0.0;
+    mat->avg_color.rgba[c] = (guint8)CLAMP_COLOR_COMPONENT(rms);
+  }
+}
+
 void build_mesh(struct mesh_s *mesh, const struct texinfo_s *texinfos,
                 guint num_texinfos, guint atlas_width, guint atlas_height,
                 struct vec3_s rotate) {
@@ -295,32 +1304,23 @@ void build_mesh(struct mesh_s *mesh, const struct texinfo_s *texinfos,
   //   rotation_matrix);
   // }
 
+  // materials own disjoint polys, so each one is triangulated on its own
+  // task; logs are printed afterwards in material order
+  GThreadPool *pool = g_thread_pool_new(triangulate_mat_task, mesh,
+                                        g_get_num_processors(), TRUE, NULL);
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    g_thread_pool_push(pool, g_ptr_array_index(mesh->mats, i), NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
   for (guint i = 0; i < mesh->mats->len; i++) {
     struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
     g_print("triangulating material %u of %u (%s)\n", i + 1, mesh->mats->len,
             mat->name);
-    guint num_tris = 0;
-    for (guint j = 0; j < mat->polys->len; j++) {
-      guint poly_idx = mat->polys->data[j];
-      struct poly_s *poly =
-          &g_array_index(mesh->polys, struct poly_s, poly_idx);
-      if (0 == poly->num_tris) {
-        triangulate_poly(poly);
-      }
-      num_tris += poly->num_tris;
-    }
-    g_print("# of triangle: %u\n", num_tris);
-    mat->tris = g_new(LISTOF(tri), 1);
-    LIST_INIT(mat->tris, num_tris);
-    for (guint j = 0; j < mat->polys->len; j++) {
-      guint poly_idx = mat->polys->data[j];
-      struct poly_s *poly =
-          &g_array_index(mesh->polys, struct poly_s, poly_idx);
-      for (guint k = 0; k < poly->num_tris; k++) {
-        LIST_APPEND(mat->tris, poly->tris[k]);
-      }
-    }
+    g_print("# of triangle: %u\n", mat->tris->len);
   }
+  print_tri_quality(mesh, mesh->polys, "lightmap mesh");
+  merge_coplanar_polys(mesh);
+  print_tri_quality(mesh, mesh->render_polys, "render mesh");
   if (texinfos && num_texinfos > 0) {
     const guint max_res = 256 + 128;
     guint *tex_res = g_new(guint, max_res * max_res);
@@ -329,70 +1329,57 @@ void build_mesh(struct mesh_s *mesh, const struct texinfo_s *texinfos,
         tex_res[i * max_res + j] = 0;
       }
     }
+    // material lookups stay serial (cheap), texture copies and color
+    // statistics run as tasks, logs are printed afterwards in texinfo order.
+    // Texinfos sharing a name share a material: as when this ran serially,
+    // the last one fills it, so each material gets exactly one task.
+    struct mat_stats_s *stats = g_new0(struct mat_stats_s, num_texinfos);
+    GHashTable *mat_owner = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (guint i = 0; i < num_texinfos; i++) {
+      stats[i].texinfo = &texinfos[i];
+      stats[i].mat = find_mat(mesh->mats, texinfos[i].name, &stats[i].searches);
+      if (stats[i].mat) {
+        g_hash_table_insert(mat_owner, stats[i].mat, &stats[i]);
+      }
+    }
+    pool = g_thread_pool_new(mat_stats_task, NULL, g_get_num_processors(),
+                             TRUE, NULL);
+    for (guint i = 0; i < num_texinfos; i++) {
+      if (stats[i].mat &&
+          g_hash_table_lookup(mat_owner, stats[i].mat) == &stats[i]) {
+        g_thread_pool_push(pool, &stats[i], NULL);
+      }
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    for (guint i = 0; i < num_texinfos; i++) {
+      if (stats[i].mat) {
+        const struct mat_stats_s *owner =
+            g_hash_table_lookup(mat_owner, stats[i].mat);
+        stats[i].min = owner->min;
+        stats[i].max = owner->max;
+      }
+    }
+    g_hash_table_destroy(mat_owner);
     for (guint i = 0; i < num_texinfos; i++) {
       const struct texinfo_s *texinfo = &texinfos[i];
+      struct mat_s *mat = stats[i].mat;
       g_print("texinfo[%u]: name='%s' size=%ux%u\n", i, texinfo->name,
               texinfo->width, texinfo->height);
-      gint searches = 0;
-      struct mat_s *mat = find_mat(mesh->mats, texinfo->name, &searches);
       if (mat) {
         g_print(" * found matching material '%s' (after %d searches)\n",
-                mat->name, searches);
-        mat->width = texinfo->width;
-        mat->height = texinfo->height;
-        mat->texture_data =
-            g_memdup2(texinfo->data,
-                      texinfo->width * texinfo->height * sizeof(struct rgba_s));
-        guint count;
-        double r, g, b, a;
-        guint minr = 255, ming = 255, minb = 255;
-        guint maxr = 0, maxg = 0, maxb = 0;
-        r = g = b = a = 0.0;
-        count = 0;
-        for (guint j = 0; j < mat->width * mat->height; j++) {
-          struct rgba_s *pixel = &mat->texture_data[j];
-          r += SQ((double)pixel->r / 255.0);
-          g += SQ((double)pixel->g / 255.0);
-          b += SQ((double)pixel->b / 255.0);
-          a += SQ((double)pixel->a / 255.0);
-          count++;
-
-          if (pixel->r < minr)
-            minr = pixel->r;
-          if (pixel->r > maxr)
-            maxr = pixel->r;
-          if (pixel->g < ming)
-            ming = pixel->g;
-          if (pixel->g > maxg)
-            maxg = pixel->g;
-          if (pixel->b < minb)
-            minb = pixel->b;
-          if (pixel->b > maxb)
-            maxb = pixel->b;
-        }
-        r /= (double)count;
-        g /= (double)count;
-        b /= (double)count;
-        a /= (double)count;
-        r = sqrt(r) * 255.0;
-        g = sqrt(g) * 255.0;
-        b = sqrt(b) * 255.0;
-        a = sqrt(a) * 255.0;
-        mat->avg_color.r = (guint8)CLAMP_COLOR_COMPONENT(r);
-        mat->avg_color.g = (guint8)CLAMP_COLOR_COMPONENT(g);
-        mat->avg_color.b = (guint8)CLAMP_COLOR_COMPONENT(b);
-        mat->avg_color.a = (guint8)CLAMP_COLOR_COMPONENT(a);
-
+                mat->name, stats[i].searches);
         g_print("   avg color: R=%u G=%u B=%u A=%u\n", mat->avg_color.r,
                 mat->avg_color.g, mat->avg_color.b, mat->avg_color.a);
-        g_print("   min color: R=%u G=%u B=%u\n", minr, ming, minb);
-        g_print("   max color: R=%u G=%u B=%u\n", maxr, maxg, maxb);
+        g_print("   min color: R=%u G=%u B=%u\n", stats[i].min.r,
+                stats[i].min.g, stats[i].min.b);
+        g_print("   max color: R=%u G=%u B=%u\n", stats[i].max.r,
+                stats[i].max.g, stats[i].max.b);
         tex_res[mat->height * max_res + mat->width]++;
-
       } else {
         g_print(" * (ignored)\n");
       }
     }
+    g_free(stats);
     // Print texture resolution histogram
     for (guint i = 0; i < max_res; i++) {
       for (guint j = 0; j < max_res; j++) {
@@ -404,6 +1391,7 @@ void build_mesh(struct mesh_s *mesh, const struct texinfo_s *texinfos,
     }
     g_free(tex_res);
   }
+  build_texture_arrays(mesh);
 }
 
 void free_mesh(struct mesh_s **mesh) {
@@ -414,13 +1402,33 @@ void free_mesh(struct mesh_s **mesh) {
     free_poly(poly);
   }
   g_array_free((*mesh)->polys, TRUE);
+  for (guint i = 0; i < (*mesh)->render_polys->len; i++) {
+    struct poly_s *poly =
+        &g_array_index((*mesh)->render_polys, struct poly_s, i);
+    free_poly(poly);
+  }
+  g_array_free((*mesh)->render_polys, TRUE);
+  g_array_free((*mesh)->chunks, TRUE);
+  for (guint i = 0; i < (*mesh)->tex_arrays->len; i++) {
+    g_free(g_array_index((*mesh)->tex_arrays, struct tex_array_s, i).mats);
+  }
+  g_array_free((*mesh)->tex_arrays, TRUE);
   g_hash_table_destroy((*mesh)->material_map);
   g_ptr_array_free((*mesh)->mats, TRUE);
   g_free((*mesh)->texture_atlas->diffuse_data);
-  g_free((*mesh)->texture_atlas->normal_data);
-  g_free((*mesh)->texture_atlas->position_data);
+  for (guint k = 0; k < 3; k++) {
+    g_aligned_free((*mesh)->texture_atlas->normal_planes[k]);
+    g_aligned_free((*mesh)->texture_atlas->position_planes[k]);
+  }
+  g_free((*mesh)->texture_atlas->coverage);
+  g_free((*mesh)->texture_atlas->tile_mask);
+  g_free((*mesh)->texture_atlas->baked_data);
   g_free((*mesh)->texture_atlas->poly_regions);
   g_free((*mesh)->texture_atlas);
+  if ((*mesh)->diffuse_atlas) {
+    g_free((*mesh)->diffuse_atlas->data);
+    g_free((*mesh)->diffuse_atlas);
+  }
   g_free(*mesh);
   *mesh = NULL;
 }
@@ -458,53 +1466,681 @@ void export_mesh_with_mats_to_obj(struct mesh_s *mesh, gfloat scale) {
   g_string_append(obj, "mtllib mesh.mtl\n");
   g_string_append(obj, "usemtl mesh\n");
 
-  // Write vertices
+  // Only the vertices the written faces use, and only once per position and
+  // diffuse UV: vertices that differ by their lightmap UVs alone merge.
+  guint *remap = g_new(guint, MAX(mesh->vertices->len, 1));
   for (guint i = 0; i < mesh->vertices->len; i++) {
-    struct vertex_s *v = &g_array_index(mesh->vertices, struct vertex_s, i);
+    remap[i] = G_MAXUINT;
+  }
+  GHashTable *written =
+      g_hash_table_new_full(vertex_hash_fn, vertex_eq_fn, g_free, NULL);
+  GArray *out = g_array_new(FALSE, FALSE, sizeof(guint));
+  for (guint i = 0; i < mesh->mats->len; i++) {
+    struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
+    gboolean merged = mat->render_polys != NULL;
+    LISTOF(index) *poly_list = merged ? mat->render_polys : mat->polys;
+    GArray *polys = merged ? mesh->render_polys : mesh->polys;
+    for (guint j = 0; j < poly_list->len; j++) {
+      struct poly_s *poly =
+          &g_array_index(polys, struct poly_s, poly_list->data[j]);
+      for (guint k = 0; k < poly->num_tris; k++) {
+        const struct tri_s *tri = &poly->tris[k];
+        const guint tri_verts[3] = {tri->v0, tri->v1, tri->v2};
+        for (guint c = 0; c < 3; c++) {
+          guint v = tri_verts[c];
+          if (remap[v] != G_MAXUINT) {
+            continue;
+          }
+          struct vertex_s key =
+              g_array_index(mesh->vertices, struct vertex_s, v);
+          key.uvs[1].x = key.uvs[1].y = 0.0f;
+          gpointer index;
+          if (g_hash_table_lookup_extended(written, &key, NULL, &index)) {
+            remap[v] = GPOINTER_TO_UINT(index);
+          } else {
+            remap[v] = out->len;
+            g_hash_table_insert(written, g_memdup2(&key, sizeof(key)),
+                                GUINT_TO_POINTER(out->len));
+            g_array_append_val(out, v);
+          }
+        }
+      }
+    }
+  }
+  g_hash_table_destroy(written);
+
+  // Write vertices
+  for (guint i = 0; i < out->len; i++) {
+    struct vertex_s *v = &g_array_index(mesh->vertices, struct vertex_s,
+                                        g_array_index(out, guint, i));
     g_string_append_printf(obj, "v %g %g %g\n", v->position.x * scale,
                            v->position.y * scale, v->position.z * scale);
   }
 
   // Write texture coordinates
-  for (guint i = 0; i < mesh->vertices->len; i++) {
-    struct vertex_s *v = &g_array_index(mesh->vertices, struct vertex_s, i);
+  for (guint i = 0; i < out->len; i++) {
+    struct vertex_s *v = &g_array_index(mesh->vertices, struct vertex_s,
+                                        g_array_index(out, guint, i));
     g_string_append_printf(obj, "vt %g %g\n", v->uvs[0].x, v->uvs[0].y);
   }
+  g_print("mesh.obj: %u of %u vertices\n", out->len, mesh->vertices->len);
+  g_array_free(out, TRUE);
 
   for (guint i = 0; i < mesh->mats->len; i++) {
     struct mat_s *mat = g_ptr_array_index(mesh->mats, i);
     g_string_append_printf(obj, "usemtl %s\n", mat->name);
 
-    // Write faces
-    for (guint j = 0; j < mat->polys->len; j++) {
-      guint poly_idx = mat->polys->data[j];
-      struct poly_s *poly =
-          &g_array_index(mesh->polys, struct poly_s, poly_idx);
+    // Write faces (merged render polys when available)
+    gboolean merged = mat->render_polys != NULL;
+    LISTOF(index) *poly_list = merged ? mat->render_polys : mat->polys;
+    GArray *polys = merged ? mesh->render_polys : mesh->polys;
+    for (guint j = 0; j < poly_list->len; j++) {
+      guint poly_idx = poly_list->data[j];
+      struct poly_s *poly = &g_array_index(polys, struct poly_s, poly_idx);
       for (guint k = 0; k < poly->num_tris; k++) {
         struct tri_s *tri = &poly->tris[k];
         g_string_append(obj, "f");
-        g_string_append_printf(obj, " %u/%u", tri->v0 + 1, tri->v0 + 1);
-        g_string_append_printf(obj, " %u/%u", tri->v1 + 1, tri->v1 + 1);
-        g_string_append_printf(obj, " %u/%u", tri->v2 + 1, tri->v2 + 1);
+        guint v0 = remap[tri->v0] + 1, v1 = remap[tri->v1] + 1;
+        guint v2 = remap[tri->v2] + 1;
+        g_string_append_printf(obj, " %u/%u", v0, v0);
+        g_string_append_printf(obj, " %u/%u", v1, v1);
+        g_string_append_printf(obj, " %u/%u", v2, v2);
         g_string_append_c(obj, '\n');
       }
     }
   }
+  g_free(remap);
   g_file_set_contents("mesh.obj", obj->str, obj->len, NULL);
   g_string_free(obj, TRUE);
 }
 
-void create_mesh_g_buffer(struct mesh_s *mesh) {
+// Rows of the g-buffer shaded per task
+#define G_BUFFER_BAND_ROWS 32 // a multiple of G_BUFFER_TILE
+
+struct g_buffer_job_s {
+  struct atlas_s *atlas;
+  const struct mesh_s *mesh;
+  const struct rgba_s *poly_colors;
+  const struct light_s *lights; // static lights only
+  guint num_lights;
+  gint num_tiles, num_tile_lights; // for the average lights per tile
+  const struct bake_opts_s *bake; // NULL to light without shadows
+  gsize num_rays;
+};
+
+// Shadow rays start this far off the surface, along its normal
+#define BAKE_NUDGE 1.0f
+// light.exe halves the light sum into a luxel (its default -range)
+#define BAKE_RANGE_SCALE 0.5f
+// Farthest neighbour texel a ray start in solid moves to
+#define BAKE_NEIGHBOUR_DIST 32.0f
+
+// Marks the texels of poly i's block that bilinear sampling inside the poly
+// can read: the texel centers within one texel of its lightmap UV winding.
+// Each edge function gets the texel's extent added, which keeps the test
+// conservative for the convex windings of BSP faces.
+static void cover_poly(struct atlas_s *atlas, const struct mesh_s *mesh,
+                       guint i) {
+  const struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
+  const struct poly_region_s *region = &atlas->poly_regions[i];
+  gint rect_w = region->rotated ? region->h : region->w;
+  gint rect_h = region->rotated ? region->w : region->h;
+  guint8 *coverage =
+      atlas->coverage + (gsize)region->page * atlas->width * atlas->height;
+
+  // winding in atlas texels, counter-clockwise
+  struct vec2_s *pts = g_newa(struct vec2_s, MAX(poly->num_vertices, 1));
+  gfloat area = 0.0f;
+  for (guint j = 0; j < poly->num_vertices; j++) {
+    const struct vertex_s *v =
+        &g_array_index(mesh->vertices, struct vertex_s, poly->vertices[j]);
+    pts[j].x = v->uvs[1].x * atlas->width;
+    pts[j].y = (1.0f - v->uvs[1].y) * atlas->height;
+  }
+  for (guint j = 0; j < poly->num_vertices; j++) {
+    const struct vec2_s *a = &pts[j];
+    const struct vec2_s *b = &pts[(j + 1) % poly->num_vertices];
+    area += a->x * b->y - b->x * a->y;
+  }
+  gfloat sign = area < 0.0f ? -1.0f : 1.0f;
+  // slivers (and uniform blocks, whose UVs all hit one texel) keep the
+  // whole block
+  gboolean whole = fabsf(area) < 1e-6f || poly->num_vertices < 3;
+
+  for (gint y = 0; y < rect_h; y++) {
+    for (gint x = 0; x < rect_w; x++) {
+      gfloat cx = region->x + x + 0.5f, cy = region->y + y + 0.5f;
+      gboolean inside = TRUE;
+      for (guint j = 0; inside && !whole && j < poly->num_vertices; j++) {
+        const struct vec2_s *a = &pts[j];
+        const struct vec2_s *b = &pts[(j + 1) % poly->num_vertices];
+        gfloat ex = (b->x - a->x) * sign, ey = (b->y - a->y) * sign;
+        // >= 0 on the inner side; a texel away counts |ex| + |ey| more
+        gfloat e = ex * (cy - a->y) - ey * (cx - a->x);
+        inside = e + fabsf(ex) + fabsf(ey) >= 0.0f;
+      }
+      if (inside) {
+        coverage[(gsize)(region->y + y) * atlas->width + region->x + x] = 1;
+      }
+    }
+  }
+}
+
+// Builds the texel coverage of all polys, shared blocks included, then the
+// tile mask from it.
+static void build_g_buffer_coverage(struct atlas_s *atlas,
+                                    const struct mesh_s *mesh) {
+  gsize num_texels = (gsize)atlas->width * atlas->height * atlas->num_pages;
+  guint num_rows = atlas->height * atlas->num_pages;
+  atlas->coverage = g_new0(guint8, num_texels);
+  for (guint i = 0; i < mesh->polys->len; i++) {
+    cover_poly(atlas, mesh, i);
+  }
+
+  atlas->tiles_x = (atlas->width + G_BUFFER_TILE - 1) / G_BUFFER_TILE;
+  atlas->tiles_y = (num_rows + G_BUFFER_TILE - 1) / G_BUFFER_TILE;
+  atlas->tile_mask = g_new0(guint8, (gsize)atlas->tiles_x * atlas->tiles_y);
+  gsize num_covered = 0, num_tiles = 0;
+  for (guint y = 0; y < num_rows; y++) {
+    for (guint x = 0; x < atlas->width; x++) {
+      if (atlas->coverage[(gsize)y * atlas->width + x]) {
+        num_covered++;
+        atlas->tile_mask[(y / G_BUFFER_TILE) * atlas->tiles_x +
+                         x / G_BUFFER_TILE] = 1;
+      }
+    }
+  }
+  for (gsize t = 0; t < (gsize)atlas->tiles_x * atlas->tiles_y; t++) {
+    num_tiles += atlas->tile_mask[t];
+  }
+  g_print("g-buffer coverage: %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT
+          " texels (%.1f%%), %" G_GSIZE_FORMAT " of %u tiles shaded\n",
+          num_covered, num_texels, 100.0 * num_covered / num_texels, num_tiles,
+          atlas->tiles_x * atlas->tiles_y);
+}
+
+// Rasterizes one poly region (data: its index + 1). Regions are disjoint in
+// the atlas, and a block shared by several lightmaps is only written by its
+// owner, so regions can be filled in parallel. Positions step along each row
+// instead of going through poly_region_coord_to_3d per texel. Texels no
+// poly covers are left empty.
+static void g_buffer_region_task(gpointer data, gpointer user_data) {
+  const struct g_buffer_job_s *job = user_data;
+  struct atlas_s *atlas = job->atlas;
+  guint i = GPOINTER_TO_UINT(data) - 1;
+  const struct poly_s *poly =
+      &g_array_index(job->mesh->polys, struct poly_s, i);
+  const struct poly_region_s *region = &atlas->poly_regions[i];
+  gsize page_size = (gsize)atlas->width * atlas->height;
+  // one luxel along S, and the first luxel's center of each row
+  struct vec3_s step = vec3_mul(region->s_axis, region->scale.x);
+  struct vec3_s row_start =
+      vec3_add(region->o, vec3_mul(region->s_axis, region->bias.x));
+  for (gint y = 0; y < region->h; y++) {
+    gfloat T = region->scale.y * (gfloat)y + region->bias.y;
+    struct vec3_s p = vec3_add(row_start, vec3_mul(region->t_axis, T));
+    for (gint x = 0; x < region->w; x++) {
+      gint dst_x = region->x + (region->rotated ? y : x);
+      gint dst_y = region->y + (region->rotated ? x : y);
+      gsize dst_idx = region->page * page_size + dst_y * atlas->width + dst_x;
+      if (atlas->coverage[dst_idx]) {
+        atlas->diffuse_data[dst_idx] = job->poly_colors[i];
+        for (guint k = 0; k < 3; k++) {
+          atlas->normal_planes[k][dst_idx] = poly->plane_normal.xyz[k];
+          atlas->position_planes[k][dst_idx] = p.xyz[k];
+        }
+      }
+      p = vec3_add(p, step);
+    }
+  }
+}
+
+// Point light at the origin: the diffuse color is scaled by
+// sqrt(min(255 / distance, 1)), alpha is kept.
+static inline void shade_texel(struct atlas_s *atlas, gsize i) {
+  gfloat x = atlas->position_planes[0][i];
+  gfloat y = atlas->position_planes[1][i];
+  gfloat z = atlas->position_planes[2][i];
+  gfloat len = sqrtf(x * x + y * y + z * z);
+  gfloat intensity = sqrtf(CLAMP(255.0f / len, 0.0f, 1.0f));
+  struct rgba_s *c = &atlas->diffuse_data[i];
+  c->r = (guint8)CLAMP_COLOR_COMPONENT(c->r * intensity);
+  c->g = (guint8)CLAMP_COLOR_COMPONENT(c->g * intensity);
+  c->b = (guint8)CLAMP_COLOR_COMPONENT(c->b * intensity);
+}
+
+#ifdef __SSE2__
+// Scales the b, g, r bytes of four texels by one intensity each. Products
+// are truncated like the scalar casts, so the results are identical.
+static inline __m128i scale_texels_sse2(__m128i texels, __m128 intensity) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 alpha_mask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+  const __m128 one = _mm_set1_ps(1.0f);
+  __m128i lo = _mm_unpacklo_epi8(texels, zero); // texels 0, 1 as 16 bits
+  __m128i hi = _mm_unpackhi_epi8(texels, zero); // texels 2, 3
+  __m128i c[4] = {_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                  _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+  __m128 s[4] = {_mm_shuffle_ps(intensity, intensity, 0x00),
+                 _mm_shuffle_ps(intensity, intensity, 0x55),
+                 _mm_shuffle_ps(intensity, intensity, 0xaa),
+                 _mm_shuffle_ps(intensity, intensity, 0xff)};
+  for (guint k = 0; k < 4; k++) {
+    __m128 scale = _mm_or_ps(_mm_andnot_ps(alpha_mask, s[k]),
+                             _mm_and_ps(alpha_mask, one));
+    c[k] = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(c[k]), scale));
+  }
+  return _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]),
+                          _mm_packs_epi32(c[2], c[3]));
+}
+#endif
+
+// Shades the texels [first, last) of the g-buffer, 8 (AVX2) or 4 (SSE2)
+// texels per iteration from the position planes. Division and square roots
+// are exact in both paths, so the output matches the scalar loop.
+void shade_g_buffer(struct atlas_s *atlas, gsize first, gsize last) {
+  gsize i = first;
+#if defined(__AVX2__)
+  for (; i < last && i % 8 != 0; i++) {
+    shade_texel(atlas, i);
+  }
+  const __m256 light_range = _mm256_set1_ps(255.0f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  for (; i + 8 <= last; i += 8) {
+    __m256 x = _mm256_load_ps(atlas->position_planes[0] + i);
+    __m256 y = _mm256_load_ps(atlas->position_planes[1] + i);
+    __m256 z = _mm256_load_ps(atlas->position_planes[2] + i);
+    __m256 len_sq = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+        _mm256_mul_ps(z, z));
+    __m256 ratio = _mm256_div_ps(light_range, _mm256_sqrt_ps(len_sq));
+    __m256 intensity = _mm256_sqrt_ps(_mm256_min_ps(ratio, one));
+    __m128i *texels = (__m128i *)(atlas->diffuse_data + i);
+    _mm_storeu_si128(texels, scale_texels_sse2(_mm_loadu_si128(texels),
+                                               _mm256_castps256_ps128(
+                                                   intensity)));
+    _mm_storeu_si128(texels + 1,
+                     scale_texels_sse2(_mm_loadu_si128(texels + 1),
+                                       _mm256_extractf128_ps(intensity, 1)));
+  }
+#elif defined(__SSE2__)
+  for (; i < last && i % 4 != 0; i++) {
+    shade_texel(atlas, i);
+  }
+  const __m128 light_range = _mm_set1_ps(255.0f);
+  const __m128 one = _mm_set1_ps(1.0f);
+  for (; i + 4 <= last; i += 4) {
+    __m128 x = _mm_load_ps(atlas->position_planes[0] + i);
+    __m128 y = _mm_load_ps(atlas->position_planes[1] + i);
+    __m128 z = _mm_load_ps(atlas->position_planes[2] + i);
+    __m128 len_sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                               _mm_mul_ps(z, z));
+    __m128 ratio = _mm_div_ps(light_range, _mm_sqrt_ps(len_sq));
+    __m128 intensity = _mm_sqrt_ps(_mm_min_ps(ratio, one));
+    __m128i *texels = (__m128i *)(atlas->diffuse_data + i);
+    _mm_storeu_si128(texels,
+                     scale_texels_sse2(_mm_loadu_si128(texels), intensity));
+  }
+#endif
+  for (; i < last; i++) {
+    shade_texel(atlas, i);
+  }
+}
+
+// Sum of the lights over one texel, as light.exe computes a luxel: linear
+// falloff scaled by wait, half of it fading with the angle of incidence, no
+// light from behind the face. Dark lights (negative light) subtract with the
+// same falloff. Clamped to [0, 255] like a lightmap luxel.
+static inline gfloat light_texel(const struct atlas_s *atlas,
+                                 const struct light_s *lights,
+                                 const guint *light_ids, guint num_ids,
+                                 gsize i) {
+  gfloat px = atlas->position_planes[0][i];
+  gfloat py = atlas->position_planes[1][i];
+  gfloat pz = atlas->position_planes[2][i];
+  gfloat nx = atlas->normal_planes[0][i];
+  gfloat ny = atlas->normal_planes[1][i];
+  gfloat nz = atlas->normal_planes[2][i];
+  gfloat total = 0.0f;
+  for (guint l = 0; l < num_ids; l++) {
+    const struct light_s *light = &lights[light_ids[l]];
+    gfloat dx = light->origin.x - px;
+    gfloat dy = light->origin.y - py;
+    gfloat dz = light->origin.z - pz;
+    gfloat ndot = dx * nx + dy * ny + dz * nz;
+    gfloat dist = sqrtf(dx * dx + dy * dy + dz * dz);
+    gfloat add = (fabsf(light->light) - dist * light->wait) *
+                 (0.5f + 0.5f * (ndot / dist));
+    if (ndot >= 0.0f && add > 0.0f) {
+      total += light->light < 0.0f ? -add : add;
+    }
+  }
+  return CLAMP(total, 0.0f, 255.0f);
+}
+
+// Lights the texels [first, last) with the lights light_ids index: the
+// diffuse color is scaled by the luxel value / 255. SSE2 handles 4 texels
+// per iteration, in the same operation order as the scalar loop.
+void light_g_buffer(struct atlas_s *atlas, const struct light_s *lights,
+                    const guint *light_ids, guint num_ids, gsize first,
+                    gsize last) {
+  gsize i = first;
+#ifdef __SSE2__
+  for (; i < last && i % 4 != 0; i++) {
+    struct rgba_s *c = &atlas->diffuse_data[i];
+    gfloat value = light_texel(atlas, lights, light_ids, num_ids, i) / 255.0f;
+    c->r = (guint8)CLAMP_COLOR_COMPONENT(c->r * value);
+    c->g = (guint8)CLAMP_COLOR_COMPONENT(c->g * value);
+    c->b = (guint8)CLAMP_COLOR_COMPONENT(c->b * value);
+  }
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 max_value = _mm_set1_ps(255.0f);
+  for (; i + 4 <= last; i += 4) {
+    __m128 px = _mm_load_ps(atlas->position_planes[0] + i);
+    __m128 py = _mm_load_ps(atlas->position_planes[1] + i);
+    __m128 pz = _mm_load_ps(atlas->position_planes[2] + i);
+    __m128 nx = _mm_load_ps(atlas->normal_planes[0] + i);
+    __m128 ny = _mm_load_ps(atlas->normal_planes[1] + i);
+    __m128 nz = _mm_load_ps(atlas->normal_planes[2] + i);
+    __m128 total = zero;
+    for (guint l = 0; l < num_ids; l++) {
+      const struct light_s *light = &lights[light_ids[l]];
+      __m128 dx = _mm_sub_ps(_mm_set1_ps(light->origin.x), px);
+      __m128 dy = _mm_sub_ps(_mm_set1_ps(light->origin.y), py);
+      __m128 dz = _mm_sub_ps(_mm_set1_ps(light->origin.z), pz);
+      __m128 ndot = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)),
+          _mm_mul_ps(dz, nz));
+      __m128 dist = _mm_sqrt_ps(_mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+          _mm_mul_ps(dz, dz)));
+      __m128 falloff = _mm_sub_ps(
+          _mm_set1_ps(fabsf(light->light)),
+          _mm_mul_ps(dist, _mm_set1_ps(light->wait)));
+      __m128 angle =
+          _mm_add_ps(half, _mm_mul_ps(half, _mm_div_ps(ndot, dist)));
+      __m128 add = _mm_mul_ps(falloff, angle);
+      __m128 lit =
+          _mm_and_ps(_mm_cmpge_ps(ndot, zero), _mm_cmpgt_ps(add, zero));
+      __m128 sign = _mm_set1_ps(light->light < 0.0f ? -1.0f : 1.0f);
+      total = _mm_add_ps(total, _mm_and_ps(lit, _mm_mul_ps(add, sign)));
+    }
+    __m128 value = _mm_div_ps(
+        _mm_max_ps(_mm_min_ps(total, max_value), zero), max_value);
+    __m128i *texels = (__m128i *)(atlas->diffuse_data + i);
+    _mm_storeu_si128(texels, scale_texels_sse2(_mm_loadu_si128(texels), value));
+  }
+#endif
+  for (; i < last; i++) {
+    struct rgba_s *c = &atlas->diffuse_data[i];
+    gfloat value = light_texel(atlas, lights, light_ids, num_ids, i) / 255.0f;
+    c->r = (guint8)CLAMP_COLOR_COMPONENT(c->r * value);
+    c->g = (guint8)CLAMP_COLOR_COMPONENT(c->g * value);
+    c->b = (guint8)CLAMP_COLOR_COMPONENT(c->b * value);
+  }
+}
+
+// Uniform point in the unit sphere, by rejection
+static struct vec3_s random_in_sphere(GRand *rand) {
+  struct vec3_s v;
+  do {
+    for (guint k = 0; k < 3; k++) {
+      v.xyz[k] = (gfloat)g_rand_double_range(rand, -1.0, 1.0);
+    }
+  } while (v.x * v.x + v.y * v.y + v.z * v.z > 1.0f);
+  return v;
+}
+
+static gboolean in_solid(const struct bsp_tree_s *tree, struct vec3_s p) {
+  return tree->leaves[bsp_point_in_leaf(tree, p)].contents == CONTENTS_SOLID;
+}
+
+// Shadow ray start for texel i at p with normal n: BAKE_NUDGE off the
+// surface. Texels covered only for filtering past a face edge can start in
+// solid; like light.exe, which pulls such sample points toward the face,
+// they start from the closest neighbour texel on the same plane that is in
+// the open. FALSE if there is none.
+static gboolean bake_start(const struct g_buffer_job_s *job, gsize i,
+                           struct vec3_s p, struct vec3_s n,
+                           struct vec3_s *start) {
+  const struct atlas_s *atlas = job->atlas;
+  *start = vec3_add(p, vec3_mul(n, BAKE_NUDGE));
+  if (!in_solid(job->bake->tree, *start)) {
+    return TRUE;
+  }
+  gsize num_texels = (gsize)atlas->width * atlas->height * atlas->num_pages;
+  gint x = (gint)(i % atlas->width);
+  gfloat best = BAKE_NEIGHBOUR_DIST * BAKE_NEIGHBOUR_DIST;
+  gboolean found = FALSE;
+  for (gint dy = -1; dy <= 1; dy++) {
+    for (gint dx = -1; dx <= 1; dx++) {
+      gssize j = (gssize)i + (gssize)dy * atlas->width + dx;
+      if ((dx == 0 && dy == 0) || x + dx < 0 || x + dx >= (gint)atlas->width ||
+          j < 0 || (gsize)j >= num_texels || !atlas->coverage[j]) {
+        continue;
+      }
+      struct vec3_s q, m;
+      for (guint k = 0; k < 3; k++) {
+        q.xyz[k] = atlas->position_planes[k][j];
+        m.xyz[k] = atlas->normal_planes[k][j];
+      }
+      struct vec3_s d = vec3_sub(q, p);
+      gfloat dist_sq = vec3_dot(d, d);
+      if (vec3_dot(m, n) < 0.99f || fabsf(vec3_dot(d, n)) > 0.1f ||
+          dist_sq >= best) {
+        continue;
+      }
+      struct vec3_s s = vec3_add(q, vec3_mul(n, BAKE_NUDGE));
+      if (!in_solid(job->bake->tree, s)) {
+        *start = s;
+        best = dist_sq;
+        found = TRUE;
+      }
+    }
+  }
+  return found;
+}
+
+// light_texel with shadows, before the clamp: each light counts with the
+// share of its shadow rays that reach it through the world. Texels with no
+// ray start in the open get no light.
+static gfloat bake_texel(struct g_buffer_job_s *job, const guint *light_ids,
+                         guint num_ids, gsize i, GRand *rand,
+                         guint *num_rays) {
+  const struct atlas_s *atlas = job->atlas;
+  const struct bake_opts_s *bake = job->bake;
+  struct vec3_s p, n, start;
+  for (guint k = 0; k < 3; k++) {
+    p.xyz[k] = atlas->position_planes[k][i];
+    n.xyz[k] = atlas->normal_planes[k][i];
+  }
+  if (!bake_start(job, i, p, n, &start)) {
+    return 0.0f;
+  }
+  guint samples = bake->light_radius > 0.0f ? MAX(bake->samples, 1) : 1;
+  gfloat total = 0.0f;
+  for (guint l = 0; l < num_ids; l++) {
+    const struct light_s *light = &job->lights[light_ids[l]];
+    gfloat dx = light->origin.x - p.x;
+    gfloat dy = light->origin.y - p.y;
+    gfloat dz = light->origin.z - p.z;
+    gfloat ndot = dx * n.x + dy * n.y + dz * n.z;
+    gfloat dist = sqrtf(dx * dx + dy * dy + dz * dz);
+    gfloat add = (fabsf(light->light) - dist * light->wait) *
+                 (0.5f + 0.5f * (ndot / dist));
+    if (ndot < 0.0f || add <= 0.0f) {
+      continue;
+    }
+    if (light->light < 0.0f) {
+      add = -add;
+    }
+    guint clear = 0;
+    for (guint s = 0; s < samples; s++) {
+      struct vec3_s target = light->origin;
+      if (bake->light_radius > 0.0f) {
+        target = vec3_add(target, vec3_mul(random_in_sphere(rand),
+                                           bake->light_radius));
+      }
+      clear += bake->bvh != NULL
+                   ? !bvh_occluded(bake->bvh, start, vec3_sub(target, start),
+                                   1.0f)
+                   : bsp_segment_clear(bake->tree, start, target);
+    }
+    *num_rays += samples;
+    total += add * ((gfloat)clear / samples);
+  }
+  return total;
+}
+
+// Bakes the covered texels of a tile into baked_data and lights their
+// diffuse color with it. The generator is reseeded from the tile's first
+// texel, so the result does not depend on which thread bakes the tile.
+static void bake_tile(struct g_buffer_job_s *job, gsize first, guint rows,
+                      guint cols, const guint *light_ids, guint num_ids,
+                      GRand *rand) {
+  struct atlas_s *atlas = job->atlas;
+  guint num_rays = 0;
+  g_rand_set_seed(rand, job->bake->seed ^ (guint32)(first * 2654435761u));
+  for (guint y = 0; y < rows; y++) {
+    for (guint x = 0; x < cols; x++) {
+      gsize i = first + (gsize)y * atlas->width + x;
+      if (!atlas->coverage[i]) {
+        continue;
+      }
+      gfloat total = bake_texel(job, light_ids, num_ids, i, rand, &num_rays);
+      gfloat value = CLAMP(total, 0.0f, 255.0f) / 255.0f;
+      struct rgba_s *c = &atlas->diffuse_data[i];
+      atlas->baked_data[i] =
+          (guint8)CLAMP(total * BAKE_RANGE_SCALE, 0.0f, 255.0f);
+      c->r = (guint8)CLAMP_COLOR_COMPONENT(c->r * value);
+      c->g = (guint8)CLAMP_COLOR_COMPONENT(c->g * value);
+      c->b = (guint8)CLAMP_COLOR_COMPONENT(c->b * value);
+    }
+  }
+  g_atomic_pointer_add(&job->num_rays, num_rays);
+}
+
+// Lights one covered tile whose top-left texel is first. Only lights whose
+// reach (|light| / wait) gets to the box around the tile's covered texels are
+// evaluated, which keeps hundreds of lights cheap.
+static void light_tile(struct g_buffer_job_s *job, gsize first, guint rows,
+                       guint cols, guint *light_ids, GRand *rand) {
+  struct atlas_s *atlas = job->atlas;
+  struct vec3_s min = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);
+  struct vec3_s max = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);
+  for (guint y = 0; y < rows; y++) {
+    for (guint x = 0; x < cols; x++) {
+      gsize i = first + (gsize)y * atlas->width + x;
+      if (!atlas->coverage[i]) {
+        continue;
+      }
+      for (guint k = 0; k < 3; k++) {
+        min.xyz[k] = MIN(min.xyz[k], atlas->position_planes[k][i]);
+        max.xyz[k] = MAX(max.xyz[k], atlas->position_planes[k][i]);
+      }
+    }
+  }
+  guint num_ids = 0;
+  for (guint l = 0; l < job->num_lights; l++) {
+    const struct light_s *light = &job->lights[l];
+    gfloat reach = fabsf(light->light) / light->wait;
+    gfloat dist_sq = 0.0f;
+    for (guint k = 0; k < 3; k++) {
+      gfloat d = MAX(MAX(min.xyz[k] - light->origin.xyz[k],
+                         light->origin.xyz[k] - max.xyz[k]),
+                     0.0f);
+      dist_sq += d * d;
+    }
+    if (reach > 0.0f && dist_sq < reach * reach) {
+      light_ids[num_ids++] = l;
+    }
+  }
+  g_atomic_int_inc(&job->num_tiles);
+  g_atomic_int_add(&job->num_tile_lights, (gint)num_ids);
+  if (job->bake != NULL) {
+    bake_tile(job, first, rows, cols, light_ids, num_ids, rand);
+    return;
+  }
+  for (guint y = 0; y < rows; y++) {
+    gsize row = first + (gsize)y * atlas->width;
+    light_g_buffer(atlas, job->lights, light_ids, num_ids, row, row + cols);
+  }
+}
+
+// Shades the covered tiles in a band of G_BUFFER_BAND_ROWS rows (data: band
+// index + 1), rows of all pages counted one after another. With lights each
+// tile is lit with its own light list, otherwise runs of covered tiles in a
+// row are shaded as one span. A bake gives each task its own generator.
+static void g_buffer_shade_task(gpointer data, gpointer user_data) {
+  struct g_buffer_job_s *job = user_data;
+  struct atlas_s *atlas = job->atlas;
+  guint num_rows = atlas->height * atlas->num_pages;
+  guint first_row = (GPOINTER_TO_UINT(data) - 1) * G_BUFFER_BAND_ROWS;
+  guint last_row = MIN(first_row + G_BUFFER_BAND_ROWS, num_rows);
+  if (job->num_lights > 0) {
+    guint *light_ids = g_new(guint, job->num_lights);
+    GRand *rand =
+        job->bake != NULL ? g_rand_new_with_seed(job->bake->seed) : NULL;
+    for (guint y = first_row; y < last_row; y += G_BUFFER_TILE) {
+      const guint8 *tiles =
+          atlas->tile_mask + (y / G_BUFFER_TILE) * atlas->tiles_x;
+      for (guint tx = 0; tx < atlas->tiles_x; tx++) {
+        guint x = tx * G_BUFFER_TILE;
+        if (tiles[tx]) {
+          light_tile(job, (gsize)y * atlas->width + x,
+                     MIN(G_BUFFER_TILE, last_row - y),
+                     MIN(G_BUFFER_TILE, atlas->width - x), light_ids, rand);
+        }
+      }
+    }
+    if (rand != NULL) {
+      g_rand_free(rand);
+    }
+    g_free(light_ids);
+    return;
+  }
+  for (guint y = first_row; y < last_row; y++) {
+    const guint8 *tiles =
+        atlas->tile_mask + (y / G_BUFFER_TILE) * atlas->tiles_x;
+    gsize row = (gsize)y * atlas->width;
+    for (guint tx = 0; tx < atlas->tiles_x;) {
+      if (!tiles[tx]) {
+        tx++;
+        continue;
+      }
+      guint run = tx;
+      while (run < atlas->tiles_x && tiles[run]) {
+        run++;
+      }
+      shade_g_buffer(atlas, row + tx * G_BUFFER_TILE,
+                     row + MIN(run * G_BUFFER_TILE, atlas->width));
+      tx = run;
+    }
+  }
+}
+
+// Lights the g-buffer with the static lights (style 0) of the map; without
+// any, with a single point light at the origin. With bake, the lights cast
+// shadows and the traced luxels are exported as baked.png, a grey atlas in
+// the layout of lightmap.png (later pages baked_<page>.png).
+void create_mesh_g_buffer(struct mesh_s *mesh, const struct light_s *lights,
+                          guint num_lights, const struct bake_opts_s *bake) {
   struct atlas_s *atlas = mesh->texture_atlas;
-  atlas->diffuse_data = g_new(struct rgba_s, atlas->width * atlas->height);
-  atlas->normal_data = g_new(struct vec3_s, atlas->width * atlas->height);
-  atlas->position_data = g_new(struct vec3_s, atlas->width * atlas->height);
+  gsize page_size = (gsize)atlas->width * atlas->height;
+  gsize num_texels = page_size * atlas->num_pages;
+  atlas->diffuse_data = g_new(struct rgba_s, num_texels);
+  for (guint k = 0; k < 3; k++) {
+    atlas->normal_planes[k] = g_aligned_alloc(num_texels, sizeof(gfloat), 32);
+    atlas->position_planes[k] =
+        g_aligned_alloc0(num_texels, sizeof(gfloat), 32);
+  }
 
   g_print("creating g-buffer atlas %ux%u...\n", atlas->width, atlas->height);
-  for (guint i = 0; i < atlas->width * atlas->height; i++) {
+  for (guint i = 0; i < num_texels; i++) {
     atlas->diffuse_data[i] = (struct rgba_s){{{0, 0, 0, 255}}};
-    atlas->normal_data[i] = vec3_set(0.0f, 0.0f, 1.0f);
-    atlas->position_data[i] = vec3_set(0.0f, 0.0f, 0.0f);
+    atlas->normal_planes[0][i] = 0.0f;
+    atlas->normal_planes[1][i] = 0.0f;
+    atlas->normal_planes[2][i] = 1.0f;
   }
 
   struct rgba_s *poly_colors = g_new(struct rgba_s, mesh->polys->len);
@@ -516,53 +2152,82 @@ void create_mesh_g_buffer(struct mesh_s *mesh) {
     }
   }
 
+  build_g_buffer_coverage(atlas, mesh);
+
+  struct g_buffer_job_s job = {
+      .atlas = atlas, .mesh = mesh, .poly_colors = poly_colors};
+  struct light_s *static_lights = g_new(struct light_s, MAX(num_lights, 1));
+  for (guint i = 0; i < num_lights; i++) {
+    if (lights[i].style == 0) {
+      static_lights[job.num_lights++] = lights[i];
+    }
+  }
+  job.lights = static_lights;
+  // styled (flickering, switchable) lights would each need a lightmap of
+  // their own, which neither the g-buffer nor the glTF has a place for
+  if (bake != NULL && job.num_lights < num_lights) {
+    g_print("%u styled lights are not baked\n", num_lights - job.num_lights);
+  }
+  if (bake != NULL && job.num_lights > 0) {
+    job.bake = bake;
+    atlas->baked_data = g_new0(guint8, num_texels);
+  } else if (bake != NULL) {
+    g_print("no static lights to bake\n");
+  }
+  GThreadPool *pool = g_thread_pool_new(g_buffer_region_task, &job,
+                                        g_get_num_processors(), TRUE, NULL);
   for (guint i = 0; i < mesh->polys->len; i++) {
-    struct poly_s *poly = &g_array_index(mesh->polys, struct poly_s, i);
-    struct poly_region_s *region = &atlas->poly_regions[i];
-    for (gint y = 0; y < region->h; y++) {
-      for (gint x = 0; x < region->w; x++) {
-        gint dst_x = region->x + x;
-        gint dst_y = region->y + y;
-        // if (dst_x >= (gint)atlas->width || dst_y >= (gint)atlas->height) {
-        //   g_print("skipping oob pixel at (%d, %d) for poly %u\n", dst_x,
-        //   dst_y,
-        //           i);
-        //   continue;
-        // }
-        guint dst_idx = dst_y * atlas->width + dst_x;
-        atlas->diffuse_data[dst_idx] = poly_colors[i];
-        atlas->normal_data[dst_idx] = poly->plane_normal;
-        atlas->position_data[dst_idx] =
-            poly_region_coord_to_3d(region, (struct ivec2_s){x, y});
-      }
-    }
-  }
-
-  struct vec3_s lightpos = vec3_set(0.0f, 0.0f, 0.0f);
-  for (guint i = 0; i < atlas->width * atlas->height; i++) {
-    struct vec3_s pos = atlas->position_data[i];
-    struct vec3_s normal = vec3_norm(atlas->normal_data[i]);
-    // gfloat diff = MAX(vec3_dot(normal, lightdir), 0.0f);
-    struct vec3_s lightdir = vec3_sub(lightpos, pos);
-    float len_sq = vec3_dot(lightdir, lightdir);
-    float len = sqrtf(len_sq);
-    lightdir = vec3_mul(lightdir, 1.0f / len);
-    gfloat ambient = 0.1f;
-    gfloat diff = MAX(vec3_dot(normal, lightdir), 0.0f);
-    gfloat intensity = 255.0f / len; // diff / (0.1f * len_sq); // +
-    // ambient;
-    intensity = sqrtf(CLAMP(intensity, 0.0f, 1.0f));
-    atlas->diffuse_data[i].r =
-        (guint8)CLAMP_COLOR_COMPONENT(atlas->diffuse_data[i].r * intensity);
-    atlas->diffuse_data[i].g =
-        (guint8)CLAMP_COLOR_COMPONENT(atlas->diffuse_data[i].g * intensity);
-    atlas->diffuse_data[i].b =
-        (guint8)CLAMP_COLOR_COMPONENT(atlas->diffuse_data[i].b * intensity);
-  }
-  unsigned error = lodepng_encode32_file("diffuse.png", atlas->diffuse_data,
-                                         atlas->width, atlas->height);
-  if (error) {
-    g_error("error %u: %s\n", error, lodepng_error_text(error));
+    if (!atlas->poly_regions[i].shared) {
+      g_thread_pool_push(pool, GUINT_TO_POINTER(i + 1), NULL);
+    }
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  guint num_rows = atlas->height * atlas->num_pages;
+  GTimer *timer = g_timer_new();
+  pool = g_thread_pool_new(g_buffer_shade_task, &job, g_get_num_processors(),
+                           TRUE, NULL);
+  for (guint band = 0; band * G_BUFFER_BAND_ROWS < num_rows; band++) {
+    g_thread_pool_push(pool, GUINT_TO_POINTER(band + 1), NULL);
+  }
+  g_thread_pool_free(pool, FALSE, TRUE);
+  gdouble secs = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  if (job.bake != NULL) {
+    g_print("baked in %.2f s on %u threads: %" G_GSIZE_FORMAT
+            " shadow rays (%.1f M/s)\n",
+            secs, g_get_num_processors(), job.num_rays,
+            secs > 0.0 ? job.num_rays / secs * 1e-6 : 0.0);
+  }
+  if (job.num_lights > 0) {
+    g_print("g-buffer lit by %u of %u lights, %.1f per tile on average\n",
+            job.num_lights, num_lights,
+            (gfloat)job.num_tile_lights / MAX(job.num_tiles, 1));
+  }
+  g_free(static_lights);
+
+  // page 0 is diffuse.png, later pages diffuse_<page>.png
+  for (guint p = 0; p < atlas->num_pages; p++) {
+    gchar *img_file = p == 0 ? g_strdup("diffuse.png")
+                             : g_strdup_printf("diffuse_%u.png", p);
+    unsigned error =
+        lodepng_encode32_file(img_file, atlas->diffuse_data + p * page_size,
+                              atlas->width, atlas->height);
+    if (error) {
+      g_error("error %u: %s\n", error, lodepng_error_text(error));
+    }
+    g_free(img_file);
+    if (atlas->baked_data == NULL) {
+      continue;
+    }
+    img_file = p == 0 ? g_strdup("baked.png")
+                      : g_strdup_printf("baked_%u.png", p);
+    error = lodepng_encode_file(img_file, atlas->baked_data + p * page_size,
+                                atlas->width, atlas->height, LCT_GREY, 8);
+    if (error) {
+      g_error("error %u: %s\n", error, lodepng_error_text(error));
+    }
+    g_free(img_file);
   }
 
   g_free(poly_colors);
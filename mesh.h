@@ -1,6 +1,9 @@
 #ifndef _MESH_
 #define _MESH_
 
+#include "bsptree.h"
+#include "bvh.h"
+#include "entities.h"
 #include "img.h"
 #include "vec.h"
 #include <glib.h>
@@ -59,6 +62,10 @@ LIST(struct tri_s, tri);
 
 struct poly_s {
   gint face_id;
+  gint texinfo_id; // BSP texinfo the face was mapped with (-1 if unknown)
+  guint chunk_id;  // index into mesh->chunks (0 when not chunked)
+  guint model_id;  // BSP model the face belongs to, 0 for the world
+  guint lightmap_page; // lightmap atlas page the lightmap UVs refer to
   struct vec3_s plane_normal;
   gfloat plane_dist;
   guint num_vertices;
@@ -67,28 +74,61 @@ struct poly_s {
   struct tri_s *tris;
 };
 
+struct mesh_chunk_s {
+  guint model_id; // BSP model; only the world (0) is split into cells
+  gint cell[3];   // grid cell, in units of the chunk size
+  struct vec3_s min, max;
+  guint num_polys;
+  guint num_tris;
+};
+
 struct poly_region_s {
-  gint x, y, w, h;
+  guint page;
+  gint x, y, w, h; // w x h luxels, placed transposed in the atlas if rotated
+  gboolean rotated;
+  gboolean shared; // its block is the one of another region, written there
   struct vec3_s o, s_axis, t_axis;
+  // lightmap S/T of the center of block texel (x, y): bias + (x, y) * scale
   struct vec2_s scale, bias;
 };
 
 struct atlas_s {
-  guint width;
-  guint height;
+  guint width;  // per page
+  guint height; // per page
+  guint num_pages; // pages are stacked in the g-buffer data arrays
   struct rgba_s *diffuse_data;
-  struct vec3_s *normal_data;
-  struct vec3_s *position_data;
+  // one plane per component (x, y, z), one float per texel, 32-byte aligned
+  gfloat *normal_planes[3];
+  gfloat *position_planes[3];
+  // texels bilinear sampling of some poly can reach (its winding grown by a
+  // texel), and tiles of G_BUFFER_TILE x G_BUFFER_TILE texels holding any;
+  // tile rows run over the rows of all pages
+  guint8 *coverage;
+  guint8 *tile_mask;
+  guint tiles_x, tiles_y;
+  guint8 *baked_data; // luxel values traced by the baker, NULL unless baked
   guint num_polys;
   struct poly_region_s *poly_regions;
 };
 
+#define G_BUFFER_TILE 8
+
 struct vec3_s poly_region_coord_to_3d(const struct poly_region_s *region,
                                       struct ivec2_s co);
 
 struct ivec2_s poly_region_coord_from_3d(const struct poly_region_s *region,
                                          struct vec3_s p);
 
+enum tri_mode_e {
+  TRI_MODE_FAN,           // fan from the first winding vertex
+  TRI_MODE_STRIP,         // zig-zag strip order
+  TRI_MODE_MIN_WEIGHT,    // minimum total edge length (convex windings)
+  TRI_MODE_MAX_MIN_ANGLE, // maximize the smallest angle (convex windings)
+};
+
+extern gboolean tri_mode_from_string(const gchar *name, enum tri_mode_e *mode);
+extern const gchar *tri_mode_to_string(enum tri_mode_e mode);
+
 extern void poly_add_vertex(struct poly_s *poly, guint vertex_index);
 extern void triangulate_poly(struct poly_s *poly);
 
@@ -102,10 +142,32 @@ struct texinfo_s {
 struct mat_s {
   gchar name[64];
   LISTOF(index) * polys;
+  LISTOF(index) * render_polys; // indices into mesh->render_polys
   LISTOF(tri) * tris;
   guint width, height;
   struct rgba_s *texture_data;
   struct rgba_s avg_color;
+  guint tex_array; // index into mesh->tex_arrays
+  guint tex_layer; // layer within that texture array
+  gfloat atlas_rect[4]; // x, y, w, h in the diffuse atlas (0..1, top-left)
+};
+
+// Materials sharing a texture resolution, drawn as one texture array.
+struct tex_array_s {
+  guint width, height; // 0 x 0 for materials without a texture
+  guint num_layers;
+  guint *mats; // indices into mesh->mats, in layer order
+};
+
+// All material textures in one image. Each texture is surrounded by a gutter
+// of its own wrapped texels, wide enough that the first mip_levels mips never
+// blend neighbouring textures, so tiling works as
+// atlas_rect.xy + fract(uv0) * atlas_rect.zw.
+struct diffuse_atlas_s {
+  guint width, height;
+  guint mip_levels;
+  guint gutter; // texels on each side of a texture, at least
+  struct rgba_s *data;
 };
 
 struct mesh_s {
@@ -116,7 +178,13 @@ struct mesh_s {
   GArray *vertices;              // array of struct vertex_s
   GPtrArray *mats;               // array of struct mat_s
   GArray *polys;                 // array of struct poly_s
+  GArray *render_polys; // array of struct poly_s (merged, diffuse UVs only)
+  GArray *chunks;       // array of struct mesh_chunk_s (empty if unchunked)
+  GArray *tex_arrays;   // array of struct tex_array_s, by (width, height)
   struct atlas_s *texture_atlas; // texture atlas for lightmaps
+  struct diffuse_atlas_s *diffuse_atlas; // NULL unless built
+  enum tri_mode_e tri_mode;      // triangulator used by build_mesh
+  gfloat chunk_size; // world grid cell size, 0 if the world is one chunk
 };
 
 extern void init_mesh(struct mesh_s *mesh);
@@ -124,17 +192,46 @@ extern struct poly_s *mesh_add_poly(struct mesh_s *mesh,
                                     const gchar *material_name);
 extern guint mesh_add_get_vertex(struct mesh_s *mesh, struct vec3_s position,
                                  struct vec2_s uv, struct vec2_s uv2);
+extern void triangulate_poly_with_mode(const struct mesh_s *mesh,
+                                       struct poly_s *poly,
+                                       enum tri_mode_e mode);
 extern void build_mesh(struct mesh_s *mesh, const struct texinfo_s *texinfos,
                        guint num_texinfos, guint atlas_width,
                        guint atlas_height, struct vec3_s rotate);
 
+extern void merge_coplanar_polys(struct mesh_s *mesh);
+extern void build_texture_arrays(struct mesh_s *mesh);
+extern void export_texture_arrays(const struct mesh_s *mesh);
+extern void build_diffuse_atlas(struct mesh_s *mesh, guint mip_levels);
+extern void export_diffuse_atlas(const struct mesh_s *mesh);
+extern void build_mesh_chunks(struct mesh_s *mesh, gfloat chunk_size);
+extern void build_mesh_bvh(struct bvh_s *bvh, const struct mesh_s *mesh,
+                           gboolean (*keep)(const struct poly_s *poly,
+                                            gpointer data),
+                           gpointer data);
+
 extern void free_mesh(struct mesh_s **mesh);
 
 extern void export_mesh_with_mats_to_obj(struct mesh_s *mesh, gfloat scale);
 
-extern void create_mesh_g_buffer(struct mesh_s *mesh);
+// Baker settings: the g-buffer is lit with shadow rays traced through the
+// world BSP tree, or against the triangles of a BVH. Lights with a radius
+// are spheres sampled by several rays per texel, for soft shadows.
+struct bake_opts_s {
+  const struct bsp_tree_s *tree;
+  const struct bvh_s *bvh; // NULL to trace through the tree
+  gfloat light_radius; // 0 for point lights
+  guint samples;       // shadow rays per light and texel with a radius
+  guint32 seed;
+};
 
-// TODO: sort by texture sizes for texture array material batching (minimize
-// texture switching)
+extern void create_mesh_g_buffer(struct mesh_s *mesh,
+                                 const struct light_s *lights,
+                                 guint num_lights,
+                                 const struct bake_opts_s *bake);
+extern void shade_g_buffer(struct atlas_s *atlas, gsize first, gsize last);
+extern void light_g_buffer(struct atlas_s *atlas, const struct light_s *lights,
+                           const guint *light_ids, guint num_ids, gsize first,
+                           gsize last);
 
 #endif // _MESH_
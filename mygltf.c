@@ -5,10 +5,139 @@
 
 #include "cgltf_write.h"
 
+// uint16 index buffers: 0xffff is reserved (primitive restart)
+#define MAX_SHORT_INDEX_VERTICES 65535
+
+// One glTF primitive: a material's triangles, optionally remapped into their
+// own contiguous vertex window.
+struct prim_batch_s {
+  guint mat_index;   // glTF material: mesh material, or texture array
+  guint chunk_index; // glTF mesh/node the primitive belongs to
+  guint page;        // lightmap atlas page of its TEXCOORD_1
+  guint first_vertex; // into the windowed vertex array (compact mode)
+  guint num_vertices;
+  guint first_index; // into the index array
+  guint num_indices;
+  gboolean short_indices;
+  struct vec3_s min, max;
+};
+
+// Splits a material's triangles into batches referencing at most
+// max_vertices distinct vertices, copying each batch's vertices into a
+// contiguous window in first-use order. remap must hold G_MAXUINT for every
+// mesh vertex and is restored before returning.
+static void build_windowed_batches(const struct mesh_s *mesh, guint mat_index,
+                                   guint chunk_index, const struct tri_s *tris,
+                                   guint num_tris, guint max_vertices,
+                                   guint *remap, GArray *batches,
+                                   GArray *window_vertices, GArray *indices) {
+  GArray *used = g_array_new(FALSE, FALSE, sizeof(guint));
+  struct prim_batch_s batch = {0};
+
+#define FLUSH_BATCH()                                                          \
+  do {                                                                         \
+    if (batch.num_indices > 0) {                                               \
+      batch.short_indices = batch.num_vertices <= MAX_SHORT_INDEX_VERTICES;    \
+      g_array_append_val(batches, batch);                                      \
+    }                                                                          \
+    for (guint u = 0; u < used->len; u++) {                                    \
+      remap[g_array_index(used, guint, u)] = G_MAXUINT;                        \
+    }                                                                          \
+    g_array_set_size(used, 0);                                                 \
+    batch.mat_index = mat_index;                                               \
+    batch.chunk_index = chunk_index;                                           \
+    batch.first_vertex = window_vertices->len;                                 \
+    batch.num_vertices = 0;                                                    \
+    batch.first_index = indices->len;                                          \
+    batch.num_indices = 0;                                                     \
+    batch.min = vec3_set(G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT);                  \
+    batch.max = vec3_set(-G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT);               \
+  } while (0)
+
+  FLUSH_BATCH();
+  for (guint t = 0; t < num_tris; t++) {
+    const struct tri_s *tri = &tris[t];
+    // written reversed, see export_mesh_to_gltf
+    guint tri_verts[3] = {tri->v2, tri->v1, tri->v0};
+    guint num_new = 0;
+    for (guint k = 0; k < 3; k++) {
+      num_new += remap[tri_verts[k]] == G_MAXUINT ? 1 : 0;
+    }
+    if (batch.num_vertices + num_new > max_vertices) {
+      FLUSH_BATCH();
+    }
+    for (guint k = 0; k < 3; k++) {
+      guint v = tri_verts[k];
+      if (remap[v] == G_MAXUINT) {
+        const struct vertex_s *vertex =
+            &g_array_index(mesh->vertices, struct vertex_s, v);
+        remap[v] = batch.num_vertices++;
+        g_array_append_val(used, v);
+        g_array_append_val(window_vertices, *vertex);
+        batch.min = vec3_min(batch.min, vertex->position);
+        batch.max = vec3_max(batch.max, vertex->position);
+      }
+      g_array_append_val(indices, remap[v]);
+      batch.num_indices++;
+    }
+  }
+  FLUSH_BATCH();
+#undef FLUSH_BATCH
+
+  g_array_free(used, TRUE);
+}
+
+// Merges the batches from first on into as few batches as fit max_vertices.
+// Their vertex windows and index ranges are already contiguous, so merging
+// only rebases the indices.
+static void merge_batches(GArray *batches, guint first, guint max_vertices,
+                          GArray *indices) {
+  if (first >= batches->len) {
+    return;
+  }
+  guint out = first;
+  for (guint i = first + 1; i < batches->len; i++) {
+    struct prim_batch_s b = g_array_index(batches, struct prim_batch_s, i);
+    struct prim_batch_s *dst =
+        &g_array_index(batches, struct prim_batch_s, out);
+    if (dst->num_vertices + b.num_vertices > max_vertices) {
+      g_array_index(batches, struct prim_batch_s, ++out) = b;
+      continue;
+    }
+    for (guint k = 0; k < b.num_indices; k++) {
+      g_array_index(indices, guint, b.first_index + k) += dst->num_vertices;
+    }
+    dst->num_vertices += b.num_vertices;
+    dst->num_indices += b.num_indices;
+    dst->short_indices = dst->num_vertices <= MAX_SHORT_INDEX_VERTICES;
+    dst->min = vec3_min(dst->min, b.min);
+    dst->max = vec3_max(dst->max, b.max);
+  }
+  g_array_set_size(batches, out + 1);
+}
+
+static void gather_chunk_tris(const struct mesh_s *mesh, const struct mat_s *m,
+                              guint chunk_index, guint page,
+                              GArray *chunk_tris) {
+  g_array_set_size(chunk_tris, 0);
+  for (guint j = 0; j < m->polys->len; ++j) {
+    struct poly_s *poly =
+        &g_array_index(mesh->polys, struct poly_s, m->polys->data[j]);
+    if (poly->chunk_id == chunk_index && poly->lightmap_page == page) {
+      g_array_append_vals(chunk_tris, poly->tris, poly->num_tris);
+    }
+  }
+}
+
 void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
+                         const struct gltf_opts_s *opts,
                          const gchar *output_path, GError **err) {
   const GArray *vertices = mesh->vertices;
   const GPtrArray *mats = mesh->mats;
+  struct gltf_opts_s default_opts = {0};
+  if (opts == NULL) {
+    opts = &default_opts;
+  }
   cgltf_options options = {0};
   options.type = cgltf_file_type_gltf; // write .gltf
   size_t allocs_size = 256;
@@ -30,50 +159,162 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
   cgltf_data *data = ALLOC(1, sizeof(cgltf_data));
   data->asset.version = "2.0";
 
-  // -------- 1) Counts --------
-  cgltf_size vertex_count = vertices->len;
+  // -------- 1) Batches (one primitive each) --------
   cgltf_size material_count = mats->len;
+  GArray *batches = g_array_new(FALSE, FALSE, sizeof(struct prim_batch_s));
+  GArray *indices = g_array_new(FALSE, FALSE, sizeof(guint));
+  GArray *window_vertices = NULL;
+  // extra per window vertex attribute: _TEXLAYER (texture arrays) or
+  // _ATLASRECT (diffuse atlas), attr_components floats each
+  GArray *window_attr = NULL;
+  guint attr_components = 0;
+  const gchar *attr_name = NULL;
+
+  cgltf_size chunk_count = MAX(mesh->chunks->len, 1);
+  gboolean use_atlas = opts->diffuse_atlas && mesh->diffuse_atlas != NULL;
+  gboolean use_arrays =
+      !use_atlas && opts->texture_arrays && mesh->tex_arrays->len > 0;
+  if (use_atlas) {
+    material_count = 1;
+    attr_components = 4;
+    attr_name = "_ATLASRECT";
+  } else if (use_arrays) {
+    material_count = mesh->tex_arrays->len;
+    attr_components = 1;
+    attr_name = "_TEXLAYER";
+  }
 
-  cgltf_size index_total_count = 0;
-  for (guint i = 0; i < material_count; ++i) {
-    struct mat_s *m = g_ptr_array_index(mats, i);
-    index_total_count += (cgltf_size)m->tris->len * 3;
+  guint num_pages = MAX(mesh->texture_atlas->num_pages, 1);
+
+  if (opts->compact_indices || mesh->chunks->len > 0 || attr_name ||
+      num_pages > 1) {
+    // each batch gets its own vertex window (and uint16 indices if it fits)
+    window_vertices = g_array_new(FALSE, FALSE, sizeof(struct vertex_s));
+    guint max_vertices =
+        opts->compact_indices ? MAX_SHORT_INDEX_VERTICES : G_MAXUINT;
+    guint *remap = g_new(guint, vertices->len);
+    for (guint i = 0; i < vertices->len; i++) {
+      remap[i] = G_MAXUINT;
+    }
+    GArray *chunk_tris = g_array_new(FALSE, FALSE, sizeof(struct tri_s));
+    if (attr_name) {
+      window_attr = g_array_new(FALSE, FALSE, attr_components * sizeof(gfloat));
+    }
+    // primitives are split per chunk and per lightmap page
+    for (guint cp = 0; cp < chunk_count * num_pages; ++cp) {
+      guint c = cp / num_pages, page = cp % num_pages;
+      guint first_page_batch = batches->len;
+      if (!attr_name) {
+        for (guint i = 0; i < material_count; ++i) {
+          struct mat_s *m = g_ptr_array_index(mats, i);
+          gather_chunk_tris(mesh, m, c, page, chunk_tris);
+          build_windowed_batches(mesh, i, c, (struct tri_s *)chunk_tris->data,
+                                 chunk_tris->len, max_vertices, remap, batches,
+                                 window_vertices, indices);
+        }
+      }
+      // every source material gets its own vertices (so each carries one
+      // attribute value), then its batches are merged into draws per texture
+      // array, or into one draw for the atlas
+      for (guint i = 0; attr_name && i < material_count; ++i) {
+        const struct tex_array_s *array =
+            use_arrays ? &g_array_index(mesh->tex_arrays, struct tex_array_s, i)
+                       : NULL;
+        guint num_members = array ? array->num_layers : mats->len;
+        guint first_batch = batches->len;
+        for (guint j = 0; j < num_members; ++j) {
+          struct mat_s *m = g_ptr_array_index(mats, array ? array->mats[j] : j);
+          gather_chunk_tris(mesh, m, c, page, chunk_tris);
+          build_windowed_batches(mesh, i, c, (struct tri_s *)chunk_tris->data,
+                                 chunk_tris->len, max_vertices, remap, batches,
+                                 window_vertices, indices);
+          gfloat layer = (gfloat)j;
+          const gfloat *value = array ? &layer : m->atlas_rect;
+          while (window_attr->len < window_vertices->len) {
+            g_array_append_vals(window_attr, value, 1);
+          }
+        }
+        merge_batches(batches, first_batch, max_vertices, indices);
+      }
+      for (guint b = first_page_batch; b < batches->len; ++b) {
+        g_array_index(batches, struct prim_batch_s, b).page = page;
+      }
+    }
+    g_array_free(chunk_tris, TRUE);
+    g_free(remap);
+  } else {
+    // one batch per material over the shared vertex buffer
+    for (guint i = 0; i < material_count; ++i) {
+      struct mat_s *m = g_ptr_array_index(mats, i);
+      struct prim_batch_s batch = {0};
+      batch.mat_index = i;
+      batch.num_vertices = vertices->len;
+      batch.first_index = indices->len;
+      batch.num_indices = m->tris->len * 3;
+      for (guint t = 0; t < m->tris->len; ++t) {
+        struct tri_s *tri = &m->tris->data[t];
+        g_array_append_val(indices, tri->v2);
+        g_array_append_val(indices, tri->v1);
+        g_array_append_val(indices, tri->v0);
+      }
+      g_array_append_val(batches, batch);
+    }
   }
+  cgltf_size batch_count = batches->len;
 
   // -------- 2) Buffer layout: [VERTICES][INDICES] --------
+  const GArray *out_vertices = window_vertices ? window_vertices : vertices;
+  cgltf_size vertex_count = out_vertices->len;
   const cgltf_size vertex_stride = sizeof(struct vertex_s);
   const cgltf_size vertex_buffer_size = vertex_count * vertex_stride;
-  const cgltf_size index_buffer_size = index_total_count * sizeof(uint32_t);
-  const cgltf_size total_buffer_size = vertex_buffer_size + index_buffer_size;
+  const cgltf_size attr_stride = attr_components * sizeof(gfloat);
+  const cgltf_size attr_buffer_size =
+      window_attr ? vertex_count * attr_stride : 0;
+
+  // index ranges are aligned to 4 bytes so uint32 ranges stay aligned
+  cgltf_size *batch_index_offset = ALLOC(batch_count, sizeof(cgltf_size));
+  cgltf_size index_buffer_size = 0;
+  for (guint i = 0; i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    batch_index_offset[i] = index_buffer_size;
+    cgltf_size index_size =
+        b->short_indices ? sizeof(uint16_t) : sizeof(uint32_t);
+    index_buffer_size += b->num_indices * index_size;
+    index_buffer_size = (index_buffer_size + 3) & ~(cgltf_size)3;
+  }
+  const cgltf_size total_buffer_size =
+      vertex_buffer_size + attr_buffer_size + index_buffer_size;
 
   uint8_t *buffer_data = ALLOC(1, total_buffer_size);
 
   // copy vertices (interleaved, already in the right layout)
-  memcpy(buffer_data, vertices->data, vertex_buffer_size);
+  memcpy(buffer_data, out_vertices->data, vertex_buffer_size);
   struct vertex_s *vs = (struct vertex_s *)buffer_data;
   for (guint i = 0; i < vertex_count; i++) {
     vs[i].uvs[0].y = 1.0f - vs[i].uvs[0].y;
     vs[i].uvs[1].y = 1.0f - vs[i].uvs[1].y;
   }
 
-  // flatten indices per material into one big index buffer
-  uint32_t *index_ptr = (uint32_t *)(buffer_data + vertex_buffer_size);
-  cgltf_size running_index_offset = 0;
-
-  // store per-material index ranges
-  cgltf_size *per_mat_index_count = ALLOC(material_count, sizeof(cgltf_size));
-  cgltf_size *per_mat_index_offset = ALLOC(material_count, sizeof(cgltf_size));
+  if (window_attr) {
+    memcpy(buffer_data + vertex_buffer_size, window_attr->data,
+           attr_buffer_size);
+  }
 
-  for (guint i = 0; i < material_count; ++i) {
-    struct mat_s *m = g_ptr_array_index(mats, i);
-    per_mat_index_count[i] = (cgltf_size)m->tris->len * 3;
-    per_mat_index_offset[i] = running_index_offset;
-
-    for (guint t = 0; t < m->tris->len; ++t) {
-      struct tri_s *tri = &m->tris->data[t];
-      index_ptr[running_index_offset++] = tri->v2;
-      index_ptr[running_index_offset++] = tri->v1;
-      index_ptr[running_index_offset++] = tri->v0;
+  // flatten indices per batch into one index buffer
+  uint8_t *index_data = buffer_data + vertex_buffer_size + attr_buffer_size;
+  cgltf_size short_batches = 0;
+  for (guint i = 0; i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    const guint *src = &g_array_index(indices, guint, b->first_index);
+    if (b->short_indices) {
+      uint16_t *dst = (uint16_t *)(index_data + batch_index_offset[i]);
+      for (guint k = 0; k < b->num_indices; ++k) {
+        dst[k] = (uint16_t)src[k];
+      }
+      short_batches++;
+    } else {
+      uint32_t *dst = (uint32_t *)(index_data + batch_index_offset[i]);
+      memcpy(dst, src, b->num_indices * sizeof(uint32_t));
     }
   }
 
@@ -86,53 +327,86 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
   // uri stays NULL for .glb
 
   // -------- 4) BufferViews --------
-  data->buffer_views_count = 2;
-  data->buffer_views = ALLOC(2, sizeof(cgltf_buffer_view));
-
-  // Vertex bufferView (interleaved)
-  cgltf_buffer_view *bv_vertices = &data->buffer_views[0];
-  bv_vertices->buffer = &data->buffers[0];
-  bv_vertices->offset = 0;
-  bv_vertices->size = vertex_buffer_size;
-  bv_vertices->stride = vertex_stride;
-  bv_vertices->type = cgltf_buffer_view_type_vertices;
-  // bv_vertices->target = 34962; // ARRAY_BUFFER
+  // shared vertices, or one vertex window per batch, then the extra
+  // attribute (if any), then indices
+  cgltf_size vertex_view_count = window_vertices ? batch_count : 1;
+  cgltf_size attr_view_count = window_attr ? 1 : 0;
+  data->buffer_views_count = vertex_view_count + attr_view_count + 1;
+  data->buffer_views =
+      ALLOC(data->buffer_views_count, sizeof(cgltf_buffer_view));
+
+  // Vertex bufferViews (interleaved)
+  for (guint i = 0; i < vertex_view_count; ++i) {
+    cgltf_buffer_view *bv_vertices = &data->buffer_views[i];
+    bv_vertices->buffer = &data->buffers[0];
+    if (window_vertices) {
+      struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+      bv_vertices->offset = b->first_vertex * vertex_stride;
+      bv_vertices->size = b->num_vertices * vertex_stride;
+    } else {
+      bv_vertices->offset = 0;
+      bv_vertices->size = vertex_buffer_size;
+    }
+    bv_vertices->stride = vertex_stride;
+    bv_vertices->type = cgltf_buffer_view_type_vertices;
+    // bv_vertices->target = 34962; // ARRAY_BUFFER
+  }
+
+  // Extra attribute bufferView (tightly packed per window vertex)
+  cgltf_buffer_view *bv_attr = NULL;
+  if (window_attr) {
+    bv_attr = &data->buffer_views[vertex_view_count];
+    bv_attr->buffer = &data->buffers[0];
+    bv_attr->offset = vertex_buffer_size;
+    bv_attr->size = attr_buffer_size;
+    bv_attr->type = cgltf_buffer_view_type_vertices;
+  }
 
   // Index bufferView
-  cgltf_buffer_view *bv_indices = &data->buffer_views[1];
+  cgltf_buffer_view *bv_indices =
+      &data->buffer_views[vertex_view_count + attr_view_count];
   bv_indices->buffer = &data->buffers[0];
-  bv_indices->offset = vertex_buffer_size;
+  bv_indices->offset = vertex_buffer_size + attr_buffer_size;
   bv_indices->size = index_buffer_size;
   bv_indices->stride = 0; // tightly packed
   bv_indices->type = cgltf_buffer_view_type_indices;
   // bv_indices->target = 34963; // ELEMENT_ARRAY_BUFFER
 
   // -------- 5) Accessors --------
-  // 0: POSITION
-  // 1: TEXCOORD_0
-  // 2: TEXCOORD_1
-  // 3..(2+material_count): index accessors per material
-  data->accessors_count = 3 + material_count;
+  // per vertex view: POSITION, TEXCOORD_0, TEXCOORD_1
+  // then one index accessor per batch, then one extra attribute accessor per
+  // batch
+  cgltf_size index_accessor_base = 3 * vertex_view_count;
+  cgltf_size attr_accessor_base = index_accessor_base + batch_count;
+  data->accessors_count = attr_accessor_base + (window_attr ? batch_count : 0);
   data->accessors = ALLOC(data->accessors_count, sizeof(cgltf_accessor));
 
-  // POSITION accessor
-  cgltf_accessor *acc_pos = &data->accessors[0];
-  acc_pos->buffer_view = bv_vertices;
-  acc_pos->offset = offsetof(struct vertex_s, position);
-  acc_pos->component_type = cgltf_component_type_r_32f;
-  acc_pos->count = vertex_count;
-  acc_pos->type = cgltf_type_vec3;
-
-  // Optional: compute min/max for POSITION (helps viewers)
-  {
-    if (vertex_count > 0) {
+  for (guint i = 0; i < vertex_view_count; ++i) {
+    cgltf_buffer_view *bv_vertices = &data->buffer_views[i];
+    cgltf_size count = bv_vertices->size / vertex_stride;
+
+    // POSITION accessor
+    cgltf_accessor *acc_pos = &data->accessors[3 * i + 0];
+    acc_pos->buffer_view = bv_vertices;
+    acc_pos->offset = offsetof(struct vertex_s, position);
+    acc_pos->component_type = cgltf_component_type_r_32f;
+    acc_pos->count = count;
+    acc_pos->type = cgltf_type_vec3;
+
+    // min/max for POSITION (helps viewers, required by the spec)
+    if (window_vertices) {
+      struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+      acc_pos->has_min = acc_pos->has_max = 1;
+      memcpy(acc_pos->min, b->min.xyz, sizeof(b->min.xyz));
+      memcpy(acc_pos->max, b->max.xyz, sizeof(b->max.xyz));
+    } else if (count > 0) {
       struct vertex_s *v0 = &g_array_index(vertices, struct vertex_s, 0);
       struct vec3_s min =
           vec3_set(v0->position.x, v0->position.y, v0->position.z);
       struct vec3_s max =
           vec3_set(v0->position.x, v0->position.y, v0->position.z);
-      for (guint i = 1; i < vertex_count; ++i) {
-        struct vertex_s *v = &g_array_index(vertices, struct vertex_s, i);
+      for (guint k = 1; k < count; ++k) {
+        struct vertex_s *v = &g_array_index(vertices, struct vertex_s, k);
         struct vec3_s p = vec3_set(v->position.x, v->position.y, v->position.z);
         min = vec3_min(min, p);
         max = vec3_max(max, p);
@@ -141,64 +415,145 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
       memcpy(acc_pos->min, min.xyz, sizeof(min.xyz));
       memcpy(acc_pos->max, max.xyz, sizeof(max.xyz));
     }
+
+    // TEXCOORD_0 (diffuse UVs)
+    cgltf_accessor *acc_uv0 = &data->accessors[3 * i + 1];
+    acc_uv0->buffer_view = bv_vertices;
+    acc_uv0->offset = offsetof(struct vertex_s, uvs[0]);
+    acc_uv0->component_type = cgltf_component_type_r_32f;
+    acc_uv0->count = count;
+    acc_uv0->type = cgltf_type_vec2;
+    acc_uv0->normalized = 0;
+
+    // TEXCOORD_1 (lightmap UVs)
+    cgltf_accessor *acc_uv1 = &data->accessors[3 * i + 2];
+    acc_uv1->buffer_view = bv_vertices;
+    acc_uv1->offset = offsetof(struct vertex_s, uvs[1]);
+    acc_uv1->component_type = cgltf_component_type_r_32f;
+    acc_uv1->count = count;
+    acc_uv1->type = cgltf_type_vec2;
+    acc_uv1->normalized = 0;
   }
 
-  // TEXCOORD_0 (diffuse UVs)
-  cgltf_accessor *acc_uv0 = &data->accessors[1];
-  acc_uv0->buffer_view = bv_vertices;
-  acc_uv0->offset = offsetof(struct vertex_s, uvs[0]);
-  acc_uv0->component_type = cgltf_component_type_r_32f;
-  acc_uv0->count = vertex_count;
-  acc_uv0->type = cgltf_type_vec2;
-  acc_uv0->normalized = 0;
-
-  // TEXCOORD_1 (lightmap UVs)
-  cgltf_accessor *acc_uv1 = &data->accessors[2];
-  acc_uv1->buffer_view = bv_vertices;
-  acc_uv1->offset = offsetof(struct vertex_s, uvs[1]);
-  acc_uv1->component_type = cgltf_component_type_r_32f;
-  acc_uv1->count = vertex_count;
-  acc_uv1->type = cgltf_type_vec2;
-  acc_uv1->normalized = 0;
-
-  // Index accessors: one per material
-  for (guint i = 0; i < material_count; ++i) {
-    cgltf_accessor *acc = &data->accessors[3 + i];
+  // Index accessors: one per batch
+  for (guint i = 0; i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    cgltf_accessor *acc = &data->accessors[index_accessor_base + i];
     acc->buffer_view = bv_indices;
-    acc->component_type = cgltf_component_type_r_32u; // UNSIGNED_INT
+    acc->component_type = b->short_indices
+                              ? cgltf_component_type_r_16u  // UNSIGNED_SHORT
+                              : cgltf_component_type_r_32u; // UNSIGNED_INT
     acc->type = cgltf_type_scalar;
-    acc->count = per_mat_index_count[i];
-    acc->offset = per_mat_index_offset[i] * sizeof(uint32_t);
+    acc->count = b->num_indices;
+    acc->offset = batch_index_offset[i];
+  }
+
+  // Extra attribute accessors: one per batch, over its vertex window
+  for (guint i = 0; window_attr && i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    cgltf_accessor *acc = &data->accessors[attr_accessor_base + i];
+    acc->buffer_view = bv_attr;
+    acc->component_type = cgltf_component_type_r_32f;
+    acc->type = attr_components == 4 ? cgltf_type_vec4 : cgltf_type_scalar;
+    acc->count = b->num_vertices;
+    acc->offset = b->first_vertex * attr_stride;
   }
 
   // -------- 6) Materials --------
-  data->materials_count = material_count;
-  data->materials = ALLOC(material_count, sizeof(cgltf_material));
+  // with lightmap occlusion every material has a variant per lightmap page,
+  // page p's variants at [p * material_count, (p + 1) * material_count)
+  guint lightmap_count = opts->lightmap_occlusion ? num_pages : 0;
+  guint variant_count = MAX(lightmap_count, 1);
+  data->materials_count = material_count * variant_count;
+  data->materials = ALLOC(data->materials_count, sizeof(cgltf_material));
 
   // Create images and textures for materials (diffuse PNGs at
-  // export/textures/<name>.png)
-  data->images_count = material_count;
-  data->images = ALLOC(material_count, sizeof(cgltf_image));
-  data->textures_count = material_count;
-  data->textures = ALLOC(material_count, sizeof(cgltf_texture));
+  // export/textures/<name>.png), followed by the lightmap pages. The texture
+  // array of untextured materials (0x0) is never written, so it gets none.
+  guint *diffuse_texture = g_new(guint, material_count);
+  guint diffuse_count = 0;
+  for (guint i = 0; i < material_count; ++i) {
+    const struct tex_array_s *array =
+        use_arrays ? &g_array_index(mesh->tex_arrays, struct tex_array_s, i)
+                   : NULL;
+    gboolean untextured = array && (array->width == 0 || array->height == 0);
+    diffuse_texture[i] = untextured ? G_MAXUINT : diffuse_count++;
+  }
+  data->images_count = diffuse_count + lightmap_count;
+  data->images = ALLOC(data->images_count, sizeof(cgltf_image));
+  data->textures_count = diffuse_count + lightmap_count;
+  data->textures = ALLOC(data->textures_count, sizeof(cgltf_texture));
+  for (guint p = 0; p < lightmap_count; ++p) {
+    cgltf_image *img = &data->images[diffuse_count + p];
+    img->uri = ALLOC(1, 32);
+    if (p == 0) {
+      g_snprintf(img->uri, 32, "lightmap.png");
+    } else {
+      g_snprintf(img->uri, 32, "lightmap_%u.png", p);
+    }
+    data->textures[diffuse_count + p].image = img;
+  }
   // Register KHR_materials_unlit so materials render as pure albedo (no
   // lighting)
   data->extensions_used_count = 1;
   data->extensions_used = ALLOC(1, sizeof(char *));
   data->extensions_used[0] = "KHR_materials_unlit";
 
-  for (guint i = 0; i < material_count; ++i) {
-    cgltf_material *mat = &data->materials[i];
-    struct mat_s *src = g_ptr_array_index(mats, i);
+  for (guint v = 0; v < data->materials_count; ++v) {
+    guint i = v % material_count, page = v / material_count;
+    cgltf_material *mat = &data->materials[v];
     mat->name = ALLOC(1, 256);
-    strncpy(mat->name, src->name, 255);
+    if (use_atlas) {
+      // atlas written by export_diffuse_atlas
+      const struct diffuse_atlas_s *atlas = mesh->diffuse_atlas;
+      g_snprintf(mat->name, 256, "atlas");
+      mat->extras.data = ALLOC(1, 128);
+      g_snprintf(mat->extras.data, 128,
+                 "{\"width\":%u,\"height\":%u,\"gutter\":%u,"
+                 "\"mip_levels\":%u}",
+                 atlas->width, atlas->height, atlas->gutter,
+                 atlas->mip_levels);
+    } else if (use_arrays) {
+      // texture array strip written by export_texture_arrays, layers listed
+      // in the material extras
+      const struct tex_array_s *array =
+          &g_array_index(mesh->tex_arrays, struct tex_array_s, i);
+      g_snprintf(mat->name, 256, "array_%ux%u", array->width, array->height);
+      GString *extras = g_string_new(NULL);
+      g_string_append_printf(extras,
+                             "{\"layer_width\":%u,\"layer_height\":%u,"
+                             "\"layers\":[",
+                             array->width, array->height);
+      for (guint j = 0; j < array->num_layers; ++j) {
+        struct mat_s *src = g_ptr_array_index(mats, array->mats[j]);
+        g_string_append_printf(extras, "%s\"%s\"", j ? "," : "", src->name);
+      }
+      g_string_append(extras, "]}");
+      mat->extras.data = ALLOC(1, extras->len + 1);
+      memcpy(mat->extras.data, extras->str, extras->len);
+      g_string_free(extras, TRUE);
+    } else {
+      struct mat_s *src = g_ptr_array_index(mats, i);
+      strncpy(mat->name, src->name, 255);
+    }
     // Wire a simple diffuse texture using the material name ->
     // export/textures/<name>.png
-    cgltf_image *img = &data->images[i];
-    cgltf_texture *tex = &data->textures[i];
-    img->uri = ALLOC(1, 128);
-    g_snprintf(img->uri, 128, "export/textures/%s.png", src->name);
-    tex->image = img;
+    guint t = diffuse_texture[i];
+    cgltf_texture *tex = t != G_MAXUINT ? &data->textures[t] : NULL;
+    if (page > 0) {
+      gsize len = strlen(mat->name);
+      g_snprintf(mat->name + len, 256 - len, "@lightmap_%u", page);
+    } else if (tex) {
+      cgltf_image *img = &data->images[t];
+      img->uri = ALLOC(1, 300);
+      g_snprintf(img->uri, 300, "export/textures/%s.png", mat->name);
+      tex->image = img;
+    }
+    if (lightmap_count > 0) {
+      mat->occlusion_texture.texture = &data->textures[diffuse_count + page];
+      mat->occlusion_texture.texcoord = 1;
+      mat->occlusion_texture.scale = 1.0f;
+    }
     // Hook into the material's baseColorTexture (simple diffuse)
     mat->pbr_metallic_roughness.base_color_texture.texture = tex;
     mat->pbr_metallic_roughness.base_color_texture.texcoord = 0;
@@ -222,42 +577,97 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
     mat->extensions[0].name = "KHR_materials_unlit";
     mat->extensions[0].data = NULL;
   }
+  g_free(diffuse_texture);
+
+  // -------- 7) Meshes (one per chunk) + primitives (one per batch) --------
+  data->meshes_count = chunk_count;
+  data->meshes = ALLOC(chunk_count, sizeof(cgltf_mesh));
+  for (guint i = 0; i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    data->meshes[b->chunk_index].primitives_count++;
+  }
+  for (guint c = 0; c < chunk_count; ++c) {
+    data->meshes[c].primitives = ALLOC(MAX(data->meshes[c].primitives_count, 1),
+                                       sizeof(cgltf_primitive));
+    data->meshes[c].primitives_count = 0;
+  }
 
-  // -------- 7) Mesh + primitives (one per material) --------
-  data->meshes_count = 1;
-  data->meshes = ALLOC(1, sizeof(cgltf_mesh));
-  cgltf_mesh *gltf_mesh = &data->meshes[0];
-
-  gltf_mesh->primitives_count = material_count;
-  gltf_mesh->primitives = ALLOC(material_count, sizeof(cgltf_primitive));
-
-  for (guint i = 0; i < material_count; ++i) {
-    cgltf_primitive *prim = &gltf_mesh->primitives[i];
+  for (guint i = 0; i < batch_count; ++i) {
+    struct prim_batch_s *b = &g_array_index(batches, struct prim_batch_s, i);
+    cgltf_mesh *gltf_mesh = &data->meshes[b->chunk_index];
+    cgltf_primitive *prim =
+        &gltf_mesh->primitives[gltf_mesh->primitives_count++];
+    cgltf_accessor *vertex_accessors =
+        &data->accessors[window_vertices ? 3 * i : 0];
 
     prim->type = cgltf_primitive_type_triangles;
-    prim->material = &data->materials[i];
-    prim->indices = &data->accessors[3 + i];
+    prim->material =
+        &data->materials[(lightmap_count > 0 ? b->page * material_count : 0) +
+                         b->mat_index];
+    prim->indices = &data->accessors[index_accessor_base + i];
+    if (num_pages > 1) {
+      prim->extras.data = ALLOC(1, 32);
+      g_snprintf(prim->extras.data, 32, "{\"lightmap_page\":%u}", b->page);
+    }
 
-    prim->attributes_count = 3;
-    prim->attributes = ALLOC(3, sizeof(cgltf_attribute));
+    prim->attributes_count = window_attr ? 4 : 3;
+    prim->attributes = ALLOC(prim->attributes_count, sizeof(cgltf_attribute));
 
     prim->attributes[0].name = "POSITION";
-    prim->attributes[0].data = acc_pos;
+    prim->attributes[0].data = &vertex_accessors[0];
     prim->attributes[0].type = cgltf_attribute_type_position;
 
     prim->attributes[1].name = "TEXCOORD_0";
-    prim->attributes[1].data = acc_uv0;
+    prim->attributes[1].data = &vertex_accessors[1];
     prim->attributes[1].type = cgltf_attribute_type_texcoord;
 
     prim->attributes[2].name = "TEXCOORD_1";
-    prim->attributes[2].data = acc_uv1;
+    prim->attributes[2].data = &vertex_accessors[2];
     prim->attributes[2].type = cgltf_attribute_type_texcoord;
+
+    if (window_attr) {
+      prim->attributes[3].name = (char *)attr_name;
+      prim->attributes[3].data = &data->accessors[attr_accessor_base + i];
+      prim->attributes[3].type = cgltf_attribute_type_custom;
+    }
   }
 
-  // -------- 8) Node --------
-  data->nodes_count = 1;
-  data->nodes = ALLOC(1, sizeof(cgltf_node));
-  data->nodes[0].mesh = gltf_mesh;
+  // -------- 8) Nodes --------
+  // unchunked: a single node holding the mesh
+  // chunked: a root node (scale) with one child node per chunk; brush model
+  // chunks are named after the entity model key ("*1"), the world is either
+  // its grid cells or a single "world" node
+  data->nodes_count = mesh->chunks->len > 0 ? 1 + chunk_count : 1;
+  data->nodes = ALLOC(data->nodes_count, sizeof(cgltf_node));
+  if (mesh->chunks->len > 0) {
+    data->nodes[0].children_count = chunk_count;
+    data->nodes[0].children = ALLOC(chunk_count, sizeof(cgltf_node *));
+    for (guint c = 0; c < chunk_count; ++c) {
+      const struct mesh_chunk_s *chunk =
+          &g_array_index(mesh->chunks, struct mesh_chunk_s, c);
+      cgltf_node *node = &data->nodes[1 + c];
+      node->name = ALLOC(1, 64);
+      if (chunk->model_id > 0) {
+        g_snprintf(node->name, 64, "*%u", chunk->model_id);
+      } else if (mesh->chunk_size > 0.0f) {
+        g_snprintf(node->name, 64, "chunk_%d_%d_%d", chunk->cell[0],
+                   chunk->cell[1], chunk->cell[2]);
+      } else {
+        g_strlcpy(node->name, "world", 64);
+      }
+      node->mesh = &data->meshes[c];
+      node->parent = &data->nodes[0];
+      node->extras.data = ALLOC(1, 256);
+      g_snprintf(node->extras.data, 256,
+                 "{\"model\":%u,\"aabb_min\":[%g,%g,%g],"
+                 "\"aabb_max\":[%g,%g,%g]}",
+                 chunk->model_id, chunk->min.x, chunk->min.y, chunk->min.z,
+                 chunk->max.x, chunk->max.y, chunk->max.z);
+      data->nodes[0].children[c] = node;
+    }
+  } else {
+    data->nodes[0].mesh = &data->meshes[0];
+  }
   data->nodes[0].has_translation = 1;
   data->nodes[0].has_scale = 1;
   data->nodes[0].translation[0] = 0.0f;
@@ -275,6 +685,11 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
   data->scenes[0].nodes_count = 1;
   data->scene = 0;
 
+  g_print("glTF: %u primitives (%u with uint16 indices), %u vertices, %u "
+          "index bytes\n",
+          (guint)batch_count, (guint)short_batches, (guint)vertex_count,
+          (guint)index_buffer_size);
+
   // -------- 10) Write file --------
   cgltf_result res = cgltf_write_file(&options, output_path, data);
   if (res != cgltf_result_success) {
@@ -290,4 +705,12 @@ void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
     g_free(allocs[i]);
   }
   g_free(allocs);
-}
\ No newline at end of file
+  g_array_free(batches, TRUE);
+  g_array_free(indices, TRUE);
+  if (window_vertices) {
+    g_array_free(window_vertices, TRUE);
+  }
+  if (window_attr) {
+    g_array_free(window_attr, TRUE);
+  }
+}
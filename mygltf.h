@@ -5,6 +5,22 @@
 
 #include "mesh.h"
 
+struct gltf_opts_s {
+  // remap each primitive into its own vertex window and use uint16 indices,
+  // splitting primitives that reference more than 65535 vertices
+  gboolean compact_indices;
+  // one primitive per texture array (resolution class) instead of per
+  // material, with the layer in a _TEXLAYER vertex attribute
+  gboolean texture_arrays;
+  // single material over the diffuse atlas (see build_diffuse_atlas), with
+  // each vertex's atlas rect in an _ATLASRECT attribute
+  gboolean diffuse_atlas;
+  // lightmap atlas pages (lightmap.png, lightmap_<page>.png) as the
+  // materials' occlusionTexture on TEXCOORD_1, one material per page
+  gboolean lightmap_occlusion;
+};
+
 void export_mesh_to_gltf(const struct mesh_s *mesh, gfloat scale,
+                         const struct gltf_opts_s *opts,
                          const gchar *output_path, GError **err);
 #endif // _MYGLTF_
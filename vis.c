@@ -0,0 +1,132 @@
+#include "vis.h"
+#include <string.h>
+
+// Quake's run-length encoding: a zero byte is followed by the number of zero
+// bytes it stands for, any other byte is literal.
+static void decompress_vis_row(const guchar *in, const guchar *end,
+                               guint row_bytes, guint8 *out) {
+  guint n = 0;
+  while (n < row_bytes && in < end) {
+    if (*in) {
+      out[n++] = *in++;
+      continue;
+    }
+    guint count = in + 1 < end ? in[1] : 0;
+    in += 2;
+    while (count-- > 0 && n < row_bytes) {
+      out[n++] = 0;
+    }
+  }
+}
+
+void build_vis(struct vis_s *vis, const gchar *buf,
+               const struct header_s *header, const struct model_s *world) {
+  const struct leaf_s *leaves =
+      (const struct leaf_s *)(buf + header->leaves.offset);
+  guint num_bsp_leaves = header->leaves.size / sizeof(struct leaf_s);
+  const guint16 *faces_list =
+      (const guint16 *)(buf + header->faces_list.offset);
+  guint faces_list_len = header->faces_list.size / sizeof(guint16);
+  const guchar *visdata = (const guchar *)buf + header->visilist.offset;
+  const guchar *visend = visdata + header->visilist.size;
+
+  vis->num_leaves = MIN(world->numleaves, MAX(num_bsp_leaves, 1) - 1);
+  vis->words_per_row = (vis->num_leaves + 63) >> 6;
+  guint row_bytes = (vis->num_leaves + 7) >> 3;
+  vis->bits = g_new0(guint64, (gsize)vis->num_leaves * vis->words_per_row);
+
+  guint8 *row = g_new(guint8, vis->words_per_row * sizeof(guint64));
+  guint64 num_visible = 0;
+  for (guint leaf = 1; leaf <= vis->num_leaves; leaf++) {
+    memset(row, 0, vis->words_per_row * sizeof(guint64));
+    if (header->visilist.size == 0 || leaves[leaf].vislist < 0) {
+      // no vis info, everything is visible
+      memset(row, 0xff, row_bytes);
+    } else {
+      decompress_vis_row(visdata + leaves[leaf].vislist, visend, row_bytes,
+                         row);
+    }
+    guint64 *dst = vis->bits + (gsize)(leaf - 1) * vis->words_per_row;
+    for (guint w = 0; w < vis->words_per_row; w++) {
+      guint64 word = 0;
+      for (guint b = 0; b < 8; b++) {
+        word |= (guint64)row[w * 8 + b] << (8 * b);
+      }
+      dst[w] = word;
+    }
+    if (vis->num_leaves & 63) {
+      dst[vis->words_per_row - 1] &= (1ull << (vis->num_leaves & 63)) - 1;
+    }
+    for (guint w = 0; w < vis->words_per_row; w++) {
+      num_visible += __builtin_popcountll(dst[w]);
+    }
+  }
+  g_free(row);
+
+  // marked faces per leaf, as indices into the world mesh polys
+  GArray *faces = g_array_new(FALSE, FALSE, sizeof(guint));
+  vis->face_offsets = g_new(guint, vis->num_leaves + 1);
+  for (guint leaf = 1; leaf <= vis->num_leaves; leaf++) {
+    const struct leaf_s *l = &leaves[leaf];
+    vis->face_offsets[leaf - 1] = faces->len;
+    for (guint k = 0; k < l->lface_num; k++) {
+      guint idx = l->lface_id + k;
+      if (idx >= faces_list_len) {
+        break;
+      }
+      guint face_id = faces_list[idx];
+      if (face_id < world->face_id ||
+          face_id >= world->face_id + world->face_num) {
+        continue;
+      }
+      guint poly_idx = face_id - world->face_id;
+      g_array_append_val(faces, poly_idx);
+    }
+  }
+  vis->face_offsets[vis->num_leaves] = faces->len;
+  guint num_faces = faces->len;
+  vis->faces = (guint *)g_array_free(faces, FALSE);
+
+  g_print("PVS: %u leaves, %u words per row, %.1f visible leaves per leaf, "
+          "%u marked faces\n",
+          vis->num_leaves, vis->words_per_row,
+          vis->num_leaves ? (gdouble)num_visible / vis->num_leaves : 0.0,
+          num_faces);
+}
+
+gboolean export_vis(const struct vis_s *vis, const gchar *path,
+                    GError **err) {
+  guint num_faces = vis->face_offsets[vis->num_leaves];
+  gsize bits_size =
+      (gsize)vis->num_leaves * vis->words_per_row * sizeof(guint64);
+  gsize offsets_size = (vis->num_leaves + 1) * sizeof(guint32);
+  gsize faces_size = num_faces * sizeof(guint32);
+  gsize size = 4 * sizeof(guint32) + bits_size + offsets_size + faces_size;
+
+  guint8 *data = g_malloc(size);
+  guint32 *head = (guint32 *)data;
+  head[0] = VIS_MAGIC;
+  head[1] = vis->num_leaves;
+  head[2] = vis->words_per_row;
+  head[3] = num_faces;
+  guint8 *ptr = data + 4 * sizeof(guint32);
+  memcpy(ptr, vis->bits, bits_size);
+  ptr += bits_size;
+  memcpy(ptr, vis->face_offsets, offsets_size);
+  ptr += offsets_size;
+  memcpy(ptr, vis->faces, faces_size);
+
+  gboolean ok = g_file_set_contents(path, (const gchar *)data, size, err);
+  g_free(data);
+  return ok;
+}
+
+void free_vis(struct vis_s *vis) {
+  g_free(vis->bits);
+  g_free(vis->face_offsets);
+  g_free(vis->faces);
+  vis->bits = NULL;
+  vis->face_offsets = NULL;
+  vis->faces = NULL;
+  vis->num_leaves = 0;
+}
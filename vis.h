@@ -0,0 +1,47 @@
+#ifndef _VIS_
+#define _VIS_
+
+#include "bsp.h"
+#include <glib.h>
+
+/*
+ * Potentially visible sets of the world model.
+ *
+ * Quake 1 has no clusters: every non-solid leaf is its own cluster. Leaf 0 is
+ * the shared solid leaf and has no PVS, so row r and bit b both refer to leaf
+ * r + 1 / b + 1. Rows are padded to whole 64-bit words.
+ *
+ * vis.bin layout (little endian):
+ *   guint32 magic ('PVS1'), num_leaves, words_per_row, num_faces
+ *   guint64 bits[num_leaves * words_per_row]
+ *   guint32 face_offsets[num_leaves + 1]  // into faces, per leaf
+ *   guint32 faces[num_faces]              // mesh poly indices
+ */
+
+#define VIS_MAGIC 0x31535650 // "PVS1"
+
+struct vis_s {
+  guint num_leaves;    // leaves with a PVS (world model numleaves)
+  guint words_per_row; // 64-bit words per bitset row
+  guint64 *bits;       // num_leaves rows of words_per_row words
+  guint *face_offsets; // num_leaves + 1 offsets into faces
+  guint *faces;        // mesh poly indices marked in each leaf
+};
+
+static inline const guint64 *vis_row(const struct vis_s *vis, guint leaf) {
+  return vis->bits + (gsize)(leaf - 1) * vis->words_per_row;
+}
+
+static inline gboolean vis_leaf_visible(const struct vis_s *vis, guint from,
+                                        guint to) {
+  const guint64 *row = vis_row(vis, from);
+  return (row[(to - 1) >> 6] >> ((to - 1) & 63)) & 1;
+}
+
+extern void build_vis(struct vis_s *vis, const gchar *buf,
+                      const struct header_s *header, const struct model_s *world);
+extern gboolean export_vis(const struct vis_s *vis, const gchar *path,
+                           GError **err);
+extern void free_vis(struct vis_s *vis);
+
+#endif // _VIS_